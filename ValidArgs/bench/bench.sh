@@ -0,0 +1,141 @@
+#!/bin/sh
+#
+# Macro benchmarks: rewrites generated workloads of increasing size and reports,
+# for each, the steps and rule applications per second of rewriting time, the
+# number of terms allocated, and the peak memory of the process, as given by
+# "reverki -r --stats-format=json".
+#
+# Usage: bench/bench.sh [PROGRAM [WORKLOAD...]]
+# The workloads are peano, church, ski, algebra and rules (all by default).
+# The sizes of each workload can be changed by setting, for example,
+# PEANO_SIZES="10 20".
+
+PROGRAM=${1:-bin/reverki}
+[ $# -gt 0 ] && shift
+WORKLOADS=${*:-peano church ski algebra rules}
+
+PEANO_SIZES=${PEANO_SIZES:-"10 20 30"}
+CHURCH_SIZES=${CHURCH_SIZES:-"3 4 5"}
+SKI_SIZES=${SKI_SIZES:-"2 3 4"}
+ALGEBRA_SIZES=${ALGEBRA_SIZES:-"4 5 6"}
+RULES_SIZES=${RULES_SIZES:-"250 500 1000"}
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/reverki-bench.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+# Peano arithmetic: the product of two numerals N, by repeated addition
+peano() {
+    awk -v n="$1" 'BEGIN {
+        print "[(+ x 0), x]"
+        print "[(+ x (S y)), (S (+ x y))]"
+        print "[(* x 0), 0]"
+        print "[(* x (S y)), (+ (* x y) x)]"
+        num = "0"
+        for(i = 0; i < n; i++) num = "(S " num ")"
+        print "(* " num " " num ")"
+    }'
+}
+
+# Church numerals as combinators: N! applications of F to X, computed as the
+# composition (B) of the numerals N, ..., 1, where n is (S B)^n (K I)
+church() {
+    awk -v n="$1" 'BEGIN {
+        print "[(I x), x]"
+        print "[(K x y), x]"
+        print "[(S x y z), (x z (y z))]"
+        print "[(B x y z), (x (y z))]"
+        num = "(K I)"
+        for(i = 1; i <= n; i++) {
+            num = "(S B " num ")"
+            product = i == 1 ? num : "(B " num " " product ")"
+        }
+        print "(" product " F X)"
+    }'
+}
+
+# Numerals in S, K and I alone: 2^N applications of F to X, computed by
+# applying the numeral N (iterated successor S (S (K S) K) on K I) to 2
+ski() {
+    awk -v n="$1" 'BEGIN {
+        print "[(I x), x]"
+        print "[(K x y), x]"
+        print "[(S x y z), (x z (y z))]"
+        succ = "(S (S (K S) K))"
+        num = "(K I)"
+        for(i = 0; i < n; i++) num = "(" succ " " num ")"
+        two = "(" succ " (" succ " (K I)))"
+        print "(" num " " two " F X)"
+    }'
+}
+
+# Normalization of the polynomial (A + B)^N with the rules of rsrc/algebra
+algebra() {
+    awk -v n="$1" 'BEGIN {
+        print "[(+ x 0), x]"
+        print "[(+ 0 x), x]"
+        print "[(+ (+ x y) z), (+ x (+ y z))]"
+        print "[(* x 0), 0]"
+        print "[(* 0 x), 0]"
+        print "[(* x 1), x]"
+        print "[(* 1 x), x]"
+        print "[(* (* x y) z), (* x (* y z))]"
+        print "[(* x (+ y z)), (+ (* x y) (* x z))]"
+        print "[(* (+ x y) z), (+ (* x z) (* y z))]"
+        term = "(+ A B)"
+        for(i = 1; i < n; i++) term = "(* (+ A B) " term ")"
+        print term
+    }'
+}
+
+# N pairs of rules, each used once, on a balanced tree with N leaves
+rules() {
+    awk -v n="$1" 'BEGIN {
+        for(i = 1; i <= n; i++) {
+            print "[(F C" i " x), (G x C" i ")]"
+            print "[(G x C" i "), (H" i " x)]"
+        }
+        for(i = 1; i <= n; i++) level[i] = "(F C" i " Z)"
+        for(count = n; count > 1; count = used) {
+            used = 0
+            for(i = 1; i <= count; i += 2) {
+                level[++used] = i < count ? "(P " level[i] " " level[i + 1] ")" : level[i]
+            }
+        }
+        print level[1]
+    }'
+}
+
+# Extracts a number from the JSON statistics
+field() {
+    sed -n "s/.*\"$1\": \([0-9.e+-]*\).*/\1/p" "$DIR/stats"
+}
+
+printf "%-8s %6s %10s %10s %10s %12s %12s %12s %10s\n" \
+       workload size steps rewrites "rewrite s" "steps/s" "rewrites/s" allocated "peak KiB"
+for workload in $WORKLOADS; do
+    case $workload in
+        peano) sizes=$PEANO_SIZES ;;
+        church) sizes=$CHURCH_SIZES ;;
+        ski) sizes=$SKI_SIZES ;;
+        algebra) sizes=$ALGEBRA_SIZES ;;
+        rules) sizes=$RULES_SIZES ;;
+        *) echo "Unknown workload $workload" >&2; exit 1 ;;
+    esac
+    for size in $sizes; do
+        $workload "$size" > "$DIR/input"
+        if ! "$PROGRAM" -r --stats-format=json < "$DIR/input" > /dev/null 2> "$DIR/stats"; then
+            echo "$workload $size failed:" >&2
+            cat "$DIR/stats" >&2
+            exit 1
+        fi
+        steps=$(field steps)
+        seconds=$(field rewrite)
+        rewrites=$(grep -o '"fired": [0-9]*' "$DIR/stats" | awk '{ s += $2 } END { print s + 0 }')
+        awk -v w="$workload" -v n="$size" -v steps="$steps" -v rewrites="$rewrites" -v t="$seconds" \
+            -v alloc="$(field allocated)" -v peak="$(field peak_memory_kib)" 'BEGIN {
+            t = t > 0 ? t : 1e-6
+            printf "%-8s %6d %10d %10d %10.4f %12.0f %12.0f %12d %10d\n",
+                   w, n, steps, rewrites, t, steps / t, rewrites / t, alloc, peak
+        }'
+    done
+done
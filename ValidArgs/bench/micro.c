@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "reverki.h"
+#include "global.h"
+#include "debug.h"
+#include "write.h"
+
+/*
+ * Micro-benchmarks of the primitives, each timed alone on synthetic terms of
+ * controlled size and depth: balanced trees, whose depth grows with the log of
+ * their size, and left spines such as (C0 C1 ... Cn), whose depth is their
+ * length.  Each benchmark is run once to warm up (which also creates the atoms
+ * and terms it needs), calibrated by doubling the number of operations until a
+ * run takes MICRO_MIN_TIME, and then repeated MICRO_REPETITIONS times.  The
+ * fastest and the median time per operation are reported, together with the
+ * calls made to malloc, calloc and realloc from the program itself, which are
+ * counted by wrapping those functions at link time, and the terms created.
+ * After the warm-up these are nothing for most primitives, so apply is also
+ * run cold, with each variable bound to a term that is new at each operation.
+ *
+ * The names of primitives given as arguments restrict the benchmarks to those.
+ */
+#define MICRO_MIN_TIME 0.01
+#define MICRO_REPETITIONS 7
+
+static unsigned long heapAllocations = 0;
+
+// Arguments of the operation being measured, and a sink for its results
+static REVERKI_TERM *subject;
+static REVERKI_TERM *other;
+static FILE *stream;
+static REVERKI_SUBST subst;
+static volatile long sink;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    heapAllocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    heapAllocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    heapAllocations++;
+    return __real_realloc(ptr, size);
+}
+
+/**
+ * @brief returns the atom term with a name made of a prefix and a number
+ *
+ * @param prefix The prefix, which starts with a lower-case letter for a variable
+ * @param n The number
+ * @return REVERKI_TERM* The term
+ */
+static REVERKI_TERM *numberedAtom(char *prefix, int n) {
+    char pname[REVERKI_PNAME_BUFFER_SIZE];
+    snprintf(pname, sizeof(pname), "%s%d", prefix, n);
+    REVERKI_ATOM *atom = reverki_intern_atom(pname);
+    if(atom == NULL) {
+        abort();
+    }
+    return atom->type == REVERKI_VARIABLE_TYPE ? reverki_make_variable(atom) : reverki_make_constant(atom);
+}
+
+/**
+ * @brief builds a balanced tree whose leaves are atoms numbered from left to
+ * right
+ *
+ * @param depth The depth of the tree
+ * @param prefix The prefix of the names of the leaves
+ * @param next By-reference number of the next leaf
+ * @return REVERKI_TERM* The tree
+ */
+static REVERKI_TERM *balancedTerm(int depth, char *prefix, int *next) {
+    if(depth == 0) {
+        return numberedAtom(prefix, (*next)++);
+    }
+    REVERKI_TERM *fst = balancedTerm(depth - 1, prefix, next);
+    return reverki_make_pair(fst, balancedTerm(depth - 1, prefix, next));
+}
+
+/**
+ * @brief builds the left spine (P0 P1 ... Pn) for a prefix P
+ *
+ * @param length The number n of pairs, which is also the depth
+ * @param prefix The prefix of the names of the atoms
+ * @return REVERKI_TERM* The spine
+ */
+static REVERKI_TERM *spineTerm(int length, char *prefix) {
+    REVERKI_TERM *term = numberedAtom(prefix, 0);
+    for(int i = 1; i <= length; i++) {
+        term = reverki_make_pair(term, numberedAtom(prefix, i));
+    }
+    return term;
+}
+
+/**
+ * @brief opens a stream from which the text of a term can be read
+ *
+ * @param term The term
+ * @param textp By-reference text, to be freed after the stream is closed
+ * @return FILE* The stream
+ */
+static FILE *termStream(REVERKI_TERM *term, char **textp) {
+    size_t size;
+    FILE *out = open_memstream(textp, &size);
+    if(out == NULL || reverki_unparse_term(term, out) || fclose(out) ||
+       (out = fmemopen(*textp, size, "r")) == NULL) {
+        fprintf(stderr, "Could not make text of term\n");
+        abort();
+    }
+    return out;
+}
+
+static void opParseAtom(long count) {
+    for(long i = 0; i < count; i++) {
+        rewind(stream);
+        sink = (long)reverki_parse_atom(stream);
+    }
+}
+
+static void opParseTerm(long count) {
+    for(long i = 0; i < count; i++) {
+        rewind(stream);
+        sink = (long)reverki_parse_term(stream);
+    }
+}
+
+static void opCompareTerm(long count) {
+    for(long i = 0; i < count; i++) {
+        sink = reverki_compare_term(subject, other);
+    }
+}
+
+static void opMatch(long count) {
+    for(long i = 0; i < count; i++) {
+        subst.count = 0;
+        sink = reverki_match(subject, other, &subst);
+    }
+}
+
+static void opApply(long count) {
+    for(long i = 0; i < count; i++) {
+        sink = (long)reverki_apply(&subst, subject);
+    }
+}
+
+static void opApplyFresh(long count) {
+    for(long i = 0; i < count; i++) {
+        // Each binding is extended by a pair, so every pair of the instance is new
+        for(int j = 0; j < subst.count; j++) {
+            *(subst.values + j) = reverki_make_pair(*(subst.values + j), other);
+        }
+        sink = (long)reverki_apply(&subst, subject);
+    }
+}
+
+static void opUnparseTerm(long count) {
+    for(long i = 0; i < count; i++) {
+        sink = reverki_unparse_term(subject, stream);
+    }
+}
+
+/**
+ * @brief returns whether a primitive was selected by the arguments, all being
+ * selected if there are none
+ *
+ * @param name The name of the primitive
+ * @param argc The number of arguments, including the name of the program
+ * @param argv The arguments
+ * @return int Nonzero if it was selected
+ */
+static int selected(char *name, int argc, char **argv) {
+    if(argc == 1) {
+        return 1;
+    }
+    for(int i = 1; i < argc; i++) {
+        if(equalStrings(*(argv + i), name)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief times an operation and prints a line of results for it
+ *
+ * @param name The name of the primitive
+ * @param shape A description of the term or terms operated on
+ * @param size The size of the term
+ * @param depth The depth of the term
+ * @param op The function that performs the operation a number of times
+ */
+static void measure(char *name, char *shape, unsigned long size, int depth, void (*op)(long count)) {
+    op(1);
+    long count = 1;
+    double start = reverki_clock();
+    op(count);
+    while(reverki_clock() - start < MICRO_MIN_TIME) {
+        count *= 2;
+        start = reverki_clock();
+        op(count);
+    }
+
+    double times[MICRO_REPETITIONS];
+    unsigned long heapBefore = heapAllocations;
+    unsigned long termsBefore = termsAllocated;
+    for(int i = 0; i < MICRO_REPETITIONS; i++) {
+        start = reverki_clock();
+        op(count);
+        double t = (reverki_clock() - start) * 1e9 / count;
+        // Insertion into the sorted times
+        int j = i;
+        while(j > 0 && *(times + j - 1) > t) {
+            *(times + j) = *(times + j - 1);
+            j--;
+        }
+        *(times + j) = t;
+    }
+    double ops = (double)count * MICRO_REPETITIONS;
+    printf("%-14s %-18s %8lu %6d %12.1f %12.1f %10.3f %10.3f\n", name, shape, size, depth,
+           *times, *(times + MICRO_REPETITIONS / 2), (heapAllocations - heapBefore) / ops,
+           (termsAllocated - termsBefore) / ops);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    static int depths[] = { 4, 8, 12, 16 };
+    static int lengths[] = { 16, 256, 4096 };
+    static int atomLengths[] = { 1, 8, 32, 63 };
+    static int patternDepths[] = { 1, 3, 6 };
+    int numDepths = sizeof(depths) / sizeof(int);
+    int numLengths = sizeof(lengths) / sizeof(int);
+    char shape[64];
+    char *text;
+    int next;
+
+    printf("%-14s %-18s %8s %6s %12s %12s %10s %10s\n", "primitive", "term", "size", "depth",
+           "min ns/op", "median ns/op", "allocs/op", "terms/op");
+
+    // Shapes on which every primitive other than reverki_parse_atom is run
+    int numShapes = numDepths + numLengths;
+    REVERKI_TERM *shapes[numShapes];
+    REVERKI_TERM *copies[numShapes];
+    REVERKI_TERM *variants[numShapes];
+    int shapeDepths[numShapes];
+    for(int i = 0; i < numShapes; i++) {
+        if(i < numDepths) {
+            *(shapeDepths + i) = *(depths + i);
+            next = 0;
+            *(shapes + i) = balancedTerm(*(depths + i), "C", &next);
+            next = 0;
+            *(copies + i) = balancedTerm(*(depths + i), "C", &next);
+            next = 0;
+            *(variants + i) = balancedTerm(*(depths + i), "D", &next);
+        } else {
+            *(shapeDepths + i) = *(lengths + i - numDepths);
+            *(shapes + i) = spineTerm(*(lengths + i - numDepths), "C");
+            *(copies + i) = spineTerm(*(lengths + i - numDepths), "C");
+            *(variants + i) = spineTerm(*(lengths + i - numDepths), "D");
+        }
+    }
+
+    if(selected("parse_atom", argc, argv)) {
+        for(int i = 0; i < sizeof(atomLengths) / sizeof(int); i++) {
+            char pname[REVERKI_PNAME_BUFFER_SIZE + 1];
+            for(int j = 0; j < *(atomLengths + i); j++) {
+                *(pname + j) = 'A' + j % 26;
+            }
+            *(pname + *(atomLengths + i)) = ' ';
+            if((stream = fmemopen(pname, *(atomLengths + i) + 1, "r")) == NULL) {
+                abort();
+            }
+            snprintf(shape, sizeof(shape), "length %d", *(atomLengths + i));
+            measure("parse_atom", shape, 1, 0, opParseAtom);
+            fclose(stream);
+        }
+    }
+
+    for(int i = 0; i < numShapes; i++) {
+        char *kind = i < numDepths ? "balanced" : "spine";
+        if(selected("parse_term", argc, argv)) {
+            stream = termStream(*(shapes + i), &text);
+            measure("parse_term", kind, (*(shapes + i))->size, *(shapeDepths + i), opParseTerm);
+            fclose(stream);
+            free(text);
+        }
+        if(selected("compare_term", argc, argv)) {
+            subject = *(shapes + i);
+            other = *(copies + i);
+            snprintf(shape, sizeof(shape), "%s, equal", kind);
+            measure("compare_term", shape, subject->size, *(shapeDepths + i), opCompareTerm);
+            other = *(variants + i);
+            snprintf(shape, sizeof(shape), "%s, different", kind);
+            measure("compare_term", shape, subject->size, *(shapeDepths + i), opCompareTerm);
+        }
+        if(selected("match", argc, argv)) {
+            // A ground pattern is traversed all the way down to match itself
+            subject = other = *(shapes + i);
+            snprintf(shape, sizeof(shape), "%s, ground", kind);
+            measure("match", shape, subject->size, *(shapeDepths + i), opMatch);
+        }
+        if(selected("apply", argc, argv)) {
+            // With nothing to replace, the whole term is still traversed
+            subject = *(shapes + i);
+            subst.count = 0;
+            snprintf(shape, sizeof(shape), "%s, ground", kind);
+            measure("apply", shape, subject->size, *(shapeDepths + i), opApply);
+        }
+        if(selected("unparse_term", argc, argv)) {
+            subject = *(shapes + i);
+            if((stream = fopen("/dev/null", "w")) == NULL) {
+                abort();
+            }
+            measure("unparse_term", kind, subject->size, *(shapeDepths + i), opUnparseTerm);
+            fclose(stream);
+        }
+    }
+
+    // Patterns with a variable at each leaf, against the largest balanced tree,
+    // and the instantiation of each pattern with the substitution obtained
+    for(int i = 0; i < sizeof(patternDepths) / sizeof(int); i++) {
+        int depth = *(patternDepths + i);
+        next = 0;
+        REVERKI_TERM *pattern = balancedTerm(depth, "x", &next);
+        REVERKI_TERM *target = *(shapes + numDepths - 1);
+        snprintf(shape, sizeof(shape), "%d variables", next);
+        if(selected("match", argc, argv)) {
+            subject = pattern;
+            other = target;
+            measure("match", shape, pattern->size, depth, opMatch);
+        }
+        if(selected("apply", argc, argv)) {
+            subst.count = 0;
+            if(!reverki_match(pattern, target, &subst)) {
+                abort();
+            }
+            subject = pattern;
+            measure("apply", shape, pattern->size, depth, opApply);
+            other = numberedAtom("E", 0);
+            snprintf(shape, sizeof(shape), "%d variables, fresh", next);
+            measure("apply", shape, pattern->size, depth, opApplyFresh);
+        }
+    }
+    return EXIT_SUCCESS;
+}
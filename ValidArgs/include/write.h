@@ -1,8 +1,110 @@
+// Options added to those in global.h, also set by validargs:
+//   If -T is specified, then the TRACE_OPTION bit is set, and the file name
+//     is saved in reverki_trace_path.
+//   If -b is specified, then the BATCH_OPTION bit is set.
+//   If -d is specified, then the SHARED_OPTION bit is set.
+//   If -c is specified, then the COMPILE_OPTION bit is set, and the file
+//     name is saved in reverki_compile_path.
+//   If --stats-format is specified, then the STATISTICS_OPTION bit is set,
+//     and the STATS_JSON_OPTION bit is set if the format is json.
+//   If -m is specified, then the MEMO_OPTION bit is set.
+//   If -i is specified, then the INCREMENTAL_OPTION bit is set.
+//   If -g is specified, then the GRAPH_OPTION bit is set.
+//   If -S is specified, then the STRATEGY_OPTION bits are set to
+//     OUTERMOST_STRATEGY or PARALLEL_STRATEGY as selected; otherwise, or if
+//     innermost is selected, they are INNERMOST_STRATEGY (0).
+//   If -j is specified, then the JOBS_OPTION bits contain the specified
+//     number of threads (JOBS_SHIFT gives their position); otherwise they are 0,
+//     and a single thread is used.
+#define MEMO_OPTION (0x00000040)
+#define INCREMENTAL_OPTION (0x00000080)
+#define GRAPH_OPTION (0x00000100)
+#define STRATEGY_OPTION (0x00000600)
+#define INNERMOST_STRATEGY (0x00000000)
+#define OUTERMOST_STRATEGY (0x00000200)
+#define PARALLEL_STRATEGY (0x00000400)
+#define BATCH_OPTION (0x00000800)
+#define COMPILE_OPTION (0x00001000)
+#define SHARED_OPTION (0x00002000)
+#define STATS_JSON_OPTION (0x00004000)
+#define JOBS_OPTION (0x00ff0000)
+#define JOBS_SHIFT 16
+
+/*
+ * An arena is a growable storage area for objects of one fixed size.
+ * Storage is obtained in blocks of (1 << blockShift) objects, and objects are
+ * handed out from the current block by bumping a pointer.  When a block is
+ * exhausted a new one is added, so objects never move once allocated.
+ * The blocks are recorded in a directory, which allows the object with a
+ * given index (in order of allocation) to be found in constant time.
+ */
+typedef struct reverki_arena {
+    int elementSize;               // Size of each object, in bytes.
+    int blockShift;                // Log2 of the number of objects per block.
+    char **blocks;                 // Directory of blocks.
+    int numBlocks;                 // Number of blocks allocated so far.
+    int maxBlocks;                 // Capacity of the directory.
+    char *next;                    // Next free object in the current block.
+    char *limit;                   // End of the current block.
+    int used;                      // Number of objects allocated.
+} REVERKI_ARENA;
+
+#define REVERKI_ARENA_INIT(type, shift) { sizeof(type), (shift), NULL, 0, 0, NULL, NULL, 0 }
+
+/*
+ * Storage for atoms.  Every atom is stored in an object allocated from this
+ * arena.  At any time, there can be at most one atom with a given pname.
+ * We do this so that atoms can be compared using pointer equality, rather
+ * than having to compare their pnames.
+ */
+REVERKI_ARENA reverki_atom_arena;
+
+/*
+ * Storage for terms.  Every term is stored in an object allocated from this
+ * arena.  No two terms in the arena are equal (terms are "hash-consed" when
+ * they are created), so terms can be compared using pointer equality.
+ */
+REVERKI_ARENA reverki_term_arena;
+
+/*
+ * Storage for rules.  Every rule is stored in an object allocated from this
+ * arena.
+ */
+REVERKI_ARENA reverki_rule_arena;
+
+/*
+ * Arena-related functions.  See arena.c for specifications.
+ */
+extern void *reverki_arena_alloc(REVERKI_ARENA *arena);
+extern void *reverki_arena_get(REVERKI_ARENA *arena, int index);
+extern void reverki_arena_release(REVERKI_ARENA *arena, int count);
+extern int reverki_arena_free_count(REVERKI_ARENA *arena);
+extern void reverki_arena_destroy(REVERKI_ARENA *arena);
+
+/*
+ * A template is the right-hand side of a rule, prepared for instantiation:
+ * each variable that occurs in the left-hand side has been replaced by the
+ * number of the slot in which it is bound by a match, and each subterm that
+ * contains no such variable is kept as a term to be used as it is.
+ */
+typedef struct reverki_template {
+    REVERKI_TERM *term;                 // Subterm used as it is, or NULL.
+    int slot;                           // Slot of the variable, or -1.
+    struct reverki_template *fst;       // First component (if neither of the above).
+    struct reverki_template *snd;       // Second component (if neither of the above).
+} REVERKI_TEMPLATE;
+
 // Trace function for rewrite
 extern int reverki_trace(REVERKI_TERM *term, int dotIndex);
 
-// Statistics function
+// Statistics function, and the figures it reports beyond the counters below
 extern int reverki_statistics();
+extern double reverki_clock();
+extern double reverki_parse_time;
+extern double reverki_rewrite_time;
+extern double reverki_print_time;
+extern unsigned long termsAllocated;
+extern int peakTerms;
 
 // Counter for all of the rules
 extern int *pRuleCounter;
@@ -13,5 +115,166 @@ extern int *pTermCounter;
 // Counter for all of the atoms
 extern int *pAtomCounter;
 
+// Instantiates the right-hand side of a rule with the slots of a substitution
+extern REVERKI_TERM *reverki_instantiate(REVERKI_RULE *rule, REVERKI_SUBST *subst);
+
+// Prints a substitution as a sequence of bindings
+extern int reverki_unparse_subst(REVERKI_SUBST *subst, FILE *out);
+
 // Checks if two character strings are equal
-extern int equalStrings(char *a, char *b);
\ No newline at end of file
+extern int equalStrings(char *a, char *b);
+// Garbage collection of terms that are no longer in use
+extern int reverki_collection_needed();
+extern int reverki_mark_term(REVERKI_TERM *term);
+extern int reverki_sweep_terms();
+
+// Matching automaton compiled from a list of rules
+typedef struct reverki_automaton REVERKI_AUTOMATON;
+extern REVERKI_AUTOMATON *reverki_compile_rules(REVERKI_RULE *rule_list);
+extern REVERKI_RULE *reverki_automaton_match(REVERKI_AUTOMATON *automaton, REVERKI_TERM *term, int after,
+                                             int *priorityp, REVERKI_SUBST *substp);
+
+// Cache of normal forms, and its statistics
+extern REVERKI_TERM *reverki_memo_lookup(REVERKI_TERM *term);
+extern int reverki_memo_probe(REVERKI_TERM *term);
+extern void reverki_memo_insert(REVERKI_TERM *term, REVERKI_TERM *normalForm);
+extern void reverki_memo_sweep();
+extern int memoHits;
+extern int memoMisses;
+extern int memoEvictions;
+extern int memoProbes;
+extern int memoProbeHits;
+
+// Work-stealing pool of threads, and locks for data shared between its tasks
+typedef struct reverki_task {
+    void (*run)(struct reverki_task *task);     // Function that performs the task.
+    int done;                                   // Set once the task has been performed.
+} REVERKI_TASK;
+#define REVERKI_TERM_LOCKS 64                   // One per shard of the term table (a power of two).
+#define REVERKI_TERM_LOCK 0                     // The first of them.
+#define REVERKI_ALLOC_LOCK (REVERKI_TERM_LOCK + REVERKI_TERM_LOCKS)
+#define REVERKI_MEMO_LOCK (REVERKI_ALLOC_LOCK + 1)
+#define REVERKI_TRACE_LOCK (REVERKI_MEMO_LOCK + 1)
+#define REVERKI_NUM_LOCKS (REVERKI_TRACE_LOCK + 1)
+extern int reverki_pool_start(int workers);
+extern int reverki_pool_workers();
+extern void reverki_pool_begin();
+extern void reverki_pool_end();
+extern void reverki_pool_fork(REVERKI_TASK *task);
+extern void reverki_pool_join(REVERKI_TASK *task);
+extern void reverki_lock(int lock);
+extern void reverki_unlock(int lock);
+
+// Rewrites every term of a batch, printing the results in order
+extern int reverki_rewrite_batch(REVERKI_RULE *rule_list, REVERKI_TERM **terms, int count, FILE *out);
+
+// Input read through a cursor from a buffer or a memory-mapped file
+typedef struct reverki_input {
+    FILE *stream;                               // Stream to refill from, or NULL.
+    char *buffer;                               // The buffer or mapping.
+    char *cur;                                  // The next character to be consumed.
+    char *end;                                  // End of the characters in the buffer.
+    size_t size;                                // Size of the buffer or mapping.
+    int mapped;                                 // Whether the buffer is a mapping.
+    char last;                                  // Buffer for reading a character at a time.
+} REVERKI_INPUT;
+#define REVERKI_SPACE_CHAR 0x1
+#define REVERKI_ATOM_CHAR 0x2
+#define REVERKI_LOWER_CHAR 0x4
+#define REVERKI_INPUT_PEEK(input) \
+    ((input)->cur < (input)->end ? (unsigned char)*(input)->cur : reverki_input_fill(input))
+#define REVERKI_INPUT_NEXT(input) ((input)->cur++)
+extern const unsigned char reverki_char_class[256];
+extern int reverki_input_open(REVERKI_INPUT *input, FILE *in);
+extern void reverki_input_wrap(REVERKI_INPUT *input, FILE *in);
+extern void reverki_input_close(REVERKI_INPUT *input);
+extern int reverki_input_fill(REVERKI_INPUT *input);
+extern int reverki_input_skip_space(REVERKI_INPUT *input);
+extern int reverki_input_atom(REVERKI_INPUT *input, char *pname);
+
+// Output written through a cursor into a buffer that is flushed in blocks
+typedef struct reverki_output {
+    FILE *stream;                               // Stream to flush to.
+    char *buffer;                               // The buffer.
+    char *cur;                                  // Where the next character is stored.
+    char *end;                                  // End of the buffer.
+    int owned;                                  // Whether the buffer was allocated by the output.
+    int error;                                  // Whether a write to the stream has failed.
+} REVERKI_OUTPUT;
+#define REVERKI_OUTPUT_PUT(output, c) \
+    ((output)->cur < (output)->end ? (void)(*(output)->cur++ = (c)) : reverki_output_char((output), (c)))
+extern int reverki_output_open(REVERKI_OUTPUT *output, FILE *out);
+extern void reverki_output_wrap(REVERKI_OUTPUT *output, FILE *out, char *buffer, size_t size);
+extern int reverki_output_flush(REVERKI_OUTPUT *output);
+extern int reverki_output_close(REVERKI_OUTPUT *output);
+extern void reverki_output_char(REVERKI_OUTPUT *output, int c);
+extern void reverki_output_string(REVERKI_OUTPUT *output, char *s);
+
+// Printer writing to an output
+extern int reverki_write_term(REVERKI_OUTPUT *output, REVERKI_TERM *term);
+extern int reverki_write_shared_term(REVERKI_OUTPUT *output, REVERKI_TERM *term);
+
+// Parsers reading from an input
+extern REVERKI_ATOM *reverki_read_atom(REVERKI_INPUT *input);
+extern REVERKI_TERM *reverki_read_term(REVERKI_INPUT *input);
+extern REVERKI_RULE *reverki_read_rule(REVERKI_INPUT *input);
+
+// Rules created other than by parsing, and atoms looked up by pname
+extern REVERKI_RULE *reverki_define_rule(REVERKI_TERM *lhs, REVERKI_TERM *rhs);
+extern REVERKI_ATOM *reverki_intern_atom(char *pname);
+
+// Compiled (binary) form of the rules and terms read
+extern char *reverki_compile_path;
+extern int reverki_is_compiled(REVERKI_INPUT *input);
+extern int reverki_write_compiled(char *path, REVERKI_TERM **terms, int count);
+extern int reverki_load_compiled(REVERKI_INPUT *input, REVERKI_TERM ***termsp, int *countp, REVERKI_RULE **rulep);
+
+// Index of an object in an arena
+extern int reverki_arena_index(REVERKI_ARENA *arena, void *object);
+
+// Binary trace (-T), written as records that bin/reverki_render turns into text
+#define REVERKI_TRACE_MAGIC "RVKT"
+#define REVERKI_TRACE_VERSION 1
+#define REVERKI_TRACE_ATOM 'a'                  // Term number, pname length, pname.
+#define REVERKI_TRACE_PAIR 'p'                  // Term number, numbers of its subterms.
+#define REVERKI_TRACE_RULE 'r'                  // Numbers of the sides of the next rule.
+#define REVERKI_TRACE_TERM 't'                  // Number of a term about to be rewritten.
+#define REVERKI_TRACE_STEP 's'                  // Step, depth, rule, subterm, result, bindings.
+extern char *reverki_trace_path;
+extern FILE *reverki_trace_file;
+extern int reverki_tracefile_open(char *path);
+extern int reverki_tracefile_close();
+extern void reverki_tracefile_rules(FILE *out);
+extern void reverki_tracefile_term(FILE *out, REVERKI_TERM *term);
+extern void reverki_tracefile_step(FILE *out, unsigned int step, REVERKI_TERM *tgt, REVERKI_RULE *rule,
+                                   REVERKI_SUBST *subst, REVERKI_TERM *result, int index);
+extern void reverki_tracefile_sweep();
+
+// Counters of calls, nodes visited and time spent in the hot paths, compiled in
+// with -DREVERKI_PROFILE (implied by -DDEBUG) and printed at exit; otherwise
+// the macros expand to nothing
+#if defined(DEBUG) && !defined(REVERKI_PROFILE)
+#define REVERKI_PROFILE
+#endif
+#define REVERKI_PROFILE_REWRITE 0               // reverki_rewrite_helper
+#define REVERKI_PROFILE_MATCH 1                 // addSubsToList
+#define REVERKI_PROFILE_APPLY 2                 // reverki_apply_helper
+#define REVERKI_PROFILE_PARSE 3                 // reverki_read_term and reverki_read_rule
+#define REVERKI_PROFILE_AUTOMATON 4             // reverki_automaton_match
+#define REVERKI_PROFILE_INSTANTIATE 5           // instantiateHelper
+#define REVERKI_PROFILE_SITES 6
+#ifdef REVERKI_PROFILE
+typedef struct reverki_profile_frame {
+    int site;                                   // The site entered.
+    long start;                                 // Time of entry in ns, or -1 if nested.
+} REVERKI_PROFILE_FRAME;
+extern REVERKI_PROFILE_FRAME reverki_profile_enter(int site);
+extern void reverki_profile_exit(REVERKI_PROFILE_FRAME *frame);
+extern void reverki_profile_node(int site);
+#define REVERKI_PROFILE_ENTER(site) \
+    __attribute__((cleanup(reverki_profile_exit))) REVERKI_PROFILE_FRAME profileFrame = reverki_profile_enter(site)
+#define REVERKI_PROFILE_NODE(site) reverki_profile_node(site)
+#else
+#define REVERKI_PROFILE_ENTER(site)
+#define REVERKI_PROFILE_NODE(site)
+#endif
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "reverki.h"
+#include "global.h"
+#include "write.h"
+
+REVERKI_ARENA reverki_atom_arena = REVERKI_ARENA_INIT(REVERKI_ATOM, 8);
+REVERKI_ARENA reverki_term_arena = REVERKI_ARENA_INIT(REVERKI_TERM, 12);
+REVERKI_ARENA reverki_rule_arena = REVERKI_ARENA_INIT(REVERKI_RULE, 8);
+
+/**
+ * @brief makes the block with the specified number the current block of an arena,
+ * positioning the bump pointer at the specified offset within it
+ *
+ * @param arena The arena
+ * @param block The number of the block, which must already exist
+ * @param offset The index, within the block, of the next object to hand out
+ */
+static void setCurrentBlock(REVERKI_ARENA *arena, int block, int offset) {
+    int blockBytes = arena->elementSize << arena->blockShift;
+    arena->next = *(arena->blocks + block) + offset * arena->elementSize;
+    arena->limit = *(arena->blocks + block) + blockBytes;
+}
+
+/**
+ * @brief adds a new block to an arena, growing its directory if necessary
+ *
+ * @param arena The arena
+ * @return int 0 if successful, -1 if memory could not be allocated
+ */
+static int addBlock(REVERKI_ARENA *arena) {
+    if(arena->numBlocks == arena->maxBlocks) {
+        int newMax = arena->maxBlocks ? arena->maxBlocks * 2 : 16;
+        char **newBlocks = realloc(arena->blocks, newMax * sizeof(char *));
+        if(newBlocks == NULL) {
+            return -1;
+        }
+        arena->blocks = newBlocks;
+        arena->maxBlocks = newMax;
+    }
+    char *block = calloc((size_t)1 << arena->blockShift, arena->elementSize);
+    if(block == NULL) {
+        return -1;
+    }
+    *(arena->blocks + arena->numBlocks) = block;
+    arena->numBlocks++;
+    return 0;
+}
+
+/**
+ * @brief  Allocate an object from an arena.
+ * @details  The object is handed out from the current block by advancing the
+ * bump pointer.  If the current block is exhausted, then the following block
+ * becomes current, first adding it to the arena if it does not yet exist.
+ * Objects never move once they have been allocated.
+ * @param arena  The arena from which to allocate.
+ * @return  A pointer to the object, or NULL if memory could not be allocated.
+ */
+void *reverki_arena_alloc(REVERKI_ARENA *arena) {
+    if(arena->next == arena->limit) {
+        int block = arena->used >> arena->blockShift;
+        if(block == arena->numBlocks && addBlock(arena)) {
+            return NULL;
+        }
+        setCurrentBlock(arena, block, 0);
+    }
+    void *object = arena->next;
+    arena->next += arena->elementSize;
+    arena->used++;
+    return object;
+}
+
+/*
+ * @brief  Get the object with a specified index in an arena.
+ * @details  Objects are numbered, starting from 0, in the order in which they
+ * were allocated.
+ * @param arena  The arena.
+ * @param index  The index of the object, which must be less than the number of
+ * objects allocated.
+ * @return  A pointer to the object.
+ */
+void *reverki_arena_get(REVERKI_ARENA *arena, int index) {
+    int mask = (1 << arena->blockShift) - 1;
+    return *(arena->blocks + (index >> arena->blockShift)) + (index & mask) * arena->elementSize;
+}
+
+/*
+ * @brief  Get the index of an object in an arena, the inverse of reverki_arena_get.
+ * @details  The blocks of the arena are searched for the one containing the
+ * object, so this takes time proportional to the number of blocks.
+ * @param arena  The arena.
+ * @param object  A pointer to an object allocated from the arena.
+ * @return  The index of the object, or -1 if it is not in the arena.
+ */
+int reverki_arena_index(REVERKI_ARENA *arena, void *object) {
+    long blockSize = (long)arena->elementSize << arena->blockShift;
+    for(int i = 0; i < arena->numBlocks; i++) {
+        char *block = *(arena->blocks + i);
+        if((char *)object >= block && (char *)object < block + blockSize) {
+            return (i << arena->blockShift) + ((char *)object - block) / arena->elementSize;
+        }
+    }
+    return -1;
+}
+
+/*
+ * @brief  Release the most recently allocated objects in an arena.
+ * @details  All objects but the first count are released, and the bump pointer
+ * is moved back so that they will be handed out again by subsequent allocations.
+ * The blocks themselves are retained.
+ * @param arena  The arena.
+ * @param count  The number of objects to keep, which must not exceed the number
+ * of objects allocated.
+ */
+void reverki_arena_release(REVERKI_ARENA *arena, int count) {
+    int mask = (1 << arena->blockShift) - 1;
+    arena->used = count;
+    if((count & mask) == 0) {
+        // Let the next allocation select (or add) the block
+        arena->next = arena->limit = NULL;
+    } else {
+        setCurrentBlock(arena, count >> arena->blockShift, count & mask);
+    }
+}
+
+/*
+ * @brief  Get the number of objects that can still be allocated from an arena
+ * without adding a new block.
+ * @param arena  The arena.
+ * @return  The number of free objects in the blocks already allocated.
+ */
+int reverki_arena_free_count(REVERKI_ARENA *arena) {
+    return (arena->numBlocks << arena->blockShift) - arena->used;
+}
+
+/*
+ * @brief  Free all the storage held by an arena.
+ * @details  All objects allocated from the arena become invalid.  The arena
+ * itself is left empty and may be used again.
+ * @param arena  The arena.
+ */
+void reverki_arena_destroy(REVERKI_ARENA *arena) {
+    for(int i = 0; i < arena->numBlocks; i++) {
+        free(*(arena->blocks + i));
+    }
+    free(arena->blocks);
+    arena->blocks = NULL;
+    arena->numBlocks = arena->maxBlocks = arena->used = 0;
+    arena->next = arena->limit = NULL;
+}
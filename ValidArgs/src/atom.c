@@ -6,33 +6,147 @@
 #include "global.h"
 #include "write.h"
 
-int atomCounter = 0;
-int *pAtomCounter = &atomCounter;
+int *pAtomCounter = &reverki_atom_arena.used;
+
+/*
+ * Intern table for atoms.  Atoms are hashed on their pnames into a table of
+ * buckets, and the atoms in each bucket are chained through their "next"
+ * fields.  Atoms themselves are allocated densely from reverki_atom_arena,
+ * so the index of an atom in that arena serves as its id.
+ */
+#define ATOM_TABLE_INITIAL_SIZE 256
+static REVERKI_ATOM **atomTable = NULL;
+static unsigned long atomTableSize = 0;
 
 /**
- * @brief returns true if the ascii value pertains to whitespace
- * 
- * @param val The ascii value of the current character 
- * @return int 1 if the value is whitespace, 0 if not
+ * @brief computes the hash of a pname
+ *
+ * @param pname The null-terminated pname
+ * @return unsigned long The hash value (FNV-1a)
  */
-int isWhiteSpace(int val) {
-    if((val > 8 && val < 14) || val == 32 || val == 40 || val == 41 || val == 44 || val == 91 || val == 93) {
-        return 1;
+static unsigned long hashPname(char *pname) {
+    unsigned long h = 14695981039346656037UL;
+    while(*pname != '\0') {
+        h ^= (unsigned char)*pname;
+        h *= 1099511628211UL;
+        pname++;
     }
+    return h;
+}
+
+/**
+ * @brief doubles the number of buckets in the intern table (or creates it, if
+ * it does not exist yet) and moves every atom to its new bucket
+ *
+ * @return int 0 if successful, -1 if memory could not be allocated
+ */
+static int growAtomTable() {
+    unsigned long newSize = atomTableSize ? atomTableSize * 2 : ATOM_TABLE_INITIAL_SIZE;
+    REVERKI_ATOM **newTable = calloc(newSize, sizeof(REVERKI_ATOM *));
+    if(newTable == NULL) {
+        return -1;
+    }
+    for(unsigned long i = 0; i < atomTableSize; i++) {
+        REVERKI_ATOM *atom = *(atomTable + i);
+        while(atom != NULL) {
+            REVERKI_ATOM *next = atom->next;
+            REVERKI_ATOM **bucket = newTable + (hashPname(atom->pname) & (newSize - 1));
+            atom->next = *bucket;
+            *bucket = atom;
+            atom = next;
+        }
+    }
+    free(atomTable);
+    atomTable = newTable;
+    atomTableSize = newSize;
     return 0;
 }
 
 /**
- * @brief returns true if the ascii value pertains to '(', ')', '[',  ']', or ','
- * 
- * @param val The ascii value of the current character
- * @return int 1 if the value is one of those characters mentioned in @brief, 0 if not
+ * @brief returns the atom having the specified pname, creating it if it does not
+ * already exist
+ *
+ * @param pname The null-terminated pname of the atom
+ * @return REVERKI_ATOM* The atom, or NULL if the atom limit was exceeded
  */
-int validFirstChar(int val) {
-    if(val == 40 || val == 41 || val == 44 || val == 91 || val == 93) {
-        return 0;
+static REVERKI_ATOM *internAtom(char *pname) {
+    if(*pAtomCounter >= atomTableSize && growAtomTable()) {
+        fprintf(stderr, "Atom limit exceeded");
+        return NULL;
     }
-    return 1;
+
+    REVERKI_ATOM **bucket = atomTable + (hashPname(pname) & (atomTableSize - 1));
+    REVERKI_ATOM *atom = *bucket;
+    while(atom != NULL) {
+        if(equalStrings(atom->pname, pname)) {
+            return atom;
+        }
+        atom = atom->next;
+    }
+
+    atom = reverki_arena_alloc(&reverki_atom_arena);
+    if(atom == NULL) {
+        fprintf(stderr, "Atom limit exceeded");
+        return NULL;
+    }
+
+    // Type variable
+    if(*(pname + 0) > 96 && *(pname + 0) < 123) {
+        atom->type = REVERKI_VARIABLE_TYPE;
+    }
+    // Type constant
+    else { atom->type = REVERKI_CONSTANT_TYPE; }
+
+    // Copy pname to atom->pname
+    int charIndex = 0;
+    do {
+        *(atom->pname + charIndex) = *(pname + charIndex);
+    } while(*(pname + charIndex++) != '\0');
+
+    atom->next = *bucket;
+    *bucket = atom;
+    return atom;
+}
+
+/*
+ * @brief  Get the atom having a specified pname.
+ * @details  The type of the atom is determined by its pname, as for an atom
+ * that is parsed.  If there is already an atom with the pname, then it is
+ * returned; otherwise a new atom is created.
+ * @param pname  The null-terminated pname, which must not be empty.
+ * @return  A pointer to the atom, or NULL if the pname is too long or the atom
+ * could not be created.
+ */
+REVERKI_ATOM *reverki_intern_atom(char *pname) {
+    int length = 0;
+    while(*(pname + length) != '\0') {
+        if(++length >= REVERKI_PNAME_BUFFER_SIZE) {
+            fprintf(stderr, "Atom too long\n");
+            return NULL;
+        }
+    }
+    return length ? internAtom(pname) : NULL;
+}
+
+/*
+ * @brief  Read an atom from a specified input and return the resulting object.
+ * @details  As reverki_parse_atom, except that characters are taken from an
+ * input rather than a stream.  A character that does not belong to the atom
+ * is left unconsumed.
+ * @param input  The input from which characters are to be read.
+ * @return  A pointer to the atom, if the parse was successful, otherwise NULL if
+ * an error occurred.
+ */
+REVERKI_ATOM *reverki_read_atom(REVERKI_INPUT *input) {
+    int length = reverki_input_atom(input, reverki_pname_buffer);
+    if(length < 0) {
+        fprintf(stderr, "Atom too long\n");
+        return NULL;
+    }
+    if(length == 0) {
+        return NULL;
+    }
+    return internAtom(reverki_pname_buffer);
 }
 
 /*
@@ -40,15 +154,16 @@ int validFirstChar(int val) {
  * @details  Read characters from the specified input stream and attempt to interpret
  * them as an atom.  An atom may start with any non-whitespace character that is not
  * a left '(' or right '(' parenthesis, a left '[' or right ']' square bracket,
- * or a comma ','.  If the first character read is one of '(', ')', '[', ']', then it
- * is not an error; instead, the character read is pushed back into the input stream
- * and NULL is returned.  Besides the first character, an atom may consist
- * of any number of additional characters (other than whitespace and the punctuation
- * mentioned previously), up to a maximum length of REVERKI_PNAME_BUFFER_SIZE-1.
- * If this maximum length is exceeded, then an error message is printed (on stderr)
- * and NULL is returned.  When a whitespace or punctuation character is encountered
- * that signals the end of the atom, this character is pushed back into the input
- * stream.  If the atom is terminated due to EOF, no character is pushed back.
+ * or a comma ','.  If the first character read is whitespace or one of '(', ')',
+ * '[', ']', ',', then it is not an error; instead, the character read is pushed
+ * back into the input stream and NULL is returned.  Besides the first character,
+ * an atom may consist of any number of additional characters (other than whitespace
+ * and the punctuation mentioned previously), up to a maximum length of
+ * REVERKI_PNAME_BUFFER_SIZE-1.  If this maximum length is exceeded, then an error
+ * message is printed (on stderr) and NULL is returned.  When a whitespace or
+ * punctuation character is encountered that signals the end of the atom, this
+ * character is pushed back into the input stream.  If the atom is terminated due
+ * to EOF, no character is pushed back.
  * An atom that starts with a lower-case letter has type REVERKI_VARIABLE_TYPE,
  * otherwise it has type REVERKI_CONSTANT_TYPE.  An atom is returned having the
  * sequence of characters read as its pname, and having the type determined by this
@@ -61,66 +176,12 @@ int validFirstChar(int val) {
  */
 REVERKI_ATOM *reverki_parse_atom(FILE *in) {
     if(in == NULL) { return NULL; }
-    
-    int c;
-    if((c = fgetc(in)) != EOF) {
-        // First character is invalid
-        if(!validFirstChar(c)) {
-            if(c != EOF) { ungetc(c, in); }
-            return NULL;
-
-        // Type Variable
-        } else {
-            int index = 0;
-
-            // Add to pname buffer
-            do {
-                *(reverki_pname_buffer + index) = c;
-                index++;
-            } while(!isWhiteSpace(c = fgetc(in)) && index < REVERKI_PNAME_BUFFER_SIZE-1 && c != EOF);
-            *(reverki_pname_buffer + index) = '\0';
-
-            if(index >= REVERKI_PNAME_BUFFER_SIZE-1 && !isWhiteSpace(c)) {
-                return NULL;
-            }
-            if(isWhiteSpace(c)) {
-                ungetc(c, in);
-            }
-
-            //Check if atom exists
-            index = 0;
-            while(index <= atomCounter  && index < REVERKI_NUM_ATOMS) {
-                if(equalStrings((reverki_atom_storage + index)->pname, reverki_pname_buffer)) {
-                    return (reverki_atom_storage + index);
-                }
-                index++;
-            }
-
-            index = atomCounter;
-
-            // Type variable
-            if(*(reverki_pname_buffer + 0) > 96 && *(reverki_pname_buffer + 0) < 123) { 
-                (reverki_atom_storage + index)->type = REVERKI_VARIABLE_TYPE; 
-            }
-            // Type constant
-            else { (reverki_atom_storage + index)->type = REVERKI_CONSTANT_TYPE; } 
-
-            // Copy pname buffer to newAtom.pname
-            int charIndex = 0;
-            while(*(reverki_pname_buffer + charIndex) != '\0') {
-                *((reverki_atom_storage + index)->pname + charIndex) = *(reverki_pname_buffer + charIndex);
-                charIndex++;
-            }
-            atomCounter++;
-            if(atomCounter > REVERKI_NUM_ATOMS) {
-                fprintf(stderr, "Atom limit exceeded");
-                return NULL;
-            }
-            return (reverki_atom_storage + index);
-        }
-    }
-    return NULL;
 
+    REVERKI_INPUT input;
+    reverki_input_wrap(&input, in);
+    REVERKI_ATOM *atom = reverki_read_atom(&input);
+    reverki_input_close(&input);
+    return atom;
 }
 
 /*
@@ -138,10 +199,13 @@ int reverki_unparse_atom(REVERKI_ATOM *atom, FILE *out) {
         return EOF;
     }
     do {
-        fprintf(out, "%c", *(atom->pname + index));
         index++;
     } while(*(atom->pname + index) != '\0' && *(atom->pname + index) != 127);
 
+    // The whole pname is written at once, rather than a character at a time
+    if(fwrite(atom->pname, 1, index, out) != index) {
+        return EOF;
+    }
     return 0;
 }
 
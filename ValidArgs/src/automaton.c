@@ -0,0 +1,780 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "reverki.h"
+#include "global.h"
+#include "write.h"
+
+/*
+ * Matching automaton compiled from a list of rules.
+ *
+ * The automaton is a decision tree that reads a target term in preorder.
+ * Each node other than a leaf consumes the next pending subterm of the target,
+ * recording it as the target "position" numbered by the order of consumption.
+ * A SWITCH node examines the head of the subterm: if it is a pair, its two
+ * subterms become pending and the pair child is taken; if it is a constant
+ * with a child of its own (found through a hash table keyed on the node and
+ * the atom) that child is taken; otherwise the default child is taken and the
+ * subterm is not looked at further.  A SKIP node consumes the subterm without
+ * examining it at all.  So every node of the target is inspected at most once.
+ *
+ * The tree is compiled from the rows of a pattern matrix, one row per rule in
+ * the order of the rule list.  A row whose pattern has a variable or an
+ * anonymous wildcard where the target has a pair stays in the pair child with
+ * two wildcards in place of the subterms, and a variable records a binding to
+ * the current position.  Each leaf lists, in rule-list order, the rules whose
+ * left-hand side is consistent with the path to it, together with the
+ * positions of their variables and, for variables occurring more than once,
+ * the pairs of positions that must hold equal (that is, identical) terms.
+ * The first of these whose equalities hold is the rule that applies.
+ *
+ * A row with a wildcard is copied into the pair child and into the child of
+ * every constant, so a rule set that mixes wildcards with many constants in
+ * the same column yields a larger tree.  The part of the tree that depends
+ * only on the wildcard rows is the same under each of those children, so the
+ * compiler looks up each matrix it is about to compile in a table of those
+ * already compiled at the same position, and shares the subtree of an
+ * identical matrix.  The automaton is then a directed acyclic graph, whose
+ * size is bounded by the number of distinct matrices rather than the number
+ * of paths; only columns in which different rules test different constants
+ * at the same time, such as (F C1 x) ... (F Cn x) with (F x D1) ... (F x Dm),
+ * still multiply the number of nodes, here by n × m.
+ */
+#define AUTOMATON_SWITCH 0
+#define AUTOMATON_SKIP 1
+#define AUTOMATON_LEAF 2
+
+typedef struct reverki_automaton_choice {
+    REVERKI_RULE *rule;                         // The rule.
+    int priority;                               // Position of the rule in the rule list.
+    int numBindings;                            // Number of distinct variables.
+    REVERKI_TERM **vars;                        // The variables, in order of first occurrence.
+    int *positions;                             // Target position bound to each variable.
+    int numChecks;                              // Number of repeated variable occurrences.
+    int *checks;                                // Pairs of positions that must be equal.
+    struct reverki_automaton_choice *next;      // Next rule, in rule-list order.
+} REVERKI_AUTOMATON_CHOICE;
+
+typedef struct reverki_automaton_node {
+    int kind;                                   // SWITCH, SKIP or LEAF.
+    struct reverki_automaton_node *pairChild;   // SWITCH: taken if the target is a pair.
+    struct reverki_automaton_node *otherChild;  // SWITCH: default; SKIP: the next node.
+    REVERKI_AUTOMATON_CHOICE *choices;          // LEAF: the candidate rules.
+} REVERKI_AUTOMATON_NODE;
+
+typedef struct reverki_automaton_edge {
+    REVERKI_AUTOMATON_NODE *parent;             // Node the edge leaves.
+    REVERKI_ATOM *atom;                         // Constant labelling the edge.
+    REVERKI_AUTOMATON_NODE *child;              // Node the edge enters.
+} REVERKI_AUTOMATON_EDGE;
+
+struct reverki_automaton {
+    REVERKI_ARENA nodes;                        // Storage for nodes.
+    REVERKI_ARENA choices;                      // Storage for choices.
+    REVERKI_AUTOMATON_NODE *root;               // Root of the decision tree.
+    REVERKI_AUTOMATON_EDGE *edges;              // Hash table of constant edges.
+    unsigned long edgesSize;                    // Size of the table (a power of two).
+    unsigned long edgesUsed;                    // Number of edges in the table.
+    int maxPositions;                           // Most positions consumed on any path.
+};
+
+/*
+ * Working storage used while running an automaton: the pending target
+ * subterms, and the target subterms by position.  Each thread has its own,
+ * so that several threads can run the same automaton at once.
+ */
+static __thread REVERKI_TERM **matchStack = NULL;
+static __thread REVERKI_TERM **matchPositions = NULL;
+static __thread int matchSize = 0;
+
+/*
+ * Pattern matrix used while compiling.  The pending patterns of a row are a
+ * list whose head is the pattern for the next target position; a NULL pattern
+ * is an anonymous wildcard.  Lists are shared between rows and never modified.
+ */
+typedef struct pattern_list {
+    REVERKI_TERM *pat;
+    struct pattern_list *next;
+} PATTERN_LIST;
+
+typedef struct binding_list {
+    REVERKI_TERM *var;
+    int pos;
+    struct binding_list *next;
+} BINDING_LIST;
+
+typedef struct pattern_row {
+    REVERKI_RULE *rule;
+    int priority;
+    PATTERN_LIST *pending;
+    BINDING_LIST *bindings;                     // Most recent binding first.
+    struct pattern_row *next;
+} PATTERN_ROW;
+
+/*
+ * A matrix already compiled, entered in a hash table so that an identical
+ * matrix compiled at the same position can share its subtree.
+ */
+typedef struct compiled_matrix {
+    unsigned long hash;                         // Hash of the position and the rows.
+    int pos;                                    // Position at which it was compiled.
+    PATTERN_ROW *rows;                          // The rows, or NULL if the entry is empty.
+    REVERKI_AUTOMATON_NODE *node;               // The subtree compiled from them.
+} COMPILED_MATRIX;
+
+/*
+ * The rows of a matrix that may take the edge of one constant: those with the
+ * constant and those with a wildcard, in rule-list order.
+ */
+typedef struct constant_group {
+    REVERKI_ATOM *atom;                         // The constant.
+    PATTERN_ROW *rows;                          // The rows of the child.
+    PATTERN_ROW **tail;                         // End of the rows.
+} CONSTANT_GROUP;
+
+typedef struct compiler {
+    REVERKI_AUTOMATON *automaton;
+    REVERKI_ARENA patterns;
+    REVERKI_ARENA bindings;
+    REVERKI_ARENA rows;
+    COMPILED_MATRIX *matrices;                  // Hash table of the matrices compiled.
+    unsigned long matricesSize;                 // Size of the table (a power of two).
+    unsigned long matricesUsed;                 // Number of matrices in the table.
+    int failed;
+} COMPILER;
+
+#define AUTOMATON_EDGES_INITIAL_SIZE 64
+#define AUTOMATON_MATRICES_INITIAL_SIZE 256
+
+/**
+ * @brief finds the slot of the edge table for the edge with the specified parent
+ * and constant, or the empty slot where such an edge should be entered
+ *
+ * @param automaton The automaton
+ * @param parent The parent node of the edge
+ * @param atom The constant labelling the edge
+ * @return REVERKI_AUTOMATON_EDGE* The slot found
+ */
+static REVERKI_AUTOMATON_EDGE *findEdge(REVERKI_AUTOMATON *automaton, REVERKI_AUTOMATON_NODE *parent,
+                                        REVERKI_ATOM *atom) {
+    unsigned long mask = automaton->edgesSize - 1;
+    unsigned long h = ((unsigned long)parent * 0x9e3779b97f4a7c15UL) ^ ((unsigned long)atom * 0xc2b2ae3d27d4eb4fUL);
+    unsigned long slot = (h ^ (h >> 29)) & mask;
+    while((automaton->edges + slot)->parent != NULL) {
+        if((automaton->edges + slot)->parent == parent && (automaton->edges + slot)->atom == atom) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return automaton->edges + slot;
+}
+
+/**
+ * @brief enters an edge into the edge table, doubling the size of the table
+ * first if it is half full
+ *
+ * @param automaton The automaton
+ * @param parent The parent node of the edge
+ * @param atom The constant labelling the edge
+ * @param child The child node of the edge
+ * @return int 0 if successful, -1 if memory could not be allocated
+ */
+static int addEdge(REVERKI_AUTOMATON *automaton, REVERKI_AUTOMATON_NODE *parent, REVERKI_ATOM *atom,
+                   REVERKI_AUTOMATON_NODE *child) {
+    if((automaton->edgesUsed + 1) * 2 > automaton->edgesSize) {
+        REVERKI_AUTOMATON_EDGE *oldEdges = automaton->edges;
+        unsigned long oldSize = automaton->edgesSize;
+        unsigned long newSize = oldSize ? oldSize * 2 : AUTOMATON_EDGES_INITIAL_SIZE;
+        REVERKI_AUTOMATON_EDGE *newEdges = calloc(newSize, sizeof(REVERKI_AUTOMATON_EDGE));
+        if(newEdges == NULL) {
+            return -1;
+        }
+        automaton->edges = newEdges;
+        automaton->edgesSize = newSize;
+        for(unsigned long i = 0; i < oldSize; i++) {
+            if((oldEdges + i)->parent != NULL) {
+                *findEdge(automaton, (oldEdges + i)->parent, (oldEdges + i)->atom) = *(oldEdges + i);
+            }
+        }
+        free(oldEdges);
+    }
+    REVERKI_AUTOMATON_EDGE *edge = findEdge(automaton, parent, atom);
+    edge->parent = parent;
+    edge->atom = atom;
+    edge->child = child;
+    automaton->edgesUsed++;
+    return 0;
+}
+
+/**
+ * @brief prepends a pattern to a list of pending patterns
+ *
+ * @param compiler The compiler state
+ * @param pat The pattern, or NULL for an anonymous wildcard
+ * @param next The list
+ * @return PATTERN_LIST* The new list, or NULL if memory could not be allocated
+ */
+static PATTERN_LIST *pushPattern(COMPILER *compiler, REVERKI_TERM *pat, PATTERN_LIST *next) {
+    PATTERN_LIST *cell = reverki_arena_alloc(&compiler->patterns);
+    if(cell == NULL) {
+        compiler->failed = 1;
+        return next;
+    }
+    cell->pat = pat;
+    cell->next = next;
+    return cell;
+}
+
+/**
+ * @brief appends to a new matrix a copy of a row with different pending
+ * patterns, recording a binding if the pattern consumed was a variable
+ *
+ * @param compiler The compiler state
+ * @param tail By-reference pointer to the end of the new matrix
+ * @param row The row being copied
+ * @param pending The pending patterns of the copy
+ * @param pos The position consumed
+ * @return PATTERN_ROW** The new end of the matrix
+ */
+static PATTERN_ROW **appendRow(COMPILER *compiler, PATTERN_ROW **tail, PATTERN_ROW *row,
+                               PATTERN_LIST *pending, int pos) {
+    PATTERN_ROW *copy = reverki_arena_alloc(&compiler->rows);
+    if(copy == NULL) {
+        compiler->failed = 1;
+        return tail;
+    }
+    copy->rule = row->rule;
+    copy->priority = row->priority;
+    copy->pending = pending;
+    copy->bindings = row->bindings;
+    copy->next = NULL;
+
+    REVERKI_TERM *pat = row->pending->pat;
+    if(pat != NULL && pat->type == REVERKI_VARIABLE_TYPE) {
+        BINDING_LIST *binding = reverki_arena_alloc(&compiler->bindings);
+        if(binding == NULL) {
+            compiler->failed = 1;
+        } else {
+            binding->var = pat;
+            binding->pos = pos;
+            binding->next = row->bindings;
+            copy->bindings = binding;
+        }
+    }
+    *tail = copy;
+    return &copy->next;
+}
+
+/**
+ * @brief returns true if the next pattern of a row matches any term
+ *
+ * @param row The row
+ * @return int 1 if the pattern is a variable or anonymous wildcard, 0 if not
+ */
+static int isWildcard(PATTERN_ROW *row) {
+    REVERKI_TERM *pat = row->pending->pat;
+    return pat == NULL || pat->type == REVERKI_VARIABLE_TYPE;
+}
+
+/**
+ * @brief creates the choice for a row whose patterns have all been consumed
+ *
+ * @param compiler The compiler state
+ * @param row The row
+ * @return REVERKI_AUTOMATON_CHOICE* The choice, or NULL if memory could not be allocated
+ */
+static REVERKI_AUTOMATON_CHOICE *makeChoice(COMPILER *compiler, PATTERN_ROW *row) {
+    REVERKI_AUTOMATON_CHOICE *choice = reverki_arena_alloc(&compiler->automaton->choices);
+    int numOccurrences = 0;
+    for(BINDING_LIST *b = row->bindings; b != NULL; b = b->next) {
+        numOccurrences++;
+    }
+    if(choice == NULL ||
+       (choice->vars = malloc((numOccurrences + 1) * sizeof(REVERKI_TERM *))) == NULL ||
+       (choice->positions = malloc((numOccurrences + 1) * sizeof(int))) == NULL ||
+       (choice->checks = malloc((2 * numOccurrences + 1) * sizeof(int))) == NULL) {
+        compiler->failed = 1;
+        return NULL;
+    }
+    choice->rule = row->rule;
+    choice->priority = row->priority;
+    choice->numBindings = 0;
+    choice->numChecks = 0;
+    choice->next = NULL;
+
+    // Bindings were accumulated most recent first, so visit them in reverse
+    for(int n = numOccurrences - 1; n >= 0; n--) {
+        BINDING_LIST *b = row->bindings;
+        for(int i = 0; i < n; i++) {
+            b = b->next;
+        }
+        int first = 0;
+        while(first < choice->numBindings && *(choice->vars + first) != b->var) {
+            first++;
+        }
+        if(first < choice->numBindings) {
+            *(choice->checks + 2 * choice->numChecks) = *(choice->positions + first);
+            *(choice->checks + 2 * choice->numChecks + 1) = b->pos;
+            choice->numChecks++;
+        } else {
+            *(choice->vars + choice->numBindings) = b->var;
+            *(choice->positions + choice->numBindings) = b->pos;
+            choice->numBindings++;
+        }
+    }
+
+    // The bindings must fit in a substitution
+    if(choice->numBindings > REVERKI_MAX_BINDINGS) {
+        fprintf(stderr, "Too many variables in rule\n");
+        compiler->failed = 1;
+    }
+    return choice;
+}
+
+/**
+ * @brief computes the hash of a matrix to be compiled at a position, from the
+ * rules of its rows and the contents of their pending patterns and bindings
+ *
+ * @param rows The rows of the matrix
+ * @param pos The position
+ * @return unsigned long The hash value
+ */
+static unsigned long hashMatrix(PATTERN_ROW *rows, int pos) {
+    unsigned long h = 14695981039346656037UL ^ pos;
+    for(PATTERN_ROW *row = rows; row != NULL; row = row->next) {
+        h = (h ^ row->priority) * 1099511628211UL;
+        for(PATTERN_LIST *p = row->pending; p != NULL; p = p->next) {
+            h = (h ^ (unsigned long)p->pat) * 1099511628211UL;
+        }
+        for(BINDING_LIST *b = row->bindings; b != NULL; b = b->next) {
+            h = (h ^ (unsigned long)b->var ^ b->pos) * 1099511628211UL;
+        }
+        h = (h ^ 0xff) * 1099511628211UL;
+    }
+    return h;
+}
+
+/**
+ * @brief returns true if two matrices have the same rows, with the same
+ * pending patterns and bindings
+ *
+ * @param a The rows of one matrix
+ * @param b The rows of the other
+ * @return int 1 if they are the same, 0 if not
+ */
+static int sameMatrix(PATTERN_ROW *a, PATTERN_ROW *b) {
+    for(; a != NULL && b != NULL; a = a->next, b = b->next) {
+        if(a->priority != b->priority) {
+            return 0;
+        }
+        PATTERN_LIST *p = a->pending, *q = b->pending;
+        for(; p != q && p != NULL && q != NULL; p = p->next, q = q->next) {
+            if(p->pat != q->pat) {
+                return 0;
+            }
+        }
+        BINDING_LIST *x = a->bindings, *y = b->bindings;
+        for(; x != y && x != NULL && y != NULL; x = x->next, y = y->next) {
+            if(x->var != y->var || x->pos != y->pos) {
+                return 0;
+            }
+        }
+        if(p != q || x != y) {
+            return 0;
+        }
+    }
+    return a == b;
+}
+
+/**
+ * @brief finds the entry of the table of compiled matrices for a matrix, or
+ * the empty entry where it should be entered
+ *
+ * @param compiler The compiler state
+ * @param rows The rows of the matrix
+ * @param pos The position at which it is compiled
+ * @param hash The hash of the matrix and position
+ * @return COMPILED_MATRIX* The entry
+ */
+static COMPILED_MATRIX *findMatrix(COMPILER *compiler, PATTERN_ROW *rows, int pos, unsigned long hash) {
+    unsigned long mask = compiler->matricesSize - 1;
+    unsigned long slot = (hash ^ (hash >> 32)) & mask;
+    COMPILED_MATRIX *entry;
+    while((entry = compiler->matrices + slot)->rows != NULL) {
+        if(entry->hash == hash && entry->pos == pos && sameMatrix(entry->rows, rows)) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return entry;
+}
+
+/**
+ * @brief enters a compiled matrix into the table, doubling the size of the
+ * table first if it is half full
+ *
+ * @param compiler The compiler state
+ * @param rows The rows of the matrix
+ * @param pos The position at which it was compiled
+ * @param hash The hash of the matrix and position
+ * @param node The subtree compiled from it
+ */
+static void addMatrix(COMPILER *compiler, PATTERN_ROW *rows, int pos, unsigned long hash,
+                      REVERKI_AUTOMATON_NODE *node) {
+    if((compiler->matricesUsed + 1) * 2 > compiler->matricesSize) {
+        COMPILED_MATRIX *oldMatrices = compiler->matrices;
+        unsigned long oldSize = compiler->matricesSize;
+        unsigned long newSize = oldSize ? oldSize * 2 : AUTOMATON_MATRICES_INITIAL_SIZE;
+        if((compiler->matrices = calloc(newSize, sizeof(COMPILED_MATRIX))) == NULL) {
+            compiler->matrices = oldMatrices;
+            compiler->failed = 1;
+            return;
+        }
+        compiler->matricesSize = newSize;
+        for(unsigned long i = 0; i < oldSize; i++) {
+            COMPILED_MATRIX *old = oldMatrices + i;
+            if(old->rows != NULL) {
+                *findMatrix(compiler, old->rows, old->pos, old->hash) = *old;
+            }
+        }
+        free(oldMatrices);
+    }
+    COMPILED_MATRIX *entry = findMatrix(compiler, rows, pos, hash);
+    entry->hash = hash;
+    entry->pos = pos;
+    entry->rows = rows;
+    entry->node = node;
+    compiler->matricesUsed++;
+}
+
+static REVERKI_AUTOMATON_NODE *compileRows(COMPILER *compiler, PATTERN_ROW *rows, int pos);
+
+/**
+ * @brief compiles the child of each distinct constant in the next column of a
+ * matrix, in order of first occurrence.  The constants are grouped through a
+ * small hash table, so the rows are visited once, plus once for each group
+ * that a row with a wildcard is copied into.
+ *
+ * @param compiler The compiler state
+ * @param node The node whose edges are being compiled
+ * @param rows The rows of the matrix
+ * @param pos The number of target positions consumed before the node
+ */
+static void compileConstants(COMPILER *compiler, REVERKI_AUTOMATON_NODE *node, PATTERN_ROW *rows, int pos) {
+    int numConstants = 0;
+    for(PATTERN_ROW *row = rows; row != NULL; row = row->next) {
+        if(!isWildcard(row) && row->pending->pat->type == REVERKI_CONSTANT_TYPE) {
+            numConstants++;
+        }
+    }
+    if(numConstants == 0) {
+        return;
+    }
+    unsigned long size = 4;
+    while(size < 2 * (unsigned long)numConstants) {
+        size *= 2;
+    }
+    CONSTANT_GROUP *groups = malloc(numConstants * sizeof(CONSTANT_GROUP));
+    int *table = malloc(size * sizeof(int));
+    if(groups == NULL || table == NULL) {
+        free(groups);
+        free(table);
+        compiler->failed = 1;
+        return;
+    }
+    for(unsigned long i = 0; i < size; i++) {
+        *(table + i) = -1;
+    }
+
+    // Find the distinct constants
+    int numGroups = 0;
+    for(PATTERN_ROW *row = rows; row != NULL; row = row->next) {
+        if(isWildcard(row) || row->pending->pat->type != REVERKI_CONSTANT_TYPE) {
+            continue;
+        }
+        REVERKI_ATOM *atom = row->pending->pat->value.atom;
+        unsigned long h = (unsigned long)atom * 0x9e3779b97f4a7c15UL;
+        unsigned long slot = (h >> 32) & (size - 1);
+        while(*(table + slot) >= 0 && (groups + *(table + slot))->atom != atom) {
+            slot = (slot + 1) & (size - 1);
+        }
+        if(*(table + slot) < 0) {
+            *(table + slot) = numGroups;
+            (groups + numGroups)->atom = atom;
+            (groups + numGroups)->rows = NULL;
+            (groups + numGroups)->tail = &(groups + numGroups)->rows;
+            numGroups++;
+        }
+    }
+
+    // Share out the rows, those with a wildcard to every group
+    for(PATTERN_ROW *row = rows; row != NULL; row = row->next) {
+        if(isWildcard(row)) {
+            for(int i = 0; i < numGroups; i++) {
+                CONSTANT_GROUP *group = groups + i;
+                group->tail = appendRow(compiler, group->tail, row, row->pending->next, pos);
+            }
+        } else if(row->pending->pat->type == REVERKI_CONSTANT_TYPE) {
+            REVERKI_ATOM *atom = row->pending->pat->value.atom;
+            unsigned long h = (unsigned long)atom * 0x9e3779b97f4a7c15UL;
+            unsigned long slot = (h >> 32) & (size - 1);
+            while((groups + *(table + slot))->atom != atom) {
+                slot = (slot + 1) & (size - 1);
+            }
+            CONSTANT_GROUP *group = groups + *(table + slot);
+            group->tail = appendRow(compiler, group->tail, row, row->pending->next, pos);
+        }
+    }
+    free(table);
+
+    for(int i = 0; i < numGroups; i++) {
+        REVERKI_AUTOMATON_NODE *child = compileRows(compiler, (groups + i)->rows, pos + 1);
+        if(child != NULL && addEdge(compiler->automaton, node, (groups + i)->atom, child)) {
+            compiler->failed = 1;
+        }
+    }
+    free(groups);
+}
+
+/**
+ * @brief compiles a pattern matrix into a decision tree
+ *
+ * @param compiler The compiler state
+ * @param rows The rows of the matrix, in rule-list order; all rows have the same
+ * number of pending patterns
+ * @param pos The number of target positions consumed before this node
+ * @return REVERKI_AUTOMATON_NODE* The root of the decision tree, or NULL if no
+ * rule can match
+ */
+static REVERKI_AUTOMATON_NODE *compileRows(COMPILER *compiler, PATTERN_ROW *rows, int pos) {
+    if(rows == NULL || compiler->failed) {
+        return NULL;
+    }
+    unsigned long hash = hashMatrix(rows, pos);
+    if(compiler->matricesSize > 0) {
+        COMPILED_MATRIX *entry = findMatrix(compiler, rows, pos, hash);
+        if(entry->rows != NULL) {
+            return entry->node;
+        }
+    }
+    REVERKI_AUTOMATON_NODE *node = reverki_arena_alloc(&compiler->automaton->nodes);
+    if(node == NULL) {
+        compiler->failed = 1;
+        return NULL;
+    }
+    node->pairChild = NULL;
+    node->otherChild = NULL;
+    node->choices = NULL;
+    if(pos > compiler->automaton->maxPositions) {
+        compiler->automaton->maxPositions = pos;
+    }
+
+    // All the patterns have been consumed
+    if(rows->pending == NULL) {
+        node->kind = AUTOMATON_LEAF;
+        REVERKI_AUTOMATON_CHOICE **tail = &node->choices;
+        for(PATTERN_ROW *row = rows; row != NULL; row = row->next) {
+            if((*tail = makeChoice(compiler, row)) != NULL) {
+                tail = &(*tail)->next;
+            }
+        }
+        addMatrix(compiler, rows, pos, hash, node);
+        return node;
+    }
+
+    int anyPair = 0;
+    PATTERN_ROW *others = NULL;
+    PATTERN_ROW **othersTail = &others;
+    for(PATTERN_ROW *row = rows; row != NULL; row = row->next) {
+        if(isWildcard(row)) {
+            othersTail = appendRow(compiler, othersTail, row, row->pending->next, pos);
+        } else if(row->pending->pat->type == REVERKI_PAIR_TYPE) {
+            anyPair = 1;
+        }
+    }
+
+    // Only wildcards here, so the target need not be examined
+    node->kind = AUTOMATON_SKIP;
+    for(PATTERN_ROW *row = rows; row != NULL; row = row->next) {
+        if(!isWildcard(row)) {
+            node->kind = AUTOMATON_SWITCH;
+        }
+    }
+    node->otherChild = compileRows(compiler, others, pos + 1);
+    if(node->kind == AUTOMATON_SKIP) {
+        addMatrix(compiler, rows, pos, hash, node);
+        return node;
+    }
+
+    if(anyPair) {
+        PATTERN_ROW *pairs = NULL;
+        PATTERN_ROW **pairsTail = &pairs;
+        for(PATTERN_ROW *row = rows; row != NULL; row = row->next) {
+            REVERKI_TERM *pat = row->pending->pat;
+            PATTERN_LIST *rest = row->pending->next;
+            if(isWildcard(row)) {
+                rest = pushPattern(compiler, NULL, pushPattern(compiler, NULL, rest));
+                pairsTail = appendRow(compiler, pairsTail, row, rest, pos);
+            } else if(pat->type == REVERKI_PAIR_TYPE) {
+                rest = pushPattern(compiler, pat->value.pair.fst, pushPattern(compiler, pat->value.pair.snd, rest));
+                pairsTail = appendRow(compiler, pairsTail, row, rest, pos);
+            }
+        }
+        node->pairChild = compileRows(compiler, pairs, pos + 1);
+    }
+
+    // One child for each distinct constant, in order of first occurrence
+    compileConstants(compiler, node, rows, pos);
+    addMatrix(compiler, rows, pos, hash, node);
+    return node;
+}
+
+/*
+ * @brief  Compile a list of rules into a matching automaton.
+ * @param rule_list  The list of rules.
+ * @return  The automaton, or NULL if memory could not be allocated.
+ */
+REVERKI_AUTOMATON *reverki_compile_rules(REVERKI_RULE *rule_list) {
+    REVERKI_AUTOMATON *automaton = calloc(1, sizeof(REVERKI_AUTOMATON));
+    if(automaton == NULL) {
+        return NULL;
+    }
+    REVERKI_ARENA nodes = REVERKI_ARENA_INIT(REVERKI_AUTOMATON_NODE, 8);
+    REVERKI_ARENA choices = REVERKI_ARENA_INIT(REVERKI_AUTOMATON_CHOICE, 8);
+    automaton->nodes = nodes;
+    automaton->choices = choices;
+
+    COMPILER compiler = {
+        automaton,
+        REVERKI_ARENA_INIT(PATTERN_LIST, 10),
+        REVERKI_ARENA_INIT(BINDING_LIST, 10),
+        REVERKI_ARENA_INIT(PATTERN_ROW, 10),
+        NULL, 0, 0,
+        0
+    };
+    PATTERN_ROW *rows = NULL;
+    PATTERN_ROW **tail = &rows;
+    int priority = 0;
+    while(rule_list != NULL) {
+        PATTERN_ROW *row = reverki_arena_alloc(&compiler.rows);
+        if(row == NULL) {
+            compiler.failed = 1;
+            break;
+        }
+        row->rule = rule_list;
+        row->priority = priority++;
+        row->pending = pushPattern(&compiler, rule_list->lhs, NULL);
+        row->bindings = NULL;
+        row->next = NULL;
+        *tail = row;
+        tail = &row->next;
+        rule_list = rule_list->next;
+    }
+
+    automaton->root = compileRows(&compiler, rows, 0);
+    reverki_arena_destroy(&compiler.patterns);
+    reverki_arena_destroy(&compiler.bindings);
+    reverki_arena_destroy(&compiler.rows);
+    free(compiler.matrices);
+
+    if(compiler.failed) {
+        return NULL;
+    }
+    return automaton;
+}
+
+/*
+ * @brief  Find the first rule, following a specified position in the rule list,
+ * whose left-hand side matches a specified term.
+ * @details  The automaton is run on the term.  If a rule is found, then
+ * (if substp is not NULL) a substitution is constructed that maps the variables
+ * of the left-hand side of the rule to the corresponding subterms of the term.
+ * As with reverki_match, the slots are filled in the order in which the
+ * variables first occur in the left-hand side, so the slot of each variable is
+ * the number it was given when the rule was parsed.
+ * @param automaton  The automaton compiled from the rule list.
+ * @param term  The term to be matched.
+ * @param after  Only rules occurring after this position in the rule list
+ * (counting from 0) are considered; -1 to consider all the rules.
+ * @param priorityp  If a rule is found, its position in the rule list is
+ * stored in the variable this points to.
+ * @param substp  If not NULL, a by-reference parameter that receives the
+ * substitution.  Any bindings it held before are replaced.
+ * @return  The rule, or NULL if none of the rules considered matches the term.
+ */
+REVERKI_RULE *reverki_automaton_match(REVERKI_AUTOMATON *automaton, REVERKI_TERM *term, int after,
+                                      int *priorityp, REVERKI_SUBST *substp) {
+    REVERKI_PROFILE_ENTER(REVERKI_PROFILE_AUTOMATON);
+    // Each position consumed leaves at most one more pending subterm
+    int size = automaton->maxPositions + 2;
+    if(matchSize < size) {
+        REVERKI_TERM **newStack = realloc(matchStack, size * sizeof(REVERKI_TERM *));
+        REVERKI_TERM **newPositions = newStack == NULL ? NULL : realloc(matchPositions, size * sizeof(REVERKI_TERM *));
+        if(newStack != NULL) {
+            matchStack = newStack;
+        }
+        if(newPositions == NULL) {
+            fprintf(stderr, "Could not allocate matching storage\n");
+            abort();
+        }
+        matchPositions = newPositions;
+        matchSize = size;
+    }
+    REVERKI_AUTOMATON_NODE *node = automaton->root;
+    REVERKI_TERM **stack = matchStack;
+    REVERKI_TERM **positions = matchPositions;
+    int depth = 0, pos = 0;
+    *(stack + depth++) = term;
+
+    while(node != NULL && node->kind != AUTOMATON_LEAF) {
+        REVERKI_PROFILE_NODE(REVERKI_PROFILE_AUTOMATON);
+        term = *(stack + --depth);
+        *(positions + pos++) = term;
+        if(node->kind == AUTOMATON_SKIP) {
+            node = node->otherChild;
+        } else if(term->type == REVERKI_PAIR_TYPE && node->pairChild != NULL) {
+            *(stack + depth++) = term->value.pair.snd;
+            *(stack + depth++) = term->value.pair.fst;
+            node = node->pairChild;
+        } else if(term->type == REVERKI_CONSTANT_TYPE && automaton->edgesSize > 0) {
+            REVERKI_AUTOMATON_EDGE *edge = findEdge(automaton, node, term->value.atom);
+            node = edge->parent != NULL ? edge->child : node->otherChild;
+        } else {
+            node = node->otherChild;
+        }
+    }
+    if(node == NULL) {
+        return NULL;
+    }
+
+    int counting = (global_options & STATISTICS_OPTION) == STATISTICS_OPTION;
+    for(REVERKI_AUTOMATON_CHOICE *choice = node->choices; choice != NULL; choice = choice->next) {
+        if(choice->priority <= after) {
+            continue;
+        }
+        int consistent = 1;
+        for(int i = 0; i < choice->numChecks && consistent; i++) {
+            consistent = *(positions + *(choice->checks + 2 * i)) == *(positions + *(choice->checks + 2 * i + 1));
+        }
+        if(counting) {
+            __atomic_add_fetch(&choice->rule->attempts, 1, __ATOMIC_RELAXED);
+            if(!consistent) {
+                __atomic_add_fetch(&choice->rule->failures, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if(!consistent) {
+            continue;
+        }
+        if(substp != NULL) {
+            for(int i = 0; i < choice->numBindings; i++) {
+                *(substp->vars + i) = *(choice->vars + i);
+                *(substp->values + i) = *(positions + *(choice->positions + i));
+            }
+            substp->count = choice->numBindings;
+        }
+        *priorityp = choice->priority;
+        return choice->rule;
+    }
+    return NULL;
+}
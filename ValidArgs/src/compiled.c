@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "reverki.h"
+#include "global.h"
+#include "write.h"
+
+/*
+ * Compiled form of the rules and terms read from the input.  The file starts
+ * with a header, which is followed by three tables and the pnames of the atoms:
+ *   - the distinct subterms of the rules and terms, in an order in which the
+ *     subterms of a pair come before it, so that a subterm shared by several
+ *     terms is stored only once;
+ *   - the rules, in the order in which they were read, as the numbers of
+ *     their left-hand and right-hand sides in the table of subterms;
+ *   - the terms read, in order, as numbers in the table of subterms.
+ * Nothing in the file is a pointer: subterms are referred to by their numbers,
+ * and pnames by their offsets from the start of the pnames.  The file can
+ * therefore be mapped into memory and used where it lies.  Numbers are stored
+ * in the byte order of the machine that wrote the file, which is checked when
+ * the file is loaded.
+ */
+#define RVK_VERSION 1
+#define RVK_BYTE_ORDER 0x01020304U
+
+typedef struct rvk_header {
+    unsigned char magic0, magic1, magic2;      // 'R', 'V', 'K'.
+    unsigned char version;                     // RVK_VERSION.
+    unsigned int byteOrder;                    // RVK_BYTE_ORDER.
+    unsigned int numTerms;                     // Number of subterms.
+    unsigned int numRules;                     // Number of rules.
+    unsigned int numInputs;                    // Number of terms read.
+    unsigned int nameSize;                     // Number of bytes of pnames.
+    unsigned int termOffset;                   // Offsets of the tables and the
+    unsigned int ruleOffset;                   // pnames from the start of the
+    unsigned int inputOffset;                  // file.
+    unsigned int nameOffset;
+} RVK_HEADER;
+
+typedef struct rvk_term {
+    int fst;                       // Number of the first subterm, or offset of the pname.
+    int snd;                       // Number of the second subterm, or -1 for an atom.
+} RVK_TERM;
+
+typedef struct rvk_rule {
+    unsigned int lhs;              // Number of the left-hand side.
+    unsigned int rhs;              // Number of the right-hand side.
+} RVK_RULE;
+
+/*
+ * State of the writer: the tables being built, and a table (open-addressed,
+ * with linear probing) that maps each term already numbered to its number.
+ */
+typedef struct term_number {
+    REVERKI_TERM *term;            // The term, or NULL if the entry is empty.
+    int number;                    // Its number in the table of subterms.
+} TERM_NUMBER;
+
+typedef struct writer {
+    TERM_NUMBER *numbers;
+    unsigned long numbersSize;
+    RVK_TERM *terms;
+    int numTerms;
+    int maxTerms;
+    char *names;
+    unsigned int nameSize;
+    unsigned int maxNames;
+    REVERKI_TERM **stack;
+    int maxStack;
+} WRITER;
+
+/**
+ * @brief finds the entry of the number table for a term, or the empty entry
+ * where it should be entered
+ *
+ * @param writer The writer
+ * @param term The term
+ * @return TERM_NUMBER* The entry
+ */
+static TERM_NUMBER *findNumber(WRITER *writer, REVERKI_TERM *term) {
+    unsigned long mask = writer->numbersSize - 1;
+    unsigned long h = (unsigned long)term * 0x9e3779b97f4a7c15UL;
+    unsigned long index = (h >> 32) & mask;
+    while((writer->numbers + index)->term != NULL && (writer->numbers + index)->term != term) {
+        index = (index + 1) & mask;
+    }
+    return writer->numbers + index;
+}
+
+/**
+ * @brief gives the next number to a term whose subterms have all been numbered,
+ * appending it to the table of subterms and growing the tables as necessary
+ *
+ * @param writer The writer
+ * @param term The term
+ * @return int 0 if successful, -1 if memory could not be allocated
+ */
+static int numberTerm(WRITER *writer, REVERKI_TERM *term) {
+    if((unsigned long)(writer->numTerms + 1) * 2 > writer->numbersSize) {
+        TERM_NUMBER *oldNumbers = writer->numbers;
+        unsigned long oldSize = writer->numbersSize;
+        unsigned long newSize = oldSize ? oldSize * 2 : 1024;
+        if((writer->numbers = calloc(newSize, sizeof(TERM_NUMBER))) == NULL) {
+            writer->numbers = oldNumbers;
+            return -1;
+        }
+        writer->numbersSize = newSize;
+        for(unsigned long i = 0; i < oldSize; i++) {
+            if((oldNumbers + i)->term != NULL) {
+                *findNumber(writer, (oldNumbers + i)->term) = *(oldNumbers + i);
+            }
+        }
+        free(oldNumbers);
+    }
+    if(writer->numTerms == writer->maxTerms) {
+        int newMax = writer->maxTerms ? writer->maxTerms * 2 : 1024;
+        RVK_TERM *newTerms = realloc(writer->terms, newMax * sizeof(RVK_TERM));
+        if(newTerms == NULL) {
+            return -1;
+        }
+        writer->terms = newTerms;
+        writer->maxTerms = newMax;
+    }
+
+    RVK_TERM *record = writer->terms + writer->numTerms;
+    if(term->type == REVERKI_PAIR_TYPE) {
+        record->fst = findNumber(writer, term->value.pair.fst)->number;
+        record->snd = findNumber(writer, term->value.pair.snd)->number;
+    } else {
+        char *pname = term->value.atom->pname;
+        int length = 0;
+        while(*(pname + length++) != '\0');
+        if(writer->nameSize + length > writer->maxNames) {
+            unsigned int newMax = writer->maxNames ? writer->maxNames * 2 : 4096;
+            char *newNames = realloc(writer->names, newMax);
+            if(newNames == NULL) {
+                return -1;
+            }
+            writer->names = newNames;
+            writer->maxNames = newMax;
+        }
+        record->fst = writer->nameSize;
+        record->snd = -1;
+        for(int i = 0; i < length; i++) {
+            *(writer->names + writer->nameSize++) = *(pname + i);
+        }
+    }
+    TERM_NUMBER *entry = findNumber(writer, term);
+    entry->term = term;
+    entry->number = writer->numTerms++;
+    return 0;
+}
+
+/**
+ * @brief numbers a term and all its subterms that have not yet been numbered,
+ * subterms first, using an explicit stack so that the depth of the term is not
+ * limited by the depth of the C stack
+ *
+ * @param writer The writer
+ * @param term The term
+ * @return int The number of the term, or -1 if memory could not be allocated
+ */
+static int numberSubterms(WRITER *writer, REVERKI_TERM *term) {
+    int depth = 0;
+    REVERKI_TERM *top = term;
+    while(1) {
+        if(writer->numbersSize == 0 || findNumber(writer, top)->term == NULL) {
+            // Number the subterms first, then come back to this term
+            REVERKI_TERM *next = NULL;
+            if(top->type == REVERKI_PAIR_TYPE) {
+                if(writer->numbersSize == 0 || findNumber(writer, top->value.pair.fst)->term == NULL) {
+                    next = top->value.pair.fst;
+                } else if(findNumber(writer, top->value.pair.snd)->term == NULL) {
+                    next = top->value.pair.snd;
+                }
+            }
+            if(next != NULL) {
+                if(depth == writer->maxStack) {
+                    int newMax = writer->maxStack ? writer->maxStack * 2 : 1024;
+                    REVERKI_TERM **newStack = realloc(writer->stack, newMax * sizeof(REVERKI_TERM *));
+                    if(newStack == NULL) {
+                        return -1;
+                    }
+                    writer->stack = newStack;
+                    writer->maxStack = newMax;
+                }
+                *(writer->stack + depth++) = top;
+                top = next;
+                continue;
+            }
+            if(numberTerm(writer, top)) {
+                return -1;
+            }
+        }
+        if(depth == 0) {
+            return findNumber(writer, term)->number;
+        }
+        top = *(writer->stack + --depth);
+    }
+}
+
+/*
+ * @brief  Write the rules read so far, and specified terms, to a file in
+ * compiled form.
+ * @param path  The name of the file.
+ * @param terms  The terms.
+ * @param count  The number of terms.
+ * @return  0 if successful, -1 if the file could not be written.
+ */
+int reverki_write_compiled(char *path, REVERKI_TERM **terms, int count) {
+    WRITER writer = {NULL, 0, NULL, 0, 0, NULL, 0, 0, NULL, 0};
+    int numRules = *pRuleCounter;
+    RVK_RULE *rules = malloc((numRules ? numRules : 1) * sizeof(RVK_RULE));
+    unsigned int *inputs = malloc((count ? count : 1) * sizeof(unsigned int));
+    int failed = rules == NULL || inputs == NULL;
+    for(int i = 0; i < numRules && !failed; i++) {
+        REVERKI_RULE *rule = reverki_arena_get(&reverki_rule_arena, i);
+        int lhs = numberSubterms(&writer, rule->lhs);
+        int rhs = numberSubterms(&writer, rule->rhs);
+        failed = lhs < 0 || rhs < 0;
+        (rules + i)->lhs = lhs;
+        (rules + i)->rhs = rhs;
+    }
+    for(int i = 0; i < count && !failed; i++) {
+        int number = numberSubterms(&writer, *(terms + i));
+        failed = number < 0;
+        *(inputs + i) = number;
+    }
+
+    FILE *out = NULL;
+    if(!failed && (out = fopen(path, "wb")) != NULL) {
+        RVK_HEADER header;
+        header.magic0 = 'R';
+        header.magic1 = 'V';
+        header.magic2 = 'K';
+        header.version = RVK_VERSION;
+        header.byteOrder = RVK_BYTE_ORDER;
+        header.numTerms = writer.numTerms;
+        header.numRules = numRules;
+        header.numInputs = count;
+        header.nameSize = writer.nameSize;
+        header.termOffset = sizeof(RVK_HEADER);
+        header.ruleOffset = header.termOffset + writer.numTerms * sizeof(RVK_TERM);
+        header.inputOffset = header.ruleOffset + numRules * sizeof(RVK_RULE);
+        header.nameOffset = header.inputOffset + count * sizeof(unsigned int);
+        failed = fwrite(&header, sizeof(RVK_HEADER), 1, out) != 1 ||
+                 fwrite(writer.terms, sizeof(RVK_TERM), writer.numTerms, out) != writer.numTerms ||
+                 fwrite(rules, sizeof(RVK_RULE), numRules, out) != numRules ||
+                 fwrite(inputs, sizeof(unsigned int), count, out) != count ||
+                 fwrite(writer.names, 1, writer.nameSize, out) != writer.nameSize;
+        failed = fclose(out) || failed;
+    } else {
+        failed = 1;
+    }
+    free(writer.numbers);
+    free(writer.terms);
+    free(writer.names);
+    free(writer.stack);
+    free(rules);
+    free(inputs);
+    if(failed) {
+        fprintf(stderr, "Could not write compiled file %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Determine whether an input is in compiled form.
+ * @param input  The input, from which nothing must yet have been consumed.
+ * @return  1 if the input starts as a compiled file does, otherwise 0.
+ */
+int reverki_is_compiled(REVERKI_INPUT *input) {
+    if(REVERKI_INPUT_PEEK(input) == EOF || input->end - input->cur < 4) {
+        return 0;
+    }
+    return *input->cur == 'R' && *(input->cur + 1) == 'V' && *(input->cur + 2) == 'K' &&
+           *(input->cur + 3) == RVK_VERSION;
+}
+
+/**
+ * @brief returns all the remaining characters of an input, in memory
+ *
+ * @param input The input
+ * @param sizep By-reference number of characters
+ * @param copyp By-reference memory to be freed by the caller, or NULL if the
+ * characters are those of a mapping
+ * @return char* The characters, or NULL if memory could not be allocated
+ */
+static char *remainingInput(REVERKI_INPUT *input, size_t *sizep, char **copyp) {
+    size_t size = input->end - input->cur;
+    *copyp = NULL;
+
+    // A mapping can be used where it lies, if its records are aligned
+    if(input->mapped && !((unsigned long)input->cur & (sizeof(int) - 1))) {
+        *sizep = size;
+        return input->cur;
+    }
+    size_t capacity = size > 4096 ? size * 2 : 8192;
+    char *copy = malloc(capacity);
+    if(copy == NULL) {
+        return NULL;
+    }
+    for(size_t i = 0; i < size; i++) {
+        *(copy + i) = *(input->cur + i);
+    }
+    input->cur = input->end;
+    while(input->stream != NULL) {
+        if(size == capacity) {
+            char *newCopy = realloc(copy, capacity *= 2);
+            if(newCopy == NULL) {
+                free(copy);
+                return NULL;
+            }
+            copy = newCopy;
+        }
+        size_t count = fread(copy + size, 1, capacity - size, input->stream);
+        if(count == 0) {
+            break;
+        }
+        size += count;
+    }
+    *sizep = size;
+    *copyp = copy;
+    return copy;
+}
+
+/**
+ * @brief checks that a table lies within a file
+ *
+ * @param offset The offset of the table
+ * @param count The number of records in the table
+ * @param recordSize The size of a record
+ * @param size The size of the file
+ * @return int 1 if the table lies within the file, 0 if not
+ */
+static int tableFits(unsigned int offset, unsigned int count, size_t recordSize, size_t size) {
+    return !(offset & (sizeof(int) - 1)) && offset <= size && count <= (size - offset) / recordSize;
+}
+
+/**
+ * @brief creates the terms, rules and terms read that are recorded in a
+ * compiled file, checking that the file is well formed
+ *
+ * @param data The contents of the file
+ * @param size The size of the file
+ * @param termsp By-reference array of the terms read, allocated with malloc
+ * @param countp By-reference number of terms read
+ * @param rulep By-reference list of rules, headed by the last rule
+ * @return int 0 if successful, -1 if not
+ */
+static int loadTables(char *data, size_t size, REVERKI_TERM ***termsp, int *countp, REVERKI_RULE **rulep) {
+    RVK_HEADER *header = (RVK_HEADER *)data;
+    if(size < sizeof(RVK_HEADER) || header->byteOrder != RVK_BYTE_ORDER ||
+       !tableFits(header->termOffset, header->numTerms, sizeof(RVK_TERM), size) ||
+       !tableFits(header->ruleOffset, header->numRules, sizeof(RVK_RULE), size) ||
+       !tableFits(header->inputOffset, header->numInputs, sizeof(unsigned int), size) ||
+       header->nameOffset > size || header->nameSize > size - header->nameOffset ||
+       (header->nameSize > 0 && *(data + header->nameOffset + header->nameSize - 1) != '\0') ||
+       header->numTerms > __INT_MAX__ || header->numInputs > __INT_MAX__) {
+        return -1;
+    }
+    RVK_TERM *records = (RVK_TERM *)(data + header->termOffset);
+    RVK_RULE *rules = (RVK_RULE *)(data + header->ruleOffset);
+    unsigned int *inputs = (unsigned int *)(data + header->inputOffset);
+    char *names = data + header->nameOffset;
+
+    REVERKI_TERM **made = malloc((header->numTerms ? header->numTerms : 1) * sizeof(REVERKI_TERM *));
+    REVERKI_TERM **terms = malloc((header->numInputs ? header->numInputs : 1) * sizeof(REVERKI_TERM *));
+    if(made == NULL || terms == NULL) {
+        free(made);
+        free(terms);
+        return -1;
+    }
+    for(int i = 0; i < (int)header->numTerms; i++) {
+        RVK_TERM *record = records + i;
+        REVERKI_TERM *term = NULL;
+        if(record->snd == -1) {
+            REVERKI_ATOM *atom;
+            if(record->fst >= 0 && record->fst < header->nameSize &&
+               (atom = reverki_intern_atom(names + record->fst)) != NULL) {
+                term = atom->type == REVERKI_VARIABLE_TYPE ? reverki_make_variable(atom) :
+                                                             reverki_make_constant(atom);
+            }
+        } else if(record->fst >= 0 && record->fst < i && record->snd >= 0 && record->snd < i) {
+            term = reverki_make_pair(*(made + record->fst), *(made + record->snd));
+        }
+        if(term == NULL) {
+            free(made);
+            free(terms);
+            return -1;
+        }
+        *(made + i) = term;
+    }
+    for(int i = 0; i < (int)header->numRules; i++) {
+        RVK_RULE *rule = rules + i;
+        if(rule->lhs >= header->numTerms || rule->rhs >= header->numTerms ||
+           (*rulep = reverki_define_rule(*(made + rule->lhs), *(made + rule->rhs))) == NULL) {
+            free(made);
+            free(terms);
+            return -1;
+        }
+    }
+    for(int i = 0; i < (int)header->numInputs; i++) {
+        if(*(inputs + i) >= header->numTerms) {
+            free(made);
+            free(terms);
+            return -1;
+        }
+        *(terms + i) = *(made + *(inputs + i));
+    }
+    free(made);
+    *termsp = terms;
+    *countp = header->numInputs;
+    return 0;
+}
+
+/*
+ * @brief  Load the rules and terms recorded in a compiled input.
+ * @details  The rules are created as if they had been read, in the order in
+ * which they were originally read.  If the input is a mapped file, then the
+ * records are used where they lie in the mapping; otherwise the input is first
+ * read into memory.
+ * @param input  The input, which must be in compiled form.
+ * @param termsp  By-reference array, allocated with malloc, of the terms that
+ * were read, in order.
+ * @param countp  By-reference number of terms that were read.
+ * @param rulep  By-reference list of the rules, set to the last rule if there
+ * are any, and otherwise left unchanged.
+ * @return  0 if successful, -1 if the input is not a well-formed compiled file.
+ */
+int reverki_load_compiled(REVERKI_INPUT *input, REVERKI_TERM ***termsp, int *countp, REVERKI_RULE **rulep) {
+    size_t size;
+    char *copy;
+    char *data = remainingInput(input, &size, &copy);
+    if(data == NULL || loadTables(data, size, termsp, countp, rulep)) {
+        free(copy);
+        fprintf(stderr, "Invalid compiled file\n");
+        return -1;
+    }
+    free(copy);
+    return 0;
+}
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "reverki.h"
+#include "global.h"
+#include "write.h"
+
+/*
+ * Input layer used by the parsers.  Characters are taken from a buffer through
+ * a cursor, and the buffer is only refilled once the cursor reaches its end.
+ * The buffer is either a memory mapping of the whole of a regular file, in
+ * which case it is never refilled, or a block of memory that is refilled from
+ * a stream.  Reading through a cursor avoids paying for the locking that the
+ * stdio functions perform on every character.
+ */
+#define INPUT_BUFFER_SIZE (1 << 20)
+
+/*
+ * Character classes, indexed by the value of an (unsigned) character.
+ * Whitespace separates atoms; an atom consists of characters of class
+ * REVERKI_ATOM_CHAR, and is a variable if it starts with one of class
+ * REVERKI_LOWER_CHAR.  The punctuation characters '(', ')', '[', ']' and ','
+ * belong to no class.
+ */
+const unsigned char reverki_char_class[256] = {
+    ['\t' ... '\r'] = REVERKI_SPACE_CHAR,
+    [' '] = REVERKI_SPACE_CHAR,
+    ['!' ... '\''] = REVERKI_ATOM_CHAR,
+    ['*' ... '+'] = REVERKI_ATOM_CHAR,
+    ['-' ... 'Z'] = REVERKI_ATOM_CHAR,
+    ['\\'] = REVERKI_ATOM_CHAR,
+    ['^' ... '`'] = REVERKI_ATOM_CHAR,
+    ['a' ... 'z'] = REVERKI_ATOM_CHAR | REVERKI_LOWER_CHAR,
+    ['{' ... '~'] = REVERKI_ATOM_CHAR,
+    [128 ... 255] = REVERKI_ATOM_CHAR
+};
+
+/**
+ * @brief maps the whole of the file underlying a stream into memory, if it is
+ * a regular file
+ *
+ * @param input The input, whose cursor is set to the current position of the stream
+ * @param in The stream, which must not have been read from yet
+ * @return int 0 if successful, -1 if the file could not be mapped
+ */
+static int mapFile(REVERKI_INPUT *input, FILE *in) {
+    struct stat st;
+    long offset = ftell(in);
+    if(fstat(fileno(in), &st) || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+       offset < 0 || offset > st.st_size) {
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    input->stream = NULL;
+    input->buffer = map;
+    input->size = st.st_size;
+    input->mapped = 1;
+    input->cur = map + offset;
+    input->end = map + st.st_size;
+    return 0;
+}
+
+/*
+ * @brief  Prepare to read the remainder of a stream through a large buffer.
+ * @details  If the stream is a regular file, then the file is mapped into
+ * memory; otherwise the stream is read a block at a time into a buffer.  In
+ * either case, the stream itself must not be used again until the input has
+ * been closed, and the characters read through the input are lost to it.
+ * @param input  The input to be initialized.
+ * @param in  The stream, which must not have been read from yet.
+ * @return  0 if successful, -1 if memory could not be allocated.
+ */
+int reverki_input_open(REVERKI_INPUT *input, FILE *in) {
+    if(!mapFile(input, in)) {
+        return 0;
+    }
+    if((input->buffer = malloc(INPUT_BUFFER_SIZE)) == NULL) {
+        return -1;
+    }
+    input->stream = in;
+    input->size = INPUT_BUFFER_SIZE;
+    input->mapped = 0;
+    input->cur = input->end = input->buffer;
+    return 0;
+}
+
+/*
+ * @brief  Prepare to read from a stream a character at a time.
+ * @details  No character is read from the stream until it is needed, and when
+ * the input is closed the one character that may have been looked at but not
+ * consumed is pushed back, so that the stream can be used again afterwards.
+ * @param input  The input to be initialized.
+ * @param in  The stream.
+ */
+void reverki_input_wrap(REVERKI_INPUT *input, FILE *in) {
+    input->stream = in;
+    input->buffer = &input->last;
+    input->size = 1;
+    input->mapped = 0;
+    input->cur = input->end = input->buffer;
+}
+
+/*
+ * @brief  Stop reading from an input.
+ * @details  The buffer or mapping is released.  If the input was made by
+ * reverki_input_wrap, then the character not yet consumed, if any, is pushed
+ * back onto the stream.
+ * @param input  The input.
+ */
+void reverki_input_close(REVERKI_INPUT *input) {
+    if(input->mapped) {
+        munmap(input->buffer, input->size);
+    } else if(input->buffer == &input->last) {
+        if(input->cur < input->end) {
+            ungetc((unsigned char)*input->cur, input->stream);
+        }
+    } else {
+        free(input->buffer);
+    }
+    input->buffer = input->cur = input->end = NULL;
+}
+
+/*
+ * @brief  Refill the buffer of an input whose cursor has reached its end.
+ * @details  This is called by REVERKI_INPUT_PEEK; it should not be necessary
+ * to call it directly.
+ * @param input  The input.
+ * @return  The character now at the cursor, or EOF if there are no more.
+ */
+int reverki_input_fill(REVERKI_INPUT *input) {
+    if(input->stream == NULL) {
+        return EOF;
+    }
+    size_t count = fread(input->buffer, 1, input->size, input->stream);
+    input->cur = input->buffer;
+    input->end = input->buffer + count;
+    return count ? (unsigned char)*input->cur : EOF;
+}
+
+/*
+ * @brief  Skip over whitespace.
+ * @param input  The input.
+ * @return  The first character that is not whitespace, which is left
+ * unconsumed, or EOF if there is none.
+ */
+int reverki_input_skip_space(REVERKI_INPUT *input) {
+    while(1) {
+        while(input->cur < input->end &&
+              (*(reverki_char_class + (unsigned char)*input->cur) & REVERKI_SPACE_CHAR)) {
+            input->cur++;
+        }
+        if(input->cur < input->end) {
+            return (unsigned char)*input->cur;
+        }
+        if(reverki_input_fill(input) == EOF) {
+            return EOF;
+        }
+    }
+}
+
+/*
+ * @brief  Read the characters of an atom.
+ * @details  Characters of class REVERKI_ATOM_CHAR are consumed for as long as
+ * there are any, and stored as a null-terminated string.  If there are more
+ * than REVERKI_PNAME_BUFFER_SIZE-1 of them, then they are all consumed but only
+ * the first REVERKI_PNAME_BUFFER_SIZE-1 are stored.
+ * @param input  The input.
+ * @param pname  The buffer, of size REVERKI_PNAME_BUFFER_SIZE, in which to
+ * store the characters.
+ * @return  The number of characters read, or -1 if there were too many.
+ */
+int reverki_input_atom(REVERKI_INPUT *input, char *pname) {
+    int length = 0;
+    int c;
+    while((c = REVERKI_INPUT_PEEK(input)) != EOF && (*(reverki_char_class + c) & REVERKI_ATOM_CHAR)) {
+        if(length < REVERKI_PNAME_BUFFER_SIZE - 1) {
+            *(pname + length) = c;
+        }
+        length++;
+        REVERKI_INPUT_NEXT(input);
+    }
+    if(length > REVERKI_PNAME_BUFFER_SIZE - 1) {
+        *(pname + REVERKI_PNAME_BUFFER_SIZE - 1) = '\0';
+        return -1;
+    }
+    *(pname + length) = '\0';
+    return length;
+}
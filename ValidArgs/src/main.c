@@ -32,53 +32,143 @@ int main(int argc, char **argv)
     (global_options & REWRITE_OPTION) == REWRITE_OPTION) {
         // PARSING TERMS AND RULES/REVERKI_MATCH
         int c;
-        while((c = fgetc(stdin)) != EOF) {
+        REVERKI_TERM *lastTerm = NULL;
+        REVERKI_RULE *lastRule = NULL;
+        int batch = (global_options & BATCH_OPTION) == BATCH_OPTION;
+        REVERKI_TERM **terms = NULL;
+        int numTerms = 0, maxTerms = 0;
+        REVERKI_INPUT input;
+        double start = reverki_clock();
+        if(reverki_input_open(&input, stdin)) {
+            fprintf(stderr, "Could not allocate input buffer\n");
+            return EXIT_FAILURE;
+        }
+        // Compiled input needs no parsing: its rules and terms are loaded as they are
+        int compiled = reverki_is_compiled(&input);
+        if(compiled) {
+            if(reverki_load_compiled(&input, &terms, &numTerms, &lastRule)) {
+                return EXIT_FAILURE;
+            }
+            if(numTerms > 0) {
+                lastTerm = *(terms + numTerms - 1);
+            }
+        }
+        while(!compiled && (c = reverki_input_skip_space(&input)) != EOF) {
             // '(' indicates start of term
             if(c == 40) {
-                ungetc(c, stdin);
-                REVERKI_TERM *newTerm = reverki_parse_term(stdin);
+                REVERKI_TERM *newTerm = reverki_read_term(&input);
                 if(newTerm == NULL) { abort(); }
+                lastTerm = newTerm;
+                // In batch mode every term is kept, to be rewritten in turn,
+                // and every term is kept for the compiled file
+                if(batch || (global_options & COMPILE_OPTION) == COMPILE_OPTION) {
+                    if(numTerms == maxTerms) {
+                        maxTerms = maxTerms ? maxTerms * 2 : 64;
+                        if((terms = realloc(terms, maxTerms * sizeof(REVERKI_TERM *))) == NULL) {
+                            fprintf(stderr, "Too many terms\n");
+                            abort();
+                        }
+                    }
+                    *(terms + numTerms++) = newTerm;
+                }
             // '[' indicates start of rule
             } else if(c == 91) {
-                ungetc(c, stdin);
-                reverki_parse_rule(stdin);
-            } else if(c == 41) {
-                fprintf(stderr, "Encountered ), which is invalid");
-            } else if(c == 93) {
-                fprintf(stderr, "Encountered ], which is invalid");
+                REVERKI_RULE *newRule = reverki_read_rule(&input);
+                if(newRule != NULL) { lastRule = newRule; }
+            } else {
+                if(c == 41) {
+                    fprintf(stderr, "Encountered ), which is invalid");
+                } else if(c == 93) {
+                    fprintf(stderr, "Encountered ], which is invalid");
+                }
+                REVERKI_INPUT_NEXT(&input);
             }
         }
+        reverki_input_close(&input);
+        reverki_parse_time = reverki_clock() - start;
+        if((global_options & COMPILE_OPTION) == COMPILE_OPTION &&
+           reverki_write_compiled(reverki_compile_path, terms, numTerms)) {
+            return EXIT_FAILURE;
+        }
         if((global_options & VALIDATE_OPTION) == VALIDATE_OPTION) {
             if((global_options & STATISTICS_OPTION) == STATISTICS_OPTION) {
                 reverki_statistics();
             }
         } else {
-            if((global_options & TRACE_OPTION) == TRACE_OPTION) {
+            if(lastTerm == NULL) {
+                fprintf(stderr, "No term to rewrite\n");
+                return EXIT_FAILURE;
+            }
+            if(reverki_trace_path != NULL) {
+                // The binary trace begins with the same information, as records
+                if(reverki_tracefile_open(reverki_trace_path)) {
+                    return EXIT_FAILURE;
+                }
+                reverki_tracefile_rules(reverki_trace_file);
+                if(!batch) {
+                    reverki_tracefile_term(reverki_trace_file, lastTerm);
+                }
+            } else if((global_options & TRACE_OPTION) == TRACE_OPTION) {
                 for(int i = 0; i < *pRuleCounter; i++) {
                     fprintf(stderr, "# ");
-                    reverki_unparse_rule((reverki_rule_storage + i), stderr);
+                    reverki_unparse_rule(reverki_arena_get(&reverki_rule_arena, i), stderr);
                     fprintf(stderr, "\n");
                 }
-                fprintf(stderr, "# ");
-                reverki_unparse_term((reverki_term_storage + *pTermCounter-1), stderr);
-                fprintf(stderr, "\n");
-                reverki_trace((reverki_term_storage + *pTermCounter-1), 0);
+                // In batch mode each term is traced along with its rewriting
+                if(!batch) {
+                    fprintf(stderr, "# ");
+                    reverki_unparse_term(lastTerm, stderr);
+                    fprintf(stderr, "\n");
+                    reverki_trace(lastTerm, 0);
+                }
+            }
+
+            int jobs = (global_options & JOBS_OPTION) >> JOBS_SHIFT;
+            if(jobs > 1 && reverki_pool_start(jobs)) {
+                fprintf(stderr, "Could not start %d threads, using %d\n", jobs, reverki_pool_workers());
             }
 
-            REVERKI_TERM *newTerm = reverki_rewrite((reverki_rule_storage + *pRuleCounter-1), (reverki_term_storage + *pTermCounter-1));
-            if(stdout == NULL) {
-                reverki_unparse_term(newTerm, stderr);
-                fprintf(stderr, "\n");
+            // Results of a batch are printed while it is rewritten, and that time is counted separately
+            start = reverki_clock();
+            if(batch) {
+                if(reverki_rewrite_batch(lastRule, terms, numTerms, stdout)) {
+                    return EXIT_FAILURE;
+                }
+                reverki_rewrite_time = reverki_clock() - start - reverki_print_time;
             } else {
-                reverki_unparse_term(newTerm, stdout);
-                fputc('\n', stdout);
+                REVERKI_TERM *newTerm = reverki_rewrite(lastRule, lastTerm);
+                reverki_rewrite_time = reverki_clock() - start;
+                start = reverki_clock();
+                if(stdout == NULL) {
+                    reverki_unparse_term(newTerm, stderr);
+                    fprintf(stderr, "\n");
+                } else {
+                    // Normal forms can be large, so they are printed through a large buffer
+                    REVERKI_OUTPUT output;
+                    if(reverki_output_open(&output, stdout)) {
+                        reverki_unparse_term(newTerm, stdout);
+                        fputc('\n', stdout);
+                    } else {
+                        if((global_options & SHARED_OPTION) == SHARED_OPTION) {
+                            reverki_write_shared_term(&output, newTerm);
+                        } else {
+                            reverki_write_term(&output, newTerm);
+                        }
+                        REVERKI_OUTPUT_PUT(&output, '\n');
+                        reverki_output_close(&output);
+                    }
+                }
+                reverki_print_time = reverki_clock() - start;
             }
 
+            if(reverki_tracefile_close()) {
+                return EXIT_FAILURE;
+            }
             if((global_options & STATISTICS_OPTION) == STATISTICS_OPTION) {
                 reverki_statistics();
             }
         }
-
+        free(terms);
     }
 
 
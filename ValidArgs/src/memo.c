@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "reverki.h"
+#include "global.h"
+#include "write.h"
+
+/*
+ * Normal-form cache.  This is a bounded table that maps terms to their known
+ * normal forms (a term known to be in normal form maps to itself).  The table
+ * is set-associative: a term hashes to a set of MEMO_WAYS entries, and when a
+ * set is full the least recently used entry in it is evicted.  Since terms are
+ * hash-consed, keys are compared by pointer.
+ */
+#define MEMO_SETS 16384
+#define MEMO_WAYS 4
+
+typedef struct memo_entry {
+    REVERKI_TERM *term;            // The key, or NULL if the entry is empty.
+    REVERKI_TERM *normalForm;      // The normal form of the key.
+    unsigned long lastUsed;        // Time of the last lookup or insertion.
+} MEMO_ENTRY;
+
+static MEMO_ENTRY *memoTable = NULL;
+static unsigned long memoClock = 0;
+
+int memoHits = 0;
+int memoMisses = 0;
+int memoEvictions = 0;
+int memoProbes = 0;
+int memoProbeHits = 0;
+
+/**
+ * @brief returns the first entry of the set to which a term hashes
+ *
+ * @param term The term
+ * @return MEMO_ENTRY* The first entry of the set, or NULL if the table could not
+ * be allocated
+ */
+static MEMO_ENTRY *memoSet(REVERKI_TERM *term) {
+    if(memoTable == NULL && (memoTable = calloc(MEMO_SETS * MEMO_WAYS, sizeof(MEMO_ENTRY))) == NULL) {
+        return NULL;
+    }
+    unsigned long h = (unsigned long)term * 0x9e3779b97f4a7c15UL;
+    return memoTable + ((h >> 32) & (MEMO_SETS - 1)) * MEMO_WAYS;
+}
+
+/**
+ * @brief returns the normal form recorded for a term, and marks its entry as
+ * used; the caller must hold the cache lock
+ *
+ * @param term The term
+ * @return REVERKI_TERM* The normal form of the term, or NULL if it is not known
+ */
+static REVERKI_TERM *findNormalForm(REVERKI_TERM *term) {
+    MEMO_ENTRY *set = memoSet(term);
+    if(set == NULL) {
+        return NULL;
+    }
+    for(int i = 0; i < MEMO_WAYS; i++) {
+        if((set + i)->term == term) {
+            (set + i)->lastUsed = ++memoClock;
+            return (set + i)->normalForm;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * @brief  Look up the normal form of a term in the cache.
+ * @details  This is counted as a hit or a miss.
+ * @param term  The term.
+ * @return  The normal form of the term, or NULL if it is not known.
+ */
+REVERKI_TERM *reverki_memo_lookup(REVERKI_TERM *term) {
+    reverki_lock(REVERKI_MEMO_LOCK);
+    REVERKI_TERM *normalForm = findNormalForm(term);
+    if(normalForm != NULL) {
+        memoHits++;
+    } else {
+        memoMisses++;
+    }
+    reverki_unlock(REVERKI_MEMO_LOCK);
+    return normalForm;
+}
+
+/*
+ * @brief  Test whether a term is recorded as being in normal form.
+ * @details  This is used to skip subterms while looking for a redex, which
+ * asks the cache far more often than there are terms to rewrite, so it is
+ * counted as a probe rather than as a hit or a miss.
+ * @param term  The term.
+ * @return  1 if the term is its own normal form in the cache, 0 otherwise.
+ */
+int reverki_memo_probe(REVERKI_TERM *term) {
+    reverki_lock(REVERKI_MEMO_LOCK);
+    int known = findNormalForm(term) == term;
+    memoProbes++;
+    if(known) {
+        memoProbeHits++;
+    }
+    reverki_unlock(REVERKI_MEMO_LOCK);
+    return known;
+}
+
+/*
+ * @brief  Record the normal form of a term in the cache.
+ * @details  If the term is already present, then its entry is updated;
+ * otherwise an empty entry, or failing that the least recently used entry,
+ * of the set to which the term hashes is replaced.
+ * @param term  The term.
+ * @param normalForm  The normal form of the term.
+ */
+void reverki_memo_insert(REVERKI_TERM *term, REVERKI_TERM *normalForm) {
+    reverki_lock(REVERKI_MEMO_LOCK);
+    MEMO_ENTRY *set = memoSet(term);
+    if(set == NULL) {
+        reverki_unlock(REVERKI_MEMO_LOCK);
+        return;
+    }
+    MEMO_ENTRY *victim = set;
+    for(int i = 0; i < MEMO_WAYS; i++) {
+        if((set + i)->term == term || (set + i)->term == NULL) {
+            victim = set + i;
+            break;
+        }
+        if((set + i)->lastUsed < victim->lastUsed) {
+            victim = set + i;
+        }
+    }
+    if(victim->term != NULL && victim->term != term) {
+        memoEvictions++;
+    }
+    victim->term = term;
+    victim->normalForm = normalForm;
+    victim->lastUsed = ++memoClock;
+    reverki_unlock(REVERKI_MEMO_LOCK);
+}
+
+/*
+ * @brief  Remove from the cache every entry that refers to a reclaimed term.
+ * @details  This must be called after reverki_sweep_terms and before any new
+ * term is created, while reclaimed terms can still be recognized by their
+ * type REVERKI_NO_TYPE.
+ */
+void reverki_memo_sweep() {
+    if(memoTable == NULL) {
+        return;
+    }
+    for(int i = 0; i < MEMO_SETS * MEMO_WAYS; i++) {
+        MEMO_ENTRY *entry = memoTable + i;
+        if(entry->term != NULL &&
+           (entry->term->type == REVERKI_NO_TYPE || entry->normalForm->type == REVERKI_NO_TYPE)) {
+            entry->term = NULL;
+        }
+    }
+}
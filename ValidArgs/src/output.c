@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "reverki.h"
+#include "global.h"
+#include "write.h"
+
+/*
+ * Output layer used by the printers, the counterpart of the input layer.
+ * Characters are stored through a cursor into a buffer, and the buffer is only
+ * written to the stream, in one block, once it is full or the output is
+ * flushed.  This avoids paying for a call to the stdio functions, and the
+ * locking they perform, on every character.
+ */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+/*
+ * @brief  Prepare to write to a stream through a large buffer.
+ * @param output  The output to be initialized.
+ * @param out  The stream.
+ * @return  0 if successful, -1 if memory could not be allocated.
+ */
+int reverki_output_open(REVERKI_OUTPUT *output, FILE *out) {
+    char *buffer = malloc(OUTPUT_BUFFER_SIZE);
+    if(buffer == NULL) {
+        return -1;
+    }
+    reverki_output_wrap(output, out, buffer, OUTPUT_BUFFER_SIZE);
+    output->owned = 1;
+    return 0;
+}
+
+/*
+ * @brief  Prepare to write to a stream through a buffer supplied by the caller.
+ * @param output  The output to be initialized.
+ * @param out  The stream.
+ * @param buffer  The buffer, which must remain valid until the output is closed.
+ * @param size  The size of the buffer.
+ */
+void reverki_output_wrap(REVERKI_OUTPUT *output, FILE *out, char *buffer, size_t size) {
+    output->stream = out;
+    output->buffer = output->cur = buffer;
+    output->end = buffer + size;
+    output->owned = 0;
+    output->error = 0;
+}
+
+/*
+ * @brief  Write the contents of the buffer of an output to its stream.
+ * @details  The stream itself is not flushed.
+ * @param output  The output.
+ * @return  0 if successful, EOF if this or any earlier write failed.
+ */
+int reverki_output_flush(REVERKI_OUTPUT *output) {
+    size_t count = output->cur - output->buffer;
+    if(count > 0 && fwrite(output->buffer, 1, count, output->stream) != count) {
+        output->error = 1;
+    }
+    output->cur = output->buffer;
+    return output->error ? EOF : 0;
+}
+
+/*
+ * @brief  Flush an output and release its buffer, if it allocated it.
+ * @param output  The output.
+ * @return  0 if successful, EOF if any write failed.
+ */
+int reverki_output_close(REVERKI_OUTPUT *output) {
+    int result = reverki_output_flush(output);
+    if(output->owned) {
+        free(output->buffer);
+    }
+    output->buffer = output->cur = output->end = NULL;
+    return result;
+}
+
+/*
+ * @brief  Store a character into the buffer of an output, flushing it first if
+ * it is full.
+ * @details  This is called by REVERKI_OUTPUT_PUT; it should not be necessary to
+ * call it directly.
+ * @param output  The output.
+ * @param c  The character.
+ */
+void reverki_output_char(REVERKI_OUTPUT *output, int c) {
+    if(output->cur == output->end) {
+        reverki_output_flush(output);
+    }
+    *output->cur++ = c;
+}
+
+/*
+ * @brief  Store a null-terminated string into the buffer of an output.
+ * @param output  The output.
+ * @param s  The string.
+ */
+void reverki_output_string(REVERKI_OUTPUT *output, char *s) {
+    while(*s != '\0') {
+        REVERKI_OUTPUT_PUT(output, *s);
+        s++;
+    }
+}
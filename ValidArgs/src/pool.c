@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "reverki.h"
+#include "global.h"
+#include "write.h"
+
+/*
+ * Work-stealing pool of threads.
+ *
+ * Each worker (the main thread is worker 0) has a double-ended queue of tasks.
+ * A worker forks a task by pushing it onto the bottom of its own queue, and
+ * later joins it by popping it back off the bottom and running it itself,
+ * unless in the meantime another worker has stolen it from the top.  While a
+ * stolen task is still running, the joining worker steals and runs other tasks
+ * rather than waiting idle.  Tasks are forked and joined in strict nested
+ * order, so the task at the bottom of a queue is always the last one forked.
+ *
+ * The other workers only look for tasks to steal while the pool is active,
+ * that is between reverki_pool_begin and reverki_pool_end; otherwise they
+ * sleep.  A worker that finds nothing to steal, or that is joining a stolen
+ * task and finds nothing else to do, sleeps until a task is forked or a stolen
+ * task is completed.  While the pool is active, the data shared between tasks must be
+ * protected by reverki_lock and reverki_unlock, which do nothing otherwise.
+ */
+typedef struct deque {
+    pthread_mutex_t lock;
+    REVERKI_TASK **tasks;          // The tasks, from top to bottom.
+    int top;                       // Index of the task to be stolen next.
+    int bottom;                    // Index past the task to be joined next.
+    int capacity;                  // Number of tasks there is room for.
+} DEQUE;
+
+static DEQUE *deques = NULL;
+static pthread_t *threads = NULL;
+static int numWorkers = 1;
+static __thread int workerId = 0;
+
+// Whether tasks may be stolen; other workers sleep while it is not set
+static int poolActive = 0;
+static int poolShutdown = 0;
+static pthread_mutex_t idleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idleCond = PTHREAD_COND_INITIALIZER;
+
+// Number of tasks forked, and of stolen tasks completed, protected by idleLock
+static unsigned long poolEvents = 0;
+
+static pthread_mutex_t sharedLocks[REVERKI_NUM_LOCKS];
+
+/**
+ * @brief runs a task and marks it as done
+ *
+ * @param task The task
+ */
+static void runTask(REVERKI_TASK *task) {
+    task->run(task);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief records that a task has been forked or a stolen task completed, waking
+ * the workers sleeping until that happens
+ */
+static void poolEvent() {
+    pthread_mutex_lock(&idleLock);
+    poolEvents++;
+    pthread_cond_broadcast(&idleCond);
+    pthread_mutex_unlock(&idleLock);
+}
+
+/**
+ * @brief returns the number of events recorded so far by poolEvent
+ *
+ * @return unsigned long The number of events
+ */
+static unsigned long poolEventCount() {
+    pthread_mutex_lock(&idleLock);
+    unsigned long events = poolEvents;
+    pthread_mutex_unlock(&idleLock);
+    return events;
+}
+
+/**
+ * @brief takes the task at the top of a worker's queue
+ *
+ * @param victim The number of the worker
+ * @return REVERKI_TASK* The task, or NULL if the queue is empty
+ */
+static REVERKI_TASK *stealTask(int victim) {
+    DEQUE *deque = deques + victim;
+    REVERKI_TASK *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->top < deque->bottom) {
+        task = *(deque->tasks + deque->top++);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+/**
+ * @brief takes the task at the top of the queue of some other worker
+ *
+ * @return REVERKI_TASK* The task, or NULL if every other queue is empty
+ */
+static REVERKI_TASK *stealAny() {
+    static __thread unsigned int nextVictim = 0;
+    for(int i = 1; i < numWorkers; i++) {
+        int victim = (workerId + nextVictim++ % (numWorkers - 1) + 1) % numWorkers;
+        REVERKI_TASK *task = stealTask(victim);
+        if(task != NULL) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief the main loop of a worker other than the main thread
+ *
+ * @param arg The number of the worker
+ * @return void* NULL
+ */
+static void *workerLoop(void *arg) {
+    workerId = (int)(long)arg;
+    while(1) {
+        pthread_mutex_lock(&idleLock);
+        while(!poolActive && !poolShutdown) {
+            pthread_cond_wait(&idleCond, &idleLock);
+        }
+        int shutdown = poolShutdown;
+        unsigned long seen = poolEvents;
+        pthread_mutex_unlock(&idleLock);
+        if(shutdown) {
+            return NULL;
+        }
+        REVERKI_TASK *task = stealAny();
+        if(task != NULL) {
+            runTask(task);
+            poolEvent();
+            continue;
+        }
+
+        // Nothing to steal, so sleep until a task is forked or the pool is ended
+        pthread_mutex_lock(&idleLock);
+        while(poolEvents == seen && poolActive && !poolShutdown) {
+            pthread_cond_wait(&idleCond, &idleLock);
+        }
+        pthread_mutex_unlock(&idleLock);
+    }
+}
+
+/*
+ * @brief  Start a pool with a specified number of workers.
+ * @details  The calling thread becomes worker 0, and the others are created.
+ * @param workers  The number of workers, including the calling thread.
+ * @return  0 if successful, -1 if the threads could not be created.
+ */
+int reverki_pool_start(int workers) {
+    for(int i = 0; i < REVERKI_NUM_LOCKS; i++) {
+        pthread_mutex_init(sharedLocks + i, NULL);
+    }
+    if((deques = calloc(workers, sizeof(DEQUE))) == NULL ||
+       (threads = calloc(workers, sizeof(pthread_t))) == NULL) {
+        return -1;
+    }
+    for(int i = 0; i < workers; i++) {
+        pthread_mutex_init(&(deques + i)->lock, NULL);
+    }
+    numWorkers = workers;
+    for(int i = 1; i < workers; i++) {
+        if(pthread_create(threads + i, NULL, workerLoop, (void *)(long)i)) {
+            numWorkers = i;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Get the number of workers in the pool.
+ * @return  The number of workers, which is 1 if no pool has been started.
+ */
+int reverki_pool_workers() {
+    return numWorkers;
+}
+
+/*
+ * @brief  Let the other workers steal tasks, until reverki_pool_end is called.
+ */
+void reverki_pool_begin() {
+    pthread_mutex_lock(&idleLock);
+    poolActive = 1;
+    pthread_cond_broadcast(&idleCond);
+    pthread_mutex_unlock(&idleLock);
+}
+
+/*
+ * @brief  Stop the other workers from stealing tasks.
+ * @details  Every task forked must have been joined.
+ */
+void reverki_pool_end() {
+    pthread_mutex_lock(&idleLock);
+    poolActive = 0;
+    pthread_cond_broadcast(&idleCond);
+    pthread_mutex_unlock(&idleLock);
+}
+
+/*
+ * @brief  Fork a task, so that another worker may run it.
+ * @param task  The task, which must remain valid until it has been joined.
+ */
+void reverki_pool_fork(REVERKI_TASK *task) {
+    DEQUE *deque = deques + workerId;
+    task->done = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom == deque->capacity) {
+        // Grow the queue, moving the tasks not yet stolen to the front
+        int used = deque->bottom - deque->top;
+        int newCapacity = deque->capacity ? deque->capacity * 2 : 64;
+        REVERKI_TASK **newTasks = malloc(newCapacity * sizeof(REVERKI_TASK *));
+        if(newTasks == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            runTask(task);
+            return;
+        }
+        for(int i = 0; i < used; i++) {
+            *(newTasks + i) = *(deque->tasks + deque->top + i);
+        }
+        free(deque->tasks);
+        deque->tasks = newTasks;
+        deque->capacity = newCapacity;
+        deque->top = 0;
+        deque->bottom = used;
+    }
+    *(deque->tasks + deque->bottom++) = task;
+    pthread_mutex_unlock(&deque->lock);
+    poolEvent();
+}
+
+/*
+ * @brief  Wait for a forked task to be completed, running it if no other worker
+ * has taken it.
+ * @param task  The task, which must be the task forked most recently by this
+ * worker and not yet joined.
+ */
+void reverki_pool_join(REVERKI_TASK *task) {
+    DEQUE *deque = deques + workerId;
+    pthread_mutex_lock(&deque->lock);
+    REVERKI_TASK *own = NULL;
+    if(deque->top < deque->bottom && *(deque->tasks + deque->bottom - 1) == task) {
+        own = task;
+        deque->bottom--;
+    }
+    if(deque->top == deque->bottom) {
+        deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    if(own != NULL) {
+        runTask(task);
+        return;
+    }
+
+    // The task was stolen, so help with other work until it is done
+    while(!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+        unsigned long seen = poolEventCount();
+        REVERKI_TASK *other = stealAny();
+        if(other != NULL) {
+            runTask(other);
+            poolEvent();
+            continue;
+        }
+
+        // Nothing else to do, so sleep until a task is forked or completed
+        pthread_mutex_lock(&idleLock);
+        while(poolEvents == seen && !__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&idleCond, &idleLock);
+        }
+        pthread_mutex_unlock(&idleLock);
+    }
+}
+
+/*
+ * @brief  Acquire one of the locks protecting data shared between tasks.
+ * @details  Nothing is done unless the pool is active.
+ * @param lock  The lock (one of REVERKI_TERM_LOCK to REVERKI_TRACE_LOCK).
+ */
+void reverki_lock(int lock) {
+    if(__atomic_load_n(&poolActive, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(sharedLocks + lock);
+    }
+}
+
+/*
+ * @brief  Release a lock acquired by reverki_lock.
+ * @param lock  The lock.
+ */
+void reverki_unlock(int lock) {
+    if(__atomic_load_n(&poolActive, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(sharedLocks + lock);
+    }
+}
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "debug.h"
+#include "reverki.h"
+#include "global.h"
+#include "write.h"
+
+/*
+ * Profile of the hot paths, compiled in only with -DREVERKI_PROFILE (or
+ * -DDEBUG).  A function that is instrumented declares a frame on entry with
+ * REVERKI_PROFILE_ENTER, which the compiler closes on every return from the
+ * function.  Only the outermost of nested entries to a site, in each thread,
+ * counts as a call and is timed, so that the time of a recursive function is
+ * not counted more than once; it includes the time of everything it calls,
+ * and it is summed over the threads of the pool.  Nodes are counted wherever
+ * REVERKI_PROFILE_NODE is placed: once per recursive call, once per position
+ * visited by the rewriter or examined by the automaton, or once per subterm
+ * read by the parser.  Rewriting matches with the automaton and builds results
+ * with instantiateHelper, so addSubsToList and reverki_apply_helper are only
+ * reached through reverki_match and reverki_apply.  The counters are printed
+ * on stderr at exit.
+ */
+#ifdef REVERKI_PROFILE
+
+typedef struct profile_site {
+    char *name;                    // Name of the function or functions.
+    unsigned long calls;           // Number of outermost entries.
+    unsigned long nodes;           // Number of nodes visited.
+    unsigned long time;            // Time spent, in ns.
+} PROFILE_SITE;
+
+static PROFILE_SITE sites[REVERKI_PROFILE_SITES] = {
+    { "reverki_rewrite_helper", 0, 0, 0 },
+    { "addSubsToList", 0, 0, 0 },
+    { "reverki_apply_helper", 0, 0, 0 },
+    { "parser", 0, 0, 0 },
+    { "reverki_automaton_match", 0, 0, 0 },
+    { "instantiateHelper", 0, 0, 0 }
+};
+static __thread int depths[REVERKI_PROFILE_SITES];
+
+/**
+ * @brief returns the time elapsed since an arbitrary fixed point
+ *
+ * @return long The time, in ns
+ */
+static long profileClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * @brief prints the counters of every site on stderr
+ */
+static void printProfile() {
+    fprintf(stderr, "%-24s %14s %14s %12s %10s\n", "Profile", "calls", "nodes", "time (s)", "ns/node");
+    for(int i = 0; i < REVERKI_PROFILE_SITES; i++) {
+        PROFILE_SITE *site = sites + i;
+        fprintf(stderr, "%-24s %14lu %14lu %12.6f %10.1f\n", site->name, site->calls, site->nodes,
+                site->time / 1e9, site->nodes ? (double)site->time / site->nodes : 0.0);
+    }
+}
+
+/**
+ * @brief arranges for the counters to be printed at exit, before main is called
+ */
+static void __attribute__((constructor)) startProfile() {
+    atexit(printProfile);
+}
+
+/*
+ * @brief  Enter an instrumented site.
+ * @details  This is called by REVERKI_PROFILE_ENTER; it should not be
+ * necessary to call it directly.
+ * @param site  The site, one of REVERKI_PROFILE_REWRITE, ...
+ * @return  The frame to be passed to reverki_profile_exit.
+ */
+REVERKI_PROFILE_FRAME reverki_profile_enter(int site) {
+    REVERKI_PROFILE_FRAME frame = { site, -1 };
+    if((*(depths + site))++ == 0) {
+        __atomic_fetch_add(&(sites + site)->calls, 1, __ATOMIC_RELAXED);
+        frame.start = profileClock();
+    }
+    return frame;
+}
+
+/*
+ * @brief  Leave an instrumented site.
+ * @details  This is called automatically when the frame declared by
+ * REVERKI_PROFILE_ENTER goes out of scope.
+ * @param frame  The frame.
+ */
+void reverki_profile_exit(REVERKI_PROFILE_FRAME *frame) {
+    (*(depths + frame->site))--;
+    if(frame->start >= 0) {
+        __atomic_fetch_add(&(sites + frame->site)->time, profileClock() - frame->start, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * @brief  Count a node visited at an instrumented site.
+ * @param site  The site.
+ */
+void reverki_profile_node(int site) {
+    __atomic_fetch_add(&(sites + site)->nodes, 1, __ATOMIC_RELAXED);
+}
+
+#endif
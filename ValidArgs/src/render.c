@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "reverki.h"
+#include "global.h"
+#include "debug.h"
+#include "write.h"
+
+/*
+ * Renderer for binary traces written with -T.  The records are read twice:
+ * first to collect the definitions of all the terms, which may follow the
+ * records that use them, and then to print each rule, term and step exactly
+ * as -t would have printed it.  Terms are rebuilt with the usual functions, so
+ * shared subterms take no more space than in the program that wrote the trace.
+ */
+#define RENDER_INITIAL_SIZE (1 << 20)
+
+typedef struct term_def {
+    REVERKI_TERM *term;            // The term, once built, or NULL.
+    unsigned long fst;             // Number of the first subterm of a pair.
+    unsigned long snd;             // Number of the second subterm of a pair.
+    int state;                     // 0 if undefined, 1 if defined, 2 while being built.
+} TERM_DEF;
+
+static TERM_DEF *defs = NULL;
+static unsigned long numDefs = 0;
+static REVERKI_RULE **rules = NULL;
+static int numRules = 0;
+static unsigned long *buildStack = NULL;
+static unsigned long buildStackSize = 0;
+
+/**
+ * @brief prints a message about a malformed trace and exits
+ */
+static void invalidTrace() {
+    fprintf(stderr, "Invalid trace file\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief reads a varint from a record
+ *
+ * @param p By-reference position of the number, advanced past it
+ * @param end End of the trace
+ * @return unsigned long The number
+ */
+static unsigned long getNumber(unsigned char **p, unsigned char *end) {
+    unsigned long n = 0;
+    int shift = 0;
+    while(1) {
+        if(*p == end || shift > 63) {
+            invalidTrace();
+        }
+        unsigned char byte = *(*p)++;
+        n |= (unsigned long)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            return n;
+        }
+        shift += 7;
+    }
+}
+
+/**
+ * @brief returns the entry for a term number, growing the table of
+ * definitions as necessary
+ *
+ * @param number The number
+ * @return TERM_DEF* The entry
+ */
+static TERM_DEF *termDef(unsigned long number) {
+    if(number >= numDefs) {
+        unsigned long newSize = numDefs ? numDefs : 4096;
+        while(newSize <= number) {
+            newSize *= 2;
+        }
+        TERM_DEF *newDefs = realloc(defs, newSize * sizeof(TERM_DEF));
+        if(newDefs == NULL || newSize > (1UL << 40)) {
+            invalidTrace();
+        }
+        for(unsigned long i = numDefs; i < newSize; i++) {
+            (newDefs + i)->term = NULL;
+            (newDefs + i)->state = 0;
+        }
+        defs = newDefs;
+        numDefs = newSize;
+    }
+    return defs + number;
+}
+
+/**
+ * @brief returns the term with a specified number, building it and any of its
+ * subterms not yet built, subterms first, using an explicit stack
+ *
+ * @param number The number
+ * @return REVERKI_TERM* The term
+ */
+static REVERKI_TERM *buildTerm(unsigned long number) {
+    unsigned long depth = 0;
+    unsigned long top = number;
+    while(1) {
+        TERM_DEF *def = termDef(top);
+        if(def->term == NULL) {
+            if(def->state == 0) {
+                invalidTrace();
+            }
+            def->state = 2;
+            unsigned long next = termDef(def->fst)->term == NULL ? def->fst : def->snd;
+            if(termDef(next)->term == NULL) {
+                // A subterm still being built would make the term contain itself
+                if(termDef(next)->state == 2) {
+                    invalidTrace();
+                }
+                if(depth == buildStackSize) {
+                    buildStackSize = buildStackSize ? buildStackSize * 2 : 1024;
+                    if((buildStack = realloc(buildStack, buildStackSize * sizeof(unsigned long))) == NULL) {
+                        invalidTrace();
+                    }
+                }
+                *(buildStack + depth++) = top;
+                top = next;
+                continue;
+            }
+            if((def->term = reverki_make_pair((defs + def->fst)->term, (defs + def->snd)->term)) == NULL) {
+                invalidTrace();
+            }
+            def->state = 1;
+        }
+        if(depth == 0) {
+            return def->term;
+        }
+        top = *(buildStack + --depth);
+    }
+}
+
+/**
+ * @brief writes a term and each of its subterms on a line of its own, prefixed
+ * by one dot for each level of depth, as the text trace does
+ *
+ * @param output The output
+ * @param term The term
+ * @param depth The depth of the term
+ */
+static void writeTree(REVERKI_OUTPUT *output, REVERKI_TERM *term, int depth) {
+    static REVERKI_TERM **stack = NULL;
+    static int *depths = NULL;
+    static int stackSize = 0;
+    int count = 0;
+    while(1) {
+        for(int i = 0; i < depth; i++) {
+            REVERKI_OUTPUT_PUT(output, '.');
+        }
+        reverki_write_term(output, term);
+        REVERKI_OUTPUT_PUT(output, '\n');
+        if(term->type == REVERKI_PAIR_TYPE) {
+            if(count == stackSize) {
+                stackSize = stackSize ? stackSize * 2 : 1024;
+                if((stack = realloc(stack, stackSize * sizeof(REVERKI_TERM *))) == NULL ||
+                   (depths = realloc(depths, stackSize * sizeof(int))) == NULL) {
+                    invalidTrace();
+                }
+            }
+            *(stack + count) = term->value.pair.snd;
+            *(depths + count++) = depth + 1;
+            term = term->value.pair.fst;
+            depth++;
+        } else if(count > 0) {
+            count--;
+            term = *(stack + count);
+            depth = *(depths + count);
+        } else {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief writes a rule as "[lhs, rhs]"
+ *
+ * @param output The output
+ * @param rule The rule
+ */
+static void writeRule(REVERKI_OUTPUT *output, REVERKI_RULE *rule) {
+    REVERKI_OUTPUT_PUT(output, '[');
+    reverki_write_term(output, rule->lhs);
+    reverki_output_string(output, ", ");
+    reverki_write_term(output, rule->rhs);
+    REVERKI_OUTPUT_PUT(output, ']');
+}
+
+/**
+ * @brief reads the records of a trace, either collecting the definitions of
+ * terms or rendering everything else
+ *
+ * @param p Start of the records
+ * @param end End of the records
+ * @param output The output to render to, or NULL to collect definitions
+ */
+static void readRecords(unsigned char *p, unsigned char *end, REVERKI_OUTPUT *output) {
+    while(p < end) {
+        int kind = *p++;
+        if(kind == REVERKI_TRACE_ATOM) {
+            TERM_DEF *def = termDef(getNumber(&p, end));
+            unsigned long length = getNumber(&p, end);
+            if(length >= REVERKI_PNAME_BUFFER_SIZE || length == 0 || length > end - p) {
+                invalidTrace();
+            }
+            if(output == NULL) {
+                char pname[REVERKI_PNAME_BUFFER_SIZE];
+                for(unsigned long i = 0; i < length; i++) {
+                    *(pname + i) = *(p + i);
+                }
+                *(pname + length) = '\0';
+                REVERKI_ATOM *atom = reverki_intern_atom(pname);
+                if(atom == NULL || def->state != 0) {
+                    invalidTrace();
+                }
+                def->term = atom->type == REVERKI_VARIABLE_TYPE ? reverki_make_variable(atom) :
+                                                                  reverki_make_constant(atom);
+                def->state = 1;
+            }
+            p += length;
+        } else if(kind == REVERKI_TRACE_PAIR) {
+            unsigned long number = getNumber(&p, end);
+            unsigned long fst = getNumber(&p, end);
+            unsigned long snd = getNumber(&p, end);
+            if(output == NULL) {
+                TERM_DEF *def = termDef(number);
+                if(def->state != 0) {
+                    invalidTrace();
+                }
+                def->fst = fst;
+                def->snd = snd;
+                def->state = 1;
+            }
+        } else if(kind == REVERKI_TRACE_RULE) {
+            unsigned long lhs = getNumber(&p, end);
+            unsigned long rhs = getNumber(&p, end);
+            if(output != NULL) {
+                if((numRules & (numRules - 1)) == 0 &&
+                   (rules = realloc(rules, (numRules ? numRules * 2 : 1) * sizeof(REVERKI_RULE *))) == NULL) {
+                    invalidTrace();
+                }
+                REVERKI_RULE *rule = reverki_make_rule(buildTerm(lhs), buildTerm(rhs));
+                if(rule == NULL) {
+                    invalidTrace();
+                }
+                *(rules + numRules++) = rule;
+                reverki_output_string(output, "# ");
+                writeRule(output, rule);
+                REVERKI_OUTPUT_PUT(output, '\n');
+            }
+        } else if(kind == REVERKI_TRACE_TERM) {
+            unsigned long number = getNumber(&p, end);
+            if(output != NULL) {
+                REVERKI_TERM *term = buildTerm(number);
+                reverki_output_string(output, "# ");
+                reverki_write_term(output, term);
+                REVERKI_OUTPUT_PUT(output, '\n');
+                writeTree(output, term, 0);
+            }
+        } else if(kind == REVERKI_TRACE_STEP) {
+            getNumber(&p, end);
+            unsigned long depth = getNumber(&p, end);
+            unsigned long rule = getNumber(&p, end);
+            unsigned long tgt = getNumber(&p, end);
+            unsigned long result = getNumber(&p, end);
+            unsigned long count = getNumber(&p, end);
+            if(count > REVERKI_MAX_BINDINGS || depth > __INT_MAX__) {
+                invalidTrace();
+            }
+            unsigned long bindings[2 * REVERKI_MAX_BINDINGS];
+            for(unsigned long i = 0; i < 2 * count; i++) {
+                *(bindings + i) = getNumber(&p, end);
+            }
+            if(output == NULL) {
+                continue;
+            }
+            if(rule >= numRules) {
+                invalidTrace();
+            }
+            for(unsigned long i = 0; i < depth; i++) {
+                REVERKI_OUTPUT_PUT(output, '.');
+            }
+            reverki_write_term(output, buildTerm(tgt));
+            reverki_output_string(output, "\n==> rule: ");
+            writeRule(output, *(rules + rule));
+            reverki_output_string(output, ", subst: ");
+            for(unsigned long i = count; i > 0; i--) {
+                REVERKI_OUTPUT_PUT(output, '[');
+                reverki_write_term(output, buildTerm(*(bindings + 2 * i - 2)));
+                reverki_output_string(output, ", ");
+                reverki_write_term(output, buildTerm(*(bindings + 2 * i - 1)));
+                reverki_output_string(output, "] ");
+            }
+            reverki_output_string(output, ".\n");
+            writeTree(output, buildTerm(result), depth);
+        } else {
+            invalidTrace();
+        }
+    }
+}
+
+/*
+ * Renders a binary trace, written by "reverki -r -T FILE", as text on stdout.
+ * The trace is read from the file named by the argument, or from stdin.
+ */
+int main(int argc, char **argv)
+{
+    if(argc > 2 || (argc == 2 && **(argv + 1) == '-' && *(*(argv + 1) + 1) != '\0')) {
+        fprintf(stderr, "USAGE: %s [FILE]\n", *argv);
+        return EXIT_FAILURE;
+    }
+    FILE *in = stdin;
+    if(argc == 2 && (in = fopen(*(argv + 1), "rb")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", *(argv + 1));
+        return EXIT_FAILURE;
+    }
+
+    // The whole trace is kept in memory, since it is read twice
+    size_t size = 0, capacity = RENDER_INITIAL_SIZE;
+    unsigned char *data = malloc(capacity);
+    size_t count;
+    while(data != NULL && (count = fread(data + size, 1, capacity - size, in)) > 0) {
+        size += count;
+        if(size == capacity) {
+            data = realloc(data, capacity *= 2);
+        }
+    }
+    if(data == NULL) {
+        fprintf(stderr, "Could not allocate memory for the trace\n");
+        return EXIT_FAILURE;
+    }
+    char *magic = REVERKI_TRACE_MAGIC;
+    if(size < 5 || *data != *magic || *(data + 1) != *(magic + 1) || *(data + 2) != *(magic + 2) ||
+       *(data + 3) != *(magic + 3) || *(data + 4) != REVERKI_TRACE_VERSION) {
+        invalidTrace();
+    }
+
+    REVERKI_OUTPUT output;
+    if(reverki_output_open(&output, stdout)) {
+        fprintf(stderr, "Could not allocate output buffer\n");
+        return EXIT_FAILURE;
+    }
+    readRecords(data + 5, data + size, NULL);
+    readRecords(data + 5, data + size, &output);
+    if(reverki_output_close(&output) || fflush(stdout)) {
+        return EXIT_FAILURE;
+    }
+    free(data);
+    return EXIT_SUCCESS;
+}
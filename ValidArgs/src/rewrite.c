@@ -1,114 +1,1129 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "debug.h"
 #include "reverki.h"
 #include "global.h"
 #include "write.h"
 
-static int limitCounter = 0;
+// Automaton compiled from the rules being used for rewriting
+static REVERKI_RULE *compiledRules = NULL;
+static REVERKI_AUTOMATON *ruleAutomaton = NULL;
+
+// Position in the rule list of the rule being applied by the current thread
+static __thread int currentPriority = -1;
+
+// Number of garbage collections performed
+static int collections = 0;
+
+// Number of rewriting steps performed, over all terms rewritten
+static unsigned long totalSteps = 0;
+
+// Time spent in each phase, in seconds, as measured with reverki_clock
+double reverki_parse_time = 0;
+double reverki_rewrite_time = 0;
+double reverki_print_time = 0;
+
+/*
+ * Cache, used by incremental rewriting, of the first rule that matches some
+ * subterm of a term.  It is direct-mapped: an entry is simply overwritten
+ * when another term hashes to it.  Each thread has its own cache.  Since terms
+ * are reclaimed by the garbage collector, every cache is cleared before it is
+ * next used once ruleCacheGeneration has been advanced by a collection (or by
+ * compiling other rules).
+ */
+#define RULE_CACHE_SIZE 65536
+
+typedef struct rule_cache_entry {
+    REVERKI_TERM *term;            // The key, or NULL if the entry is empty.
+    REVERKI_RULE *rule;            // The first rule that matches, or NULL if none.
+    int priority;                  // Position of the rule in the rule list.
+} RULE_CACHE_ENTRY;
+
+static __thread RULE_CACHE_ENTRY *ruleCache = NULL;
+static __thread int ruleCacheSeen = 0;
+static int ruleCacheGeneration = 0;
+
+/*
+ * Stack of the positions between the root of a term and the subterm being
+ * visited, used to walk terms without recursion, so that the depth of a term is
+ * not limited by the depth of the C stack.  Walks are nested (incremental
+ * rewriting searches the rule cache at each position it visits, and a thread
+ * waiting to join a task may run another task meanwhile), so each walk only
+ * uses the positions above those in use when it began, and a position must be
+ * found again from the top of the stack after anything that may walk a term.
+ */
+typedef struct position {
+    REVERKI_TERM *term;            // The subterm at this position.
+    REVERKI_TERM *fst;             // The rewritten first component, once known.
+    REVERKI_RULE *rule;            // The best rule found so far at this position.
+    int priority;                  // Position of that rule in the rule list.
+    int state;                     // 0, 1 or 2: number of components visited.
+} POSITION;
+
+static __thread POSITION *positionStack = NULL;
+static __thread int maxPositions = 0;
+static __thread int positionCount = 0;
+
+/*
+ * Table, used by graph rewriting, of the subterms already rewritten during the
+ * current step and what they were rewritten to.  It is open-addressed (linear
+ * probing, size a power of two).  Each entry is stamped with the number of the
+ * step that made it, and entries from earlier steps count as empty, so the
+ * table never needs to be cleared.
+ */
+#define STEP_TABLE_INITIAL_SIZE 1024
+
+typedef struct step_entry {
+    REVERKI_TERM *term;            // The subterm.
+    REVERKI_TERM *result;          // What it was rewritten to.
+    unsigned int step;             // The step during which it was rewritten.
+} STEP_ENTRY;
+
+static __thread STEP_ENTRY *stepTable = NULL;
+static __thread unsigned long stepTableSize = 0;
+static __thread unsigned long stepTableUsed = 0;
+static __thread unsigned int stepNumber = 0;
+
+/*
+ * Parallel rewriting (-j).  During a step of the default strategy, a pair both
+ * of whose components have at least PARALLEL_CUTOFF nodes is searched and
+ * rewritten by forking its second component as a task for the pool, while the
+ * first component is processed by the current thread.  Each task traces into
+ * its own buffer, which is copied to the trace of the task that forked it when
+ * it is joined, so the trace is the same as if the step were sequential.
+ */
+#define PARALLEL_CUTOFF 1024
+
+typedef struct sweep_task {
+    REVERKI_TASK task;             // Must come first.
+    REVERKI_TERM *tgt;             // The subterm to be rewritten.
+    REVERKI_RULE *rule;            // The rule being applied.
+    int priority;                  // Position of the rule in the rule list.
+    unsigned int step;             // Number of the step.
+    int index;                     // The depth of tgt in the term being rewritten.
+    REVERKI_TERM *result;          // The rewritten subterm, once done.
+    char *trace;                   // Trace of the task, or NULL if not tracing.
+    size_t traceSize;              // Number of characters in the trace.
+} SWEEP_TASK;
+
+typedef struct search_task {
+    REVERKI_TASK task;             // Must come first.
+    REVERKI_TERM *term;            // The subterm to be searched.
+    int after;                     // Only rules after this position are considered.
+    int best;                      // Position of the best rule found so far.
+    REVERKI_RULE *rule;            // The best rule found, or NULL if none.
+} SEARCH_TASK;
+
+static void runSearch(REVERKI_TASK *task);
+REVERKI_TERM *reverki_rewrite_helper(REVERKI_TERM *tgt, REVERKI_RULE *rule_list, REVERKI_SUBST *subst, int index);
+
+// Whether the current step may fork tasks
+static int parallelStep = 0;
+
+// Stream to which the current thread traces, or NULL for stderr (or the -T file)
+static __thread FILE *traceOut = NULL;
+
+// Number of the step being performed by the current thread, for the -T trace
+static __thread unsigned int currentStep = 0;
+
+/*
+ * Batch rewriting (-b).  The terms are rewritten by one batch task per worker
+ * of the pool, each of which repeatedly claims the next term not yet claimed.
+ * Each result is printed, with its trace, once all the terms before it have
+ * been printed, by whichever task completes the next term to be printed.
+ *
+ * Each task holds batchLock for reading while it rewrites, and lets go of it
+ * between steps so that a garbage collection can be performed while it holds
+ * the lock for writing.  The collection keeps alive every term given, every
+ * result not yet printed, and the term each task has rewritten so far.
+ */
+typedef struct batch_task {
+    REVERKI_TASK task;             // Must come first.
+    REVERKI_TERM *current;         // The term being rewritten, as rewritten so far.
+} BATCH_TASK;
+
+typedef struct batch_result {
+    REVERKI_TERM *term;            // The normal form, or NULL until it is known.
+    char *trace;                   // Trace of the term, or NULL if not tracing.
+    size_t traceSize;              // Number of characters in the trace.
+} BATCH_RESULT;
+
+static REVERKI_RULE *batchRules = NULL;
+static REVERKI_TERM **batchTerms = NULL;
+static BATCH_RESULT *batchResults = NULL;
+static BATCH_TASK *batchTasks = NULL;
+static int batchCount = 0;
+static int batchWorkers = 0;
+static int batchNext = 0;                  // Next term to be claimed.
+static int batchPrinted = 0;               // Number of terms printed.
+static REVERKI_OUTPUT batchOutput;         // Where the results are printed.
+static pthread_rwlock_t batchLock;
+static pthread_mutex_t batchPrintLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The batch task run by the current thread, or NULL if not rewriting a batch
+static __thread BATCH_TASK *batchSlot = NULL;
+
 /**
- * @brief Traces out the process in which the term is divided
+ * @brief Empties the rule cache of the current thread
+ */
+static void clearRuleCache() {
+    if(ruleCache != NULL) {
+        for(int i = 0; i < RULE_CACHE_SIZE; i++) {
+            (ruleCache + i)->term = NULL;
+        }
+    }
+    ruleCacheSeen = ruleCacheGeneration;
+}
+
+/**
+ * @brief returns the stream to which the current thread traces
+ *
+ * @return FILE* The buffer of the current task or batch term, if any, otherwise
+ * the -T file if a binary trace is being written, otherwise stderr
+ */
+static FILE *traceStream() {
+    if(traceOut != NULL) {
+        return traceOut;
+    }
+    return reverki_trace_file != NULL ? reverki_trace_file : stderr;
+}
+
+/**
+ * @brief Traces out the process in which the term is divided, to a specified stream
  *
  * @param term The term to be traced
- * @return int 0 if successful, -1 if not
+ * @param dotIndex The depth of the term
+ * @param out The stream
  */
-int reverki_trace(REVERKI_TERM *term, int dotIndex) {
+static void traceTerm(REVERKI_TERM *term, int dotIndex, FILE *out) {
     for(int i = 0; i < dotIndex; i++) {
-        fprintf(stderr, ".");
+        fprintf(out, ".");
     }
-    reverki_unparse_term(term, stderr);
-    fprintf(stderr, "\n");
+    reverki_unparse_term(term, out);
+    fprintf(out, "\n");
     if(term->type == REVERKI_PAIR_TYPE) {
-        reverki_trace(term->value.pair.fst, dotIndex + 1);
-        reverki_trace(term->value.pair.snd, dotIndex + 1);
+        traceTerm(term->value.pair.fst, dotIndex + 1, out);
+        traceTerm(term->value.pair.snd, dotIndex + 1, out);
     }
+}
+
+/**
+ * @brief Traces out the process in which the term is divided
+ *
+ * @param term The term to be traced
+ * @return int 0 if successful, -1 if not
+ */
+int reverki_trace(REVERKI_TERM *term, int dotIndex) {
+    traceTerm(term, dotIndex, stderr);
     return 0;
 }
 
+/**
+ * @brief prints a string as a JSON string literal
+ *
+ * @param s The string
+ * @param size The number of characters in the string
+ * @param out The stream
+ */
+static void printJsonString(char *s, size_t size, FILE *out) {
+    fputc('"', out);
+    for(size_t i = 0; i < size; i++) {
+        char c = *(s + i);
+        if(c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if((unsigned char)c < ' ') {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * @brief  Get the time elapsed since an arbitrary fixed point.
+ * @return  The time, in seconds.
+ */
+double reverki_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * @brief  Print statistics to stderr.
+ * @details  The counts of atoms, terms and rules in use are followed by the
+ * number of rewriting steps and garbage collections, the number of terms ever
+ * created and the most in use at once, the peak memory use of the process, the
+ * time spent parsing, rewriting and printing, and, for each rule in the order
+ * in which they were read, the number of times it was applied, the number of
+ * times the matcher considered it (that is, reached it as a candidate in the
+ * matching automaton), and how many of those it rejected because a repeated
+ * variable was bound to different terms.  With --stats-format=json the same
+ * figures are printed as a single JSON object on one line.
+ * @return  0.
+ */
 int reverki_statistics() {
-    fprintf(stderr, "Atoms used: %d, free: %d\n", *pAtomCounter, REVERKI_NUM_ATOMS - *pAtomCounter);
-    fprintf(stderr, "Terms used: %d, free: %d\n", *pTermCounter, REVERKI_NUM_TERMS - *pTermCounter);
-    fprintf(stderr, "Rules used: %d, free: %d\n", *pRuleCounter, REVERKI_NUM_RULES - *pRuleCounter);
+    int termsFree = reverki_arena_free_count(&reverki_term_arena) + reverki_term_arena.used - *pTermCounter;
+    struct rusage usage;
+    long peakMemory = getrusage(RUSAGE_SELF, &usage) ? 0 : usage.ru_maxrss;
+    int memo = (global_options & MEMO_OPTION) == MEMO_OPTION;
+
+    if((global_options & STATS_JSON_OPTION) == STATS_JSON_OPTION) {
+        fprintf(stderr, "{\"atoms\": {\"used\": %d, \"free\": %d}, ", *pAtomCounter,
+                reverki_arena_free_count(&reverki_atom_arena));
+        fprintf(stderr, "\"terms\": {\"used\": %d, \"free\": %d, \"allocated\": %lu, \"peak\": %d}, ",
+                *pTermCounter, termsFree, termsAllocated, peakTerms);
+        fprintf(stderr, "\"rules\": {\"used\": %d, \"free\": %d}, ", *pRuleCounter,
+                reverki_arena_free_count(&reverki_rule_arena));
+        if(memo) {
+            fprintf(stderr, "\"memo\": {\"hits\": %d, \"misses\": %d, \"evictions\": %d, "
+                    "\"probes\": %d, \"probe_hits\": %d}, ",
+                    memoHits, memoMisses, memoEvictions, memoProbes, memoProbeHits);
+        }
+        fprintf(stderr, "\"steps\": %lu, \"collections\": %d, \"peak_memory_kib\": %ld, ",
+                totalSteps, collections, peakMemory);
+        fprintf(stderr, "\"time\": {\"parse\": %.6f, \"rewrite\": %.6f, \"print\": %.6f}, ",
+                reverki_parse_time, reverki_rewrite_time, reverki_print_time);
+        fprintf(stderr, "\"rule_stats\": [");
+        for(int i = 0; i < *pRuleCounter; i++) {
+            REVERKI_RULE *rule = reverki_arena_get(&reverki_rule_arena, i);
+            char *text = NULL;
+            size_t size = 0;
+            FILE *out = open_memstream(&text, &size);
+            if(out != NULL) {
+                reverki_unparse_rule(rule, out);
+                fclose(out);
+            }
+            fprintf(stderr, "%s{\"rule\": ", i ? ", " : "");
+            printJsonString(text != NULL ? text : "", size, stderr);
+            fprintf(stderr, ", \"fired\": %lu, \"attempted\": %lu, \"failed\": %lu}",
+                    rule->fires, rule->attempts, rule->failures);
+            free(text);
+        }
+        fprintf(stderr, "]}\n");
+        return 0;
+    }
+
+    fprintf(stderr, "Atoms used: %d, free: %d\n", *pAtomCounter, reverki_arena_free_count(&reverki_atom_arena));
+    fprintf(stderr, "Terms used: %d, free: %d\n", *pTermCounter, termsFree);
+    fprintf(stderr, "Rules used: %d, free: %d\n", *pRuleCounter, reverki_arena_free_count(&reverki_rule_arena));
+    if(memo) {
+        fprintf(stderr, "Normal-form cache hits: %d, misses: %d, evictions: %d\n", memoHits, memoMisses, memoEvictions);
+        fprintf(stderr, "Normal-form cache probes while looking for redexes: %d, known normal forms: %d\n",
+                memoProbes, memoProbeHits);
+    }
+    fprintf(stderr, "Steps: %lu, garbage collections: %d\n", totalSteps, collections);
+    fprintf(stderr, "Terms allocated: %lu, peak in use: %d\n", termsAllocated, peakTerms);
+    fprintf(stderr, "Peak memory: %ld KiB\n", peakMemory);
+    fprintf(stderr, "Time parsing: %.6fs, rewriting: %.6fs, printing: %.6fs\n",
+            reverki_parse_time, reverki_rewrite_time, reverki_print_time);
+    for(int i = 0; i < *pRuleCounter; i++) {
+        REVERKI_RULE *rule = reverki_arena_get(&reverki_rule_arena, i);
+        fprintf(stderr, "Rule ");
+        reverki_unparse_rule(rule, stderr);
+        fprintf(stderr, " fired: %lu, attempted: %lu, failed: %lu\n", rule->fires, rule->attempts, rule->failures);
+    }
     return 0;
 }
 
-REVERKI_TERM *reverki_rewrite_helper(REVERKI_TERM *pat, REVERKI_TERM *tgt, REVERKI_RULE *rule_list, REVERKI_SUBST *subst, int index) {
-    if((tgt->type == REVERKI_CONSTANT_TYPE || tgt->type == REVERKI_VARIABLE_TYPE)) {
-        if(reverki_match(pat, tgt, subst)) {
-            REVERKI_TERM *varcon = reverki_apply(*subst, rule_list->rhs);
+/**
+ * @brief Reclaims all terms except those reachable from the rules, the term
+ * originally given to be rewritten and the term it has been rewritten to so far,
+ * together with those kept alive by a batch being rewritten.
+ * This may only be called between rewriting steps, when no other terms are in use.
+ *
+ * @param rule_list The list of rules being used for rewriting
+ * @param term The term originally given to be rewritten
+ * @param current The result of the rewriting steps performed so far
+ */
+static void collectGarbage(REVERKI_RULE *rule_list, REVERKI_TERM *term, REVERKI_TERM *current) {
+    while(rule_list != NULL) {
+        reverki_mark_term(rule_list->lhs);
+        reverki_mark_term(rule_list->rhs);
+        rule_list = rule_list->next;
+    }
+    reverki_mark_term(term);
+    reverki_mark_term(current);
+    if(batchTerms != NULL) {
+        for(int i = 0; i < batchCount; i++) {
+            reverki_mark_term(*(batchTerms + i));
+            reverki_mark_term((batchResults + i)->term);
+        }
+        for(int i = 0; i < batchWorkers; i++) {
+            reverki_mark_term((batchTasks + i)->current);
+        }
+    }
+    int reclaimed = reverki_sweep_terms();
+    reverki_memo_sweep();
+    reverki_tracefile_sweep();
+    ruleCacheGeneration++;
+    collections++;
+    debug("Reclaimed %d terms, %d in use", reclaimed, *pTermCounter);
+}
+
+/**
+ * @brief returns true if graph rewriting is in use
+ *
+ * @return int 1 if graph rewriting is in use, 0 if not
+ */
+static int graphRewriting() {
+    return (global_options & GRAPH_OPTION) == GRAPH_OPTION;
+}
+
+/**
+ * @brief Begins a new step for graph rewriting, so that no subterm is yet
+ * recorded as having been rewritten
+ */
+static void beginStep() {
+    stepTableUsed = 0;
+    if(++stepNumber == 0) {
+        // The stamps have wrapped around, so they can no longer be trusted
+        for(unsigned long i = 0; i < stepTableSize; i++) {
+            (stepTable + i)->step = 0;
+        }
+        stepNumber = 1;
+    }
+}
+
+/**
+ * @brief finds the slot of the step table for a subterm, or the slot where it
+ * should be entered
+ *
+ * @param term The subterm
+ * @return STEP_ENTRY* The slot found
+ */
+static STEP_ENTRY *findStepEntry(REVERKI_TERM *term) {
+    unsigned long mask = stepTableSize - 1;
+    unsigned long h = (unsigned long)term * 0x9e3779b97f4a7c15UL;
+    unsigned long slot = (h >> 32) & mask;
+    while((stepTable + slot)->step == stepNumber && (stepTable + slot)->term != term) {
+        slot = (slot + 1) & mask;
+    }
+    return stepTable + slot;
+}
+
+/**
+ * @brief returns what a subterm was rewritten to earlier in the current step
+ *
+ * @param term The subterm
+ * @return REVERKI_TERM* The result, or NULL if the subterm has not been rewritten
+ */
+static REVERKI_TERM *sharedResult(REVERKI_TERM *term) {
+    if(stepTable == NULL) {
+        return NULL;
+    }
+    STEP_ENTRY *entry = findStepEntry(term);
+    return entry->step == stepNumber ? entry->result : NULL;
+}
+
+/**
+ * @brief records what a subterm was rewritten to during the current step,
+ * doubling the size of the step table first if it is half full
+ *
+ * @param term The subterm
+ * @param result What it was rewritten to
+ */
+static void recordResult(REVERKI_TERM *term, REVERKI_TERM *result) {
+    if((stepTableUsed + 1) * 2 > stepTableSize) {
+        STEP_ENTRY *oldTable = stepTable;
+        unsigned long oldSize = stepTableSize;
+        unsigned long newSize = oldSize ? oldSize * 2 : STEP_TABLE_INITIAL_SIZE;
+        STEP_ENTRY *newTable = calloc(newSize, sizeof(STEP_ENTRY));
+        if(newTable == NULL) {
+            // Without the entry, the subterm will just be rewritten again
+            return;
+        }
+        stepTable = newTable;
+        stepTableSize = newSize;
+        for(unsigned long i = 0; i < oldSize; i++) {
+            if((oldTable + i)->step == stepNumber) {
+                *findStepEntry((oldTable + i)->term) = *(oldTable + i);
+            }
+        }
+        free(oldTable);
+    }
+    STEP_ENTRY *entry = findStepEntry(term);
+    if(entry->step != stepNumber) {
+        stepTableUsed++;
+    }
+    entry->term = term;
+    entry->result = result;
+    entry->step = stepNumber;
+}
+
+/**
+ * @brief Matches the left-hand side of the rule being applied against a term,
+ * using the automaton compiled from the rules
+ *
+ * @param tgt The term to be matched
+ * @param subst By-reference substitution, set if the match succeeds
+ * @return int 1 if the match succeeds, 0 if not
+ */
+static int matchCurrentRule(REVERKI_TERM *tgt, REVERKI_SUBST *subst) {
+    int priority;
+    return reverki_automaton_match(ruleAutomaton, tgt, currentPriority - 1, &priority, subst) != NULL &&
+           priority == currentPriority;
+}
+
+/**
+ * @brief returns true if a term is known to be in normal form
+ *
+ * @param term The term
+ * @return int 1 if the normal-form cache is in use and records the term as being
+ * its own normal form, 0 otherwise
+ */
+static int knownNormalForm(REVERKI_TERM *term) {
+    return (global_options & MEMO_OPTION) == MEMO_OPTION && reverki_memo_probe(term);
+}
+
+/**
+ * @brief returns true if the components of a pair are to be processed by
+ * different tasks during the current step
+ *
+ * @param term The term
+ * @return int 1 if term is a pair whose components are both large enough, 0 if not
+ */
+static int forkable(REVERKI_TERM *term) {
+    return parallelStep && term->type == REVERKI_PAIR_TYPE &&
+           term->value.pair.fst->size >= PARALLEL_CUTOFF && term->value.pair.snd->size >= PARALLEL_CUTOFF;
+}
 
-            if((global_options & TRACE_OPTION) == TRACE_OPTION) {
-                REVERKI_SUBST tempSub = *subst;
-                // Trace used
-                for(int i = 0; i < index; i++) {
-                    fprintf(stderr, ".");
+/**
+ * @brief Pushes a position onto the position stack, growing it if necessary
+ *
+ * @param term The subterm at the new position
+ */
+static void pushPosition(REVERKI_TERM *term) {
+    if(positionCount == maxPositions) {
+        int newMax = maxPositions ? maxPositions * 2 : 64;
+        POSITION *newStack = realloc(positionStack, newMax * sizeof(POSITION));
+        if(newStack == NULL) {
+            fprintf(stderr, "Could not allocate position stack\n");
+            abort();
+        }
+        positionStack = newStack;
+        maxPositions = newMax;
+    }
+    POSITION *pos = positionStack + positionCount;
+    pos->term = term;
+    pos->fst = NULL;
+    pos->rule = NULL;
+    pos->priority = __INT_MAX__;
+    pos->state = 0;
+    positionCount++;
+}
+
+/**
+ * @brief returns the position at the top of the position stack
+ *
+ * @return POSITION* The position, which is only valid until the next push
+ */
+static POSITION *topPosition() {
+    return positionStack + (positionCount - 1);
+}
+
+/**
+ * @brief Finds the first rule, following a specified position in the rule list,
+ * whose left-hand side matches some subterm of a term.  Subterms known to be in
+ * normal form are not searched, and subterms found to be in normal form are
+ * recorded as such in the normal-form cache.  The term is walked with the
+ * position stack; the C stack is only used where the second component of a
+ * pair is searched by another task.
+ *
+ * @param term The term whose subterms are to be matched
+ * @param after Only rules occurring after this position are considered
+ * @param bestp By-reference position of the best rule found so far (initially
+ * __INT_MAX__); only rules occurring before it are considered
+ * @return REVERKI_RULE* The best rule found in the term, or NULL if none
+ */
+static REVERKI_RULE *findFirstRule(REVERKI_TERM *term, int after, int *bestp) {
+    REVERKI_RULE *best = NULL;
+
+    // Whether no rule at all matches anywhere in the subterm last searched.  The
+    // priority of a position is left at __INT_MAX__ until some rule is found to
+    // match in its subterm, or a part of its subterm is left unsearched.
+    int clean = 0;
+    int base = positionCount;
+    pushPosition(term);
+    while(positionCount > base) {
+        POSITION *pos = topPosition();
+        REVERKI_TERM *tgt = pos->term;
+        if(pos->state == 0) {
+            if(knownNormalForm(tgt)) {
+                clean = 1;
+                positionCount--;
+                continue;
+            }
+            int priority;
+            REVERKI_RULE *rule = reverki_automaton_match(ruleAutomaton, tgt, after, &priority, NULL);
+            if(rule != NULL) {
+                pos->priority = priority;
+                if(priority < *bestp) {
+                    best = rule;
+                    *bestp = priority;
+                }
+            }
+            pos->state = 2;
+            if(forkable(tgt) && *bestp > after + 1) {
+                // The second component is searched with the bound known before the first
+                SEARCH_TASK search = {{runSearch, 0}, tgt->value.pair.snd, after, *bestp, NULL};
+                reverki_pool_fork(&search.task);
+                REVERKI_RULE *found = findFirstRule(tgt->value.pair.fst, after, bestp);
+                if(found != NULL) {
+                    best = found;
                 }
-                reverki_unparse_term(tgt, stderr);
-                fprintf(stderr, "\n");
-
-                // Rules/Substitution
-                fprintf(stderr, "==> rule: ");
-                reverki_unparse_rule(rule_list, stderr);
-                fprintf(stderr, ", subst: ");
-                while(tempSub != NULL) {
-                    reverki_unparse_rule(tempSub, stderr);
-                    fprintf(stderr, " ");
-                    tempSub = tempSub->next;
+                reverki_pool_join(&search.task);
+                if(search.rule != NULL && search.best < *bestp) {
+                    best = search.rule;
+                    *bestp = search.best;
+                }
+
+                // Each task records the normal forms in its own component
+                pos = topPosition();
+                pos->priority = 0;
+            } else if(tgt->type == REVERKI_PAIR_TYPE && *bestp > after + 1) {
+                pos->state = 1;
+                pushPosition(tgt->value.pair.fst);
+                continue;
+            } else if(tgt->type == REVERKI_PAIR_TYPE) {
+                pos->priority = 0;
+            }
+        } else {
+            if(!clean) {
+                pos->priority = 0;
+            }
+            if(pos->state == 1) {
+                pos->state = 2;
+                if(*bestp > after + 1) {
+                    pushPosition(tgt->value.pair.snd);
+                    continue;
                 }
-                fprintf(stderr, ".\n");
+                pos->priority = 0;
+            }
+        }
+
+        // Only a search from the first rule shows that no rule matches
+        clean = pos->priority == __INT_MAX__;
+        if(clean && after < 0 && (global_options & MEMO_OPTION) == MEMO_OPTION) {
+            reverki_memo_insert(tgt, tgt);
+        }
+        positionCount--;
+    }
+    return best;
+}
+
+/**
+ * @brief Traces a rewriting step: the subterm rewritten, the rule and
+ * substitution used, and the term it was replaced by
+ *
+ * @param tgt The subterm rewritten
+ * @param rule The rule used
+ * @param subst The substitution used
+ * @param result The term that replaces tgt
+ * @param index The depth of tgt in the term being rewritten
+ */
+static void traceStep(REVERKI_TERM *tgt, REVERKI_RULE *rule, REVERKI_SUBST *subst, REVERKI_TERM *result, int index) {
+    FILE *out = traceStream();
+    if(reverki_trace_file != NULL) {
+        reverki_tracefile_step(out, currentStep, tgt, rule, subst, result, index);
+        return;
+    }
+
+    // Trace used
+    for(int i = 0; i < index; i++) {
+        fprintf(out, ".");
+    }
+    reverki_unparse_term(tgt, out);
+    fprintf(out, "\n");
+
+    // Rules/Substitution
+    fprintf(out, "==> rule: ");
+    reverki_unparse_rule(rule, out);
+    fprintf(out, ", subst: ");
+    reverki_unparse_subst(subst, out);
+    fprintf(out, ".\n");
+
+    // Term created
+    traceTerm(result, index, out);
+}
+
+/**
+ * @brief Runs a search task, finding the best rule in its subterm
+ *
+ * @param task The task, which is a SEARCH_TASK
+ */
+static void runSearch(REVERKI_TASK *task) {
+    SEARCH_TASK *search = (SEARCH_TASK *)task;
+    search->rule = findFirstRule(search->term, search->after, &search->best);
+}
 
-                // Term created
-                reverki_trace(varcon, index);
+/**
+ * @brief Runs a sweep task, rewriting its subterm with its own substitution
+ * and, when tracing, its own trace buffer
+ *
+ * @param task The task, which is a SWEEP_TASK
+ */
+static void runSweep(REVERKI_TASK *task) {
+    SWEEP_TASK *sweep = (SWEEP_TASK *)task;
+    REVERKI_SUBST subst;
+    subst.count = 0;
+    FILE *saved = traceOut;
+    currentPriority = sweep->priority;
+    currentStep = sweep->step;
+    if((global_options & TRACE_OPTION) == TRACE_OPTION &&
+       (traceOut = open_memstream(&sweep->trace, &sweep->traceSize)) == NULL) {
+        fprintf(stderr, "Could not allocate trace buffer\n");
+        abort();
+    }
+    sweep->result = reverki_rewrite_helper(sweep->tgt, sweep->rule, &subst, sweep->index);
+    if(traceOut != saved) {
+        fclose(traceOut);
+        traceOut = saved;
+    }
+}
+
+REVERKI_TERM *reverki_rewrite_helper(REVERKI_TERM *tgt, REVERKI_RULE *rule_list, REVERKI_SUBST *subst, int index) {
+    REVERKI_PROFILE_ENTER(REVERKI_PROFILE_REWRITE);
+    REVERKI_TERM *result = tgt;
+    int base = positionCount;
+    pushPosition(tgt);
+    while(positionCount > base) {
+        POSITION *pos = topPosition();
+        REVERKI_TERM *term = pos->term;
+        int depth = index + (positionCount - base - 1);
+        if(pos->state == 0) {
+            REVERKI_PROFILE_NODE(REVERKI_PROFILE_REWRITE);
+            REVERKI_TERM *shared;
+            if(graphRewriting() && (shared = sharedResult(term)) != NULL) {
+                result = shared;
+                positionCount--;
+                continue;
+            }
+            if(matchCurrentRule(term, subst)) {
+                result = reverki_instantiate(rule_list, subst);
+                if((global_options & TRACE_OPTION) == TRACE_OPTION) {
+                    traceStep(term, rule_list, subst, result, depth);
+                }
+            } else if(term->type != REVERKI_PAIR_TYPE) {
+                result = term;
+                positionCount--;
+                continue;
+            } else if(forkable(term)) {
+                SWEEP_TASK sweep = {{runSweep, 0}, term->value.pair.snd, rule_list, currentPriority, currentStep,
+                                   depth+1, NULL, NULL, 0};
+                reverki_pool_fork(&sweep.task);
+                REVERKI_TERM *lhs = reverki_rewrite_helper(term->value.pair.fst, rule_list, subst, depth+1);
+                reverki_pool_join(&sweep.task);
+                if(sweep.trace != NULL) {
+                    fwrite(sweep.trace, 1, sweep.traceSize, traceStream());
+                    free(sweep.trace);
+                }
+                pos = topPosition();
+                pos->fst = lhs;
+                pos->state = 2;
+                result = sweep.result;
+                continue;
+            } else {
+                pos->state = 1;
+                pushPosition(term->value.pair.fst);
+                continue;
             }
+        } else if(pos->state == 1) {
+            pos->fst = result;
+            pos->state = 2;
+            pushPosition(term->value.pair.snd);
+            continue;
+        } else if(pos->fst != term->value.pair.fst || result != term->value.pair.snd) {
+            result = reverki_make_pair(pos->fst, result);
+        } else {
+            result = term;
+        }
+        if(graphRewriting()) {
+            recordResult(term, result);
+        }
+        positionCount--;
+    }
+    return result;
+}
+
+/**
+ * @brief returns the entry of the rule cache to which a term hashes
+ *
+ * @param term The term
+ * @return RULE_CACHE_ENTRY* The entry
+ */
+static RULE_CACHE_ENTRY *ruleCacheEntry(REVERKI_TERM *term) {
+    unsigned long h = (unsigned long)term * 0x9e3779b97f4a7c15UL;
+    return ruleCache + ((h >> 32) & (RULE_CACHE_SIZE - 1));
+}
 
-            return varcon;
+/**
+ * @brief Finds the first rule whose left-hand side matches some subterm of a
+ * term.  The result is cached, so that after a rewriting step only the subterms
+ * that were changed by the step need to be searched again.  The term is walked
+ * with the position stack.
+ *
+ * @param term The term whose subterms are to be matched
+ * @param priorityp By-reference position of the rule found in the rule list,
+ * set to __INT_MAX__ if none
+ * @return REVERKI_RULE* The first rule that matches some subterm, or NULL if none
+ */
+static REVERKI_RULE *firstRuleIn(REVERKI_TERM *term, int *priorityp) {
+    if(ruleCache == NULL && (ruleCache = calloc(RULE_CACHE_SIZE, sizeof(RULE_CACHE_ENTRY))) == NULL) {
+        fprintf(stderr, "Could not allocate rule cache\n");
+        abort();
+    }
+
+    // Rule found in the subterm last searched, and its position in the rule list
+    REVERKI_RULE *found = NULL;
+    int priority = __INT_MAX__;
+    int base = positionCount;
+    pushPosition(term);
+    while(positionCount > base) {
+        POSITION *pos = topPosition();
+        REVERKI_TERM *tgt = pos->term;
+        RULE_CACHE_ENTRY *entry;
+        if(pos->state == 0) {
+            if(knownNormalForm(tgt)) {
+                found = NULL;
+                priority = __INT_MAX__;
+                positionCount--;
+                continue;
+            }
+            if((entry = ruleCacheEntry(tgt))->term == tgt) {
+                found = entry->rule;
+                priority = entry->priority;
+                positionCount--;
+                continue;
+            }
+            if((pos->rule = reverki_automaton_match(ruleAutomaton, tgt, -1, &pos->priority, NULL)) == NULL) {
+                pos->priority = __INT_MAX__;
+            }
+            if(tgt->type == REVERKI_PAIR_TYPE && pos->priority > 0) {
+                pos->state = 1;
+                pushPosition(tgt->value.pair.fst);
+                continue;
+            }
         } else {
-            return tgt;
+            if(found != NULL && priority < pos->priority) {
+                pos->rule = found;
+                pos->priority = priority;
+            }
+            if(pos->state == 1 && pos->priority > 0) {
+                pos->state = 2;
+                pushPosition(tgt->value.pair.snd);
+                continue;
+            }
+        }
+
+        // The entry may have been overwritten while the subterms were searched
+        entry = ruleCacheEntry(tgt);
+        entry->term = tgt;
+        entry->rule = pos->rule;
+        entry->priority = pos->priority;
+        if(pos->rule == NULL && (global_options & MEMO_OPTION) == MEMO_OPTION) {
+            reverki_memo_insert(tgt, tgt);
         }
+        found = pos->rule;
+        priority = pos->priority;
+        positionCount--;
     }
-    if(reverki_match(pat, tgt, subst)) {
-        REVERKI_TERM *newTerm = reverki_apply(*subst, rule_list->rhs);
+    *priorityp = priority;
+    return found;
+}
 
-        if((global_options & TRACE_OPTION) == TRACE_OPTION) {
-            REVERKI_SUBST tempSub = *subst;
-            // Trace used
-            for(int i = 0; i < index; i++) {
-                fprintf(stderr, ".");
+/**
+ * @brief Incremental counterpart of reverki_rewrite_helper, for the case in
+ * which the rule being applied is the first rule that matches anywhere in the
+ * term.  The term is walked with an explicit stack of positions, and only the
+ * subterms in which the rule matches are visited: every other subterm is
+ * known, from the rule cache, to be left unchanged.  The subterms above each
+ * rewritten position are rebuilt on the way back up; all others are shared
+ * with the original term.  With graph rewriting, a subterm that occurs more
+ * than once is rewritten only where it is first visited.
+ *
+ * @param term The term to be rewritten
+ * @param rule The rule being applied
+ * @param subst By-reference substitution used by the match
+ * @return REVERKI_TERM* The rewritten term
+ */
+static REVERKI_TERM *rewriteIncremental(REVERKI_TERM *term, REVERKI_RULE *rule, REVERKI_SUBST *subst) {
+    REVERKI_TERM *result = term;
+    int base = positionCount;
+    pushPosition(term);
+    while(positionCount > base) {
+        POSITION *pos = topPosition();
+        REVERKI_TERM *tgt = pos->term;
+        int priority;
+        if(pos->state == 0) {
+            REVERKI_TERM *shared;
+            if(firstRuleIn(tgt, &priority) == NULL || priority != currentPriority) {
+                result = tgt;
+                positionCount--;
+            } else if(graphRewriting() && (shared = sharedResult(tgt)) != NULL) {
+                result = shared;
+                positionCount--;
+            } else if(matchCurrentRule(tgt, subst)) {
+                result = reverki_instantiate(rule, subst);
+                if((global_options & TRACE_OPTION) == TRACE_OPTION) {
+                    traceStep(tgt, rule, subst, result, positionCount - base - 1);
+                }
+                if(graphRewriting()) {
+                    recordResult(tgt, result);
+                }
+                positionCount--;
+            } else {
+                topPosition()->state = 1;
+                pushPosition(tgt->value.pair.fst);
             }
-            reverki_unparse_term(tgt, stderr);
-            fprintf(stderr, "\n");
+        } else if(pos->state == 1) {
+            pos->fst = result;
+            pos->state = 2;
+            pushPosition(tgt->value.pair.snd);
+        } else {
+            if(pos->fst != tgt->value.pair.fst || result != tgt->value.pair.snd) {
+                result = reverki_make_pair(pos->fst, result);
+            } else {
+                result = tgt;
+            }
+            if(graphRewriting()) {
+                recordResult(tgt, result);
+            }
+            positionCount--;
+        }
+    }
+    return result;
+}
 
-            // Rules/Substitution
-            fprintf(stderr, "==> rule: ");
-            reverki_unparse_rule(rule_list, stderr);
-            fprintf(stderr, ", subst: ");
-            while(tempSub != NULL) {
-                reverki_unparse_rule(tempSub, stderr);
-                fprintf(stderr, " ");
-                tempSub = tempSub->next;
+/**
+ * @brief Finds the leftmost-outermost redex of a term: the first subterm, in
+ * preorder, that some rule matches.  The term is walked with the position stack.
+ *
+ * @param tgt The term to be searched
+ * @param subst By-reference substitution, set by the match of the redex
+ * @param rulep By-reference rule, set to the first rule that matches the redex
+ * @param indexp By-reference depth of tgt, set to the depth of the redex
+ * @return REVERKI_TERM* The redex, or NULL if there is none
+ */
+static REVERKI_TERM *findOutermost(REVERKI_TERM *tgt, REVERKI_SUBST *subst, REVERKI_RULE **rulep, int *indexp) {
+    REVERKI_TERM *redex = NULL;
+    int base = positionCount;
+    pushPosition(tgt);
+    while(positionCount > base && redex == NULL) {
+        REVERKI_TERM *term = topPosition()->term;
+        int priority;
+        if(topPosition()->state == 0 && firstRuleIn(term, &priority) == NULL) {
+            positionCount--;
+        } else if(topPosition()->state == 0) {
+            if((*rulep = reverki_automaton_match(ruleAutomaton, term, -1, &priority, subst)) != NULL) {
+                redex = term;
+                *indexp += positionCount - base - 1;
+            } else {
+                // Some subterm is a redex, since term itself is not
+                topPosition()->state = 1;
+                pushPosition(term->value.pair.fst);
             }
-            fprintf(stderr, ".\n");
+        } else if(topPosition()->state == 1) {
+            topPosition()->state = 2;
+            pushPosition(term->value.pair.snd);
+        } else {
+            positionCount--;
+        }
+    }
+    positionCount = base;
+    return redex;
+}
 
-            // Term created
-            reverki_trace(newTerm, index);
+/**
+ * @brief Replaces occurrences of a redex in a term by the result of rewriting it.
+ * Only subterms that contain some redex are searched.  The term is walked with
+ * the position stack.
+ *
+ * @param tgt The term
+ * @param redex The redex
+ * @param result The result of rewriting the redex
+ * @param donep By-reference flag, set once an occurrence has been replaced; if
+ * NULL, then every occurrence is replaced
+ * @return REVERKI_TERM* The term with the occurrences replaced
+ */
+static REVERKI_TERM *replaceRedex(REVERKI_TERM *tgt, REVERKI_TERM *redex, REVERKI_TERM *result, int *donep) {
+    REVERKI_TERM *newTerm = tgt;
+    int base = positionCount;
+    pushPosition(tgt);
+    while(positionCount > base) {
+        REVERKI_TERM *term = topPosition()->term;
+        int priority;
+        REVERKI_TERM *shared;
+        if(topPosition()->state == 0) {
+            if(donep != NULL && *donep) {
+                newTerm = term;
+            } else if(term == redex) {
+                if(donep != NULL) {
+                    *donep = 1;
+                }
+                newTerm = result;
+            } else if(term->type != REVERKI_PAIR_TYPE || firstRuleIn(term, &priority) == NULL) {
+                newTerm = term;
+            } else if(donep == NULL && (shared = sharedResult(term)) != NULL) {
+                newTerm = shared;
+            } else {
+                topPosition()->state = 1;
+                pushPosition(term->value.pair.fst);
+                continue;
+            }
+        } else if(topPosition()->state == 1) {
+            topPosition()->fst = newTerm;
+            topPosition()->state = 2;
+            pushPosition(term->value.pair.snd);
+            continue;
+        } else {
+            REVERKI_TERM *lhs = topPosition()->fst;
+            if(lhs != term->value.pair.fst || newTerm != term->value.pair.snd) {
+                newTerm = reverki_make_pair(lhs, newTerm);
+            } else {
+                newTerm = term;
+            }
+            if(donep == NULL) {
+                recordResult(term, newTerm);
+            }
         }
+        positionCount--;
+    }
+    return newTerm;
+}
+
+/**
+ * @brief Performs one leftmost-outermost step: the leftmost-outermost redex is
+ * rewritten using the first rule that matches it.  With graph rewriting, every
+ * occurrence of the redex is replaced by the result at once.
+ *
+ * @param term The term to be rewritten
+ * @param subst By-reference substitution used by the match
+ * @return REVERKI_TERM* The rewritten term, or term itself if it has no redex
+ */
+static REVERKI_TERM *rewriteOutermost(REVERKI_TERM *term, REVERKI_SUBST *subst) {
+    REVERKI_RULE *rule;
+    int index = 0;
+    REVERKI_TERM *redex = findOutermost(term, subst, &rule, &index);
+    if(redex == NULL) {
+        return term;
+    }
+    REVERKI_TERM *result = reverki_instantiate(rule, subst);
+    if((global_options & TRACE_OPTION) == TRACE_OPTION) {
+        traceStep(redex, rule, subst, result, index);
+    }
+    if(graphRewriting()) {
+        return replaceRedex(term, redex, result, NULL);
+    }
+    int done = 0;
+    return replaceRedex(term, redex, result, &done);
+}
 
-        return newTerm;
+/**
+ * @brief Performs one parallel-outermost step: every outermost redex is
+ * rewritten, using the first rule that matches it.  With graph rewriting, a
+ * redex that occurs more than once is rewritten only where it is first visited.
+ * The term is walked with the position stack.
+ *
+ * @param tgt The term to be rewritten
+ * @param subst By-reference substitution used by the matches
+ * @param index The depth of tgt in the term being rewritten
+ * @return REVERKI_TERM* The rewritten term, or tgt itself if it has no redex
+ */
+static REVERKI_TERM *rewriteParallel(REVERKI_TERM *tgt, REVERKI_SUBST *subst, int index) {
+    REVERKI_TERM *newTerm = tgt;
+    int base = positionCount;
+    pushPosition(tgt);
+    while(positionCount > base) {
+        REVERKI_TERM *term = topPosition()->term;
+        int priority;
+        REVERKI_RULE *rule;
+        REVERKI_TERM *shared;
+        if(topPosition()->state == 0) {
+            if(firstRuleIn(term, &priority) == NULL) {
+                newTerm = term;
+                positionCount--;
+                continue;
+            }
+            if(graphRewriting() && (shared = sharedResult(term)) != NULL) {
+                newTerm = shared;
+                positionCount--;
+                continue;
+            }
+            if((rule = reverki_automaton_match(ruleAutomaton, term, -1, &priority, subst)) != NULL) {
+                newTerm = reverki_instantiate(rule, subst);
+                if((global_options & TRACE_OPTION) == TRACE_OPTION) {
+                    traceStep(term, rule, subst, newTerm, index + (positionCount - base - 1));
+                }
+            } else {
+                topPosition()->state = 1;
+                pushPosition(term->value.pair.fst);
+                continue;
+            }
+        } else if(topPosition()->state == 1) {
+            topPosition()->fst = newTerm;
+            topPosition()->state = 2;
+            pushPosition(term->value.pair.snd);
+            continue;
+        } else {
+            REVERKI_TERM *lhs = topPosition()->fst;
+            if(lhs != term->value.pair.fst || newTerm != term->value.pair.snd) {
+                newTerm = reverki_make_pair(lhs, newTerm);
+            } else {
+                newTerm = term;
+            }
+        }
+        if(graphRewriting()) {
+            recordResult(term, newTerm);
+        }
+        positionCount--;
     }
-    REVERKI_TERM *lhs = reverki_rewrite_helper(pat, tgt->value.pair.fst, rule_list, subst, index+1);
-    REVERKI_TERM *rhs = reverki_rewrite_helper(pat, tgt->value.pair.snd, rule_list, subst, index+1);
-    if(reverki_compare_term(tgt->value.pair.fst, lhs)) {
-        if(reverki_compare_term(tgt->value.pair.snd, rhs)) {
-            return reverki_make_pair(lhs, rhs);
+    return newTerm;
+}
+
+/**
+ * @brief Compiles the rules into the automaton used for matching, unless they
+ * have already been compiled
+ *
+ * @param rule_list The list of rules
+ */
+static void compileRules(REVERKI_RULE *rule_list) {
+    if(compiledRules != rule_list) {
+        if((ruleAutomaton = reverki_compile_rules(rule_list)) == NULL) {
+            fprintf(stderr, "Could not compile rules\n");
+            abort();
         }
-        return reverki_make_pair(lhs, tgt->value.pair.snd);
-    } else if(reverki_compare_term(tgt->value.pair.snd, rhs)) {
-        return reverki_make_pair(tgt->value.pair.fst, rhs);
+        compiledRules = rule_list;
+        ruleCacheGeneration++;
     }
-    return tgt;
 }
 
+/**
+ * @brief Ends a step of rewriting a term of a batch, letting another task
+ * perform a garbage collection, or performing one itself if it is needed
+ *
+ * @param rule_list The list of rules being used for rewriting
+ * @param term The term originally given to be rewritten
+ * @param current The result of the rewriting steps performed so far
+ */
+static void batchSafePoint(REVERKI_RULE *rule_list, REVERKI_TERM *term, REVERKI_TERM *current) {
+    batchSlot->current = current;
+    pthread_rwlock_unlock(&batchLock);
+    if(reverki_collection_needed()) {
+        pthread_rwlock_wrlock(&batchLock);
+        if(reverki_collection_needed()) {
+            collectGarbage(rule_list, term, current);
+        }
+        pthread_rwlock_unlock(&batchLock);
+    }
+    pthread_rwlock_rdlock(&batchLock);
+}
 
 /**
  * @brief  This function rewrites a term, using a specified list of rules.
@@ -137,6 +1152,13 @@ REVERKI_TERM *reverki_rewrite_helper(REVERKI_TERM *pat, REVERKI_TERM *tgt, REVER
  * never used to rewrite a term unless none of the rules occurring earlier
  * can be applied.
  *
+ * Two other strategies can be selected with -S.  In the "leftmost-outermost"
+ * strategy (normal order), each step rewrites only the first subterm, in
+ * preorder, that some rule matches, using the first rule that matches it.
+ * In the "parallel-outermost" strategy, each step rewrites every subterm
+ * that some rule matches and that is not inside another such subterm.
+ * These strategies do not rewrite arguments that a rule goes on to discard.
+ *
  * @param rule_list  The list of rules to be used for rewriting.
  * @param term  The term to be rewritten.
  * @return  The rewritten term.  This term should have the property that
@@ -144,33 +1166,260 @@ REVERKI_TERM *reverki_rewrite_helper(REVERKI_TERM *pat, REVERKI_TERM *tgt, REVER
  * using rules in the specified list.
  */
 REVERKI_TERM *reverki_rewrite(REVERKI_RULE *rule_list, REVERKI_TERM *term) {
-    // Pointer to substitution list
+    if(rule_list == NULL) {
+        return term;
+    }
+
+    compileRules(rule_list);
+
+    // The term may have been rewritten before
+    if((global_options & MEMO_OPTION) == MEMO_OPTION) {
+        REVERKI_TERM *normalForm = reverki_memo_lookup(term);
+        if(normalForm != NULL) {
+            return normalForm;
+        }
+    }
+
+    // Term being rewritten, and position in the rule list of the rule last applied
     REVERKI_TERM *newTerm = term;
-    REVERKI_RULE *tempList = rule_list;
-    while(tempList != NULL) {
+    REVERKI_RULE *tempList;
+    int priority = -1;
+    int best = __INT_MAX__;
+    int limitCounter = 0;
 
-        if((global_options & LIMIT_OPTION) == LIMIT_OPTION) {
-            int limit = global_options >> 32;
-            if(limit < limitCounter) {
-                fprintf(stderr, "Rewrite limit exceeded\n");
-                abort();
-            }
+    // Only rules that match somewhere in the term can change it.  After each
+    // step that changes the term, the search begins again with the first rule.
+    while(1) {
+        REVERKI_SUBST subst;
+        subst.count = 0;
+        currentStep = limitCounter;
+        if(ruleCacheSeen != ruleCacheGeneration) {
+            clearRuleCache();
         }
+        if(graphRewriting()) {
+            beginStep();
+        }
+        REVERKI_TERM *result;
+
+        // Outermost strategies rewrite any redex with its first matching rule
+        long strategy = global_options & STRATEGY_OPTION;
+        if(strategy != INNERMOST_STRATEGY) {
+            if(strategy == OUTERMOST_STRATEGY) {
+                result = rewriteOutermost(newTerm, &subst);
+            } else {
+                result = rewriteParallel(newTerm, &subst, 0);
+            }
+
+            // A step that changes nothing would be repeated forever
+            if(result == newTerm) {
+                break;
+            }
+        } else {
+            // Incremental rewriting only applies when searching from the first rule
+            int incremental = ((global_options & INCREMENTAL_OPTION) == INCREMENTAL_OPTION || graphRewriting()) &&
+                              priority < 0;
 
-        REVERKI_RULE *substRule = NULL;
-        REVERKI_SUBST *gSubst = &substRule;
+            // Other threads help only with terms large enough to be split, and
+            // not while they are rewriting the other terms of a batch
+            int parallel = !incremental && !graphRewriting() && reverki_pool_workers() > 1 &&
+                           batchSlot == NULL && newTerm->size >= 2 * PARALLEL_CUTOFF;
+            if(parallel) {
+                parallelStep = 1;
+                reverki_pool_begin();
+            }
+            if(incremental) {
+                tempList = firstRuleIn(newTerm, &best);
+            } else {
+                tempList = findFirstRule(newTerm, priority, &best);
+            }
+            if(tempList != NULL) {
+                priority = best;
+                best = __INT_MAX__;
 
-        // Loop until compared terms are equal
-        reverki_rewrite_helper(tempList->lhs, newTerm, tempList, gSubst, 0);
+                currentPriority = priority;
+                if(incremental) {
+                    result = rewriteIncremental(newTerm, tempList, &subst);
+                } else {
+                    result = reverki_rewrite_helper(newTerm, tempList, &subst, 0);
+                }
+            }
+            if(parallel) {
+                reverki_pool_end();
+                parallelStep = 0;
+            }
+            if(tempList == NULL) {
+                break;
+            }
+        }
 
-        if(reverki_compare_term(newTerm, (reverki_term_storage + *pTermCounter-1))) {
-            newTerm = (reverki_term_storage + *pTermCounter-1);
+        // Terms are hash-consed, so a change shows up as a different pointer
+        if(result != newTerm) {
+            if((global_options & LIMIT_OPTION) == LIMIT_OPTION) {
+                int limit = global_options >> 32;
+                if(limit <= limitCounter) {
+                    fprintf(stderr, "Rewrite limit exceeded\n");
+                    if(reverki_trace_file != NULL) {
+                        fflush(reverki_trace_file);
+                    }
+                    abort();
+                }
+            }
             limitCounter++;
-            return reverki_rewrite(rule_list, (reverki_term_storage + *pTermCounter-1));
+            newTerm = result;
+            priority = -1;
+            if(batchSlot != NULL) {
+                batchSafePoint(rule_list, term, newTerm);
+            } else if(reverki_collection_needed()) {
+                collectGarbage(rule_list, term, newTerm);
+            }
+        }
+    }
+
+    __atomic_add_fetch(&totalSteps, limitCounter, __ATOMIC_RELAXED);
+    if((global_options & MEMO_OPTION) == MEMO_OPTION) {
+        reverki_memo_insert(term, newTerm);
+    }
+    return newTerm;
+}
+
+/**
+ * @brief Records the normal form of a term of a batch, then prints, in order,
+ * every result that can now be printed
+ *
+ * @param index The position of the term in the batch
+ * @param normalForm Its normal form
+ */
+static void finishBatchTerm(int index, REVERKI_TERM *normalForm) {
+    pthread_mutex_lock(&batchPrintLock);
+    double start = reverki_clock();
+    (batchResults + index)->term = normalForm;
+    while(batchPrinted < batchCount && (batchResults + batchPrinted)->term != NULL) {
+        BATCH_RESULT *result = batchResults + batchPrinted;
+        if(result->trace != NULL) {
+            fwrite(result->trace, 1, result->traceSize, traceStream());
+            free(result->trace);
+            result->trace = NULL;
+        }
+        if((global_options & SHARED_OPTION) == SHARED_OPTION) {
+            reverki_write_shared_term(&batchOutput, result->term);
         } else {
-            tempList =  tempList->next;
+            reverki_write_term(&batchOutput, result->term);
         }
+        REVERKI_OUTPUT_PUT(&batchOutput, '\n');
+
+        // Once printed, the result need no longer be kept alive
+        result->term = NULL;
+        batchPrinted++;
     }
+    reverki_output_flush(&batchOutput);
+    reverki_print_time += reverki_clock() - start;
+    pthread_mutex_unlock(&batchPrintLock);
+}
 
-    return term;
+/**
+ * @brief Runs a batch task, rewriting terms of the batch until every term has
+ * been claimed
+ *
+ * @param task The task, which is a BATCH_TASK
+ */
+static void runBatch(REVERKI_TASK *task) {
+    batchSlot = (BATCH_TASK *)task;
+    pthread_rwlock_rdlock(&batchLock);
+    int index;
+    while((index = __atomic_fetch_add(&batchNext, 1, __ATOMIC_RELAXED)) < batchCount) {
+        BATCH_RESULT *result = batchResults + index;
+        REVERKI_TERM *term = *(batchTerms + index);
+        batchSlot->current = term;
+        if((global_options & TRACE_OPTION) == TRACE_OPTION) {
+            if((traceOut = open_memstream(&result->trace, &result->traceSize)) == NULL) {
+                fprintf(stderr, "Could not allocate trace buffer\n");
+                abort();
+            }
+            if(reverki_trace_file != NULL) {
+                reverki_tracefile_term(traceOut, term);
+            } else {
+                fprintf(traceOut, "# ");
+                reverki_unparse_term(term, traceOut);
+                fprintf(traceOut, "\n");
+                traceTerm(term, 0, traceOut);
+            }
+        }
+        REVERKI_TERM *normalForm = reverki_rewrite(batchRules, term);
+        if(traceOut != NULL) {
+            fclose(traceOut);
+            traceOut = NULL;
+        }
+        batchSlot->current = NULL;
+        finishBatchTerm(index, normalForm);
+    }
+    pthread_rwlock_unlock(&batchLock);
+    batchSlot = NULL;
+}
+
+/*
+ * @brief  Rewrite each of a sequence of terms, using a specified list of rules,
+ * and print the results in order.
+ * @details  Each term is rewritten to normal form as by reverki_rewrite, and
+ * its normal form is printed on a line of its own.  The terms are shared out
+ * between the workers of the pool, but the results, and the traces if -t was
+ * specified, are printed in the order in which the terms are given.  Terms
+ * that are no longer needed are reclaimed while the batch is being rewritten,
+ * except for the terms given, which are kept alive throughout.
+ * @param rule_list  The list of rules to be used for rewriting.
+ * @param terms  The terms to be rewritten.
+ * @param count  The number of terms.
+ * @param out  The stream to which the results are printed.
+ * @return  0 if successful, -1 if memory could not be allocated.
+ */
+int reverki_rewrite_batch(REVERKI_RULE *rule_list, REVERKI_TERM **terms, int count, FILE *out) {
+    if(rule_list != NULL) {
+        compileRules(rule_list);
+    }
+    int workers = reverki_pool_workers();
+    if((batchResults = calloc(count ? count : 1, sizeof(BATCH_RESULT))) == NULL ||
+       (batchTasks = calloc(workers, sizeof(BATCH_TASK))) == NULL ||
+       reverki_output_open(&batchOutput, out)) {
+        free(batchResults);
+        free(batchTasks);
+        batchResults = NULL;
+        batchTasks = NULL;
+        fprintf(stderr, "Could not allocate batch\n");
+        return -1;
+    }
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&batchLock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    batchRules = rule_list;
+    batchTerms = terms;
+    batchCount = count;
+    batchWorkers = workers;
+    batchNext = batchPrinted = 0;
+
+    // The calling thread runs the first task, and the others may be stolen
+    if(workers > 1) {
+        reverki_pool_begin();
+    }
+    for(int i = 1; i < workers; i++) {
+        (batchTasks + i)->task.run = runBatch;
+        reverki_pool_fork(&(batchTasks + i)->task);
+    }
+    runBatch(&batchTasks->task);
+    for(int i = workers - 1; i > 0; i--) {
+        reverki_pool_join(&(batchTasks + i)->task);
+    }
+    if(workers > 1) {
+        reverki_pool_end();
+    }
+
+    pthread_rwlock_destroy(&batchLock);
+    reverki_output_close(&batchOutput);
+    free(batchResults);
+    free(batchTasks);
+    batchResults = NULL;
+    batchTasks = NULL;
+    batchTerms = NULL;
+    batchCount = batchWorkers = 0;
+    return 0;
 }
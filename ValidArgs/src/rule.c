@@ -6,8 +6,10 @@
 #include "global.h"
 #include "write.h"
 
-int ruleCounter = 0;
-int *pRuleCounter = &ruleCounter;
+int *pRuleCounter = &reverki_rule_arena.used;
+
+// The rule most recently read by reverki_parse_rule
+static REVERKI_RULE *lastParsedRule = NULL;
 
 
 /*
@@ -19,18 +21,203 @@ int *pRuleCounter = &ruleCounter;
  * @return  A pointer to the newly created rule.
  */
 REVERKI_RULE *reverki_make_rule(REVERKI_TERM *lhs, REVERKI_TERM *rhs) {
-    // Create new rule and pointer to new rule
-    REVERKI_RULE newRule;
-    REVERKI_RULE *pNewRule;
-    pNewRule = &newRule;
+    // Create new rule
+    REVERKI_RULE *pNewRule = reverki_arena_alloc(&reverki_rule_arena);
+    if(pNewRule == NULL) {
+        fprintf(stderr, "Rule limit exceeded");
+        return NULL;
+    }
 
     // Specify the left-hand/right-hand sides
-    newRule.lhs = lhs;
-    newRule.rhs = rhs;
+    pNewRule->lhs = lhs;
+    pNewRule->rhs = rhs;
+    pNewRule->next = NULL;
+    pNewRule->numVars = -1;
+    pNewRule->vars = NULL;
+    pNewRule->template = NULL;
+    pNewRule->fires = pNewRule->attempts = pNewRule->failures = 0;
 
     return pNewRule;
 }
 
+/**
+ * @brief numbers the distinct variables of a term in preorder, continuing a
+ * numbering already begun
+ *
+ * @param term The term
+ * @param vars The variables numbered so far, by number
+ * @param numVars The number of variables numbered so far
+ * @return int The number of variables numbered, or -1 if there are more than
+ * REVERKI_MAX_BINDINGS
+ */
+static int numberVariables(REVERKI_TERM *term, REVERKI_TERM **vars, int numVars) {
+    if(term->type == REVERKI_PAIR_TYPE) {
+        numVars = numberVariables(term->value.pair.fst, vars, numVars);
+        return numVars < 0 ? numVars : numberVariables(term->value.pair.snd, vars, numVars);
+    }
+    if(term->type != REVERKI_VARIABLE_TYPE) {
+        return numVars;
+    }
+    for(int i = 0; i < numVars; i++) {
+        if(*(vars + i) == term) {
+            return numVars;
+        }
+    }
+    if(numVars == REVERKI_MAX_BINDINGS) {
+        return -1;
+    }
+    *(vars + numVars) = term;
+    return numVars + 1;
+}
+
+/**
+ * @brief prepares a term as a template, replacing the numbered variables by
+ * their slots
+ *
+ * @param term The term
+ * @param vars The numbered variables, by number
+ * @param numVars The number of numbered variables
+ * @return REVERKI_TEMPLATE* The template, or NULL if memory could not be allocated
+ */
+static REVERKI_TEMPLATE *makeTemplate(REVERKI_TERM *term, REVERKI_TERM **vars, int numVars) {
+    REVERKI_TEMPLATE *template = malloc(sizeof(REVERKI_TEMPLATE));
+    if(template == NULL) {
+        return NULL;
+    }
+    template->term = term;
+    template->slot = -1;
+    template->fst = template->snd = NULL;
+    if(term->type == REVERKI_VARIABLE_TYPE) {
+        for(int i = 0; i < numVars; i++) {
+            if(*(vars + i) == term) {
+                template->term = NULL;
+                template->slot = i;
+            }
+        }
+    } else if(term->type == REVERKI_PAIR_TYPE) {
+        REVERKI_TEMPLATE *fst = makeTemplate(term->value.pair.fst, vars, numVars);
+        REVERKI_TEMPLATE *snd = makeTemplate(term->value.pair.snd, vars, numVars);
+        if(fst == NULL || snd == NULL) {
+            free(fst);
+            free(snd);
+            free(template);
+            return NULL;
+        }
+
+        // A pair with no numbered variables in it is used as it is
+        if(fst->term != NULL && snd->term != NULL) {
+            free(fst);
+            free(snd);
+        } else {
+            template->term = NULL;
+            template->fst = fst;
+            template->snd = snd;
+        }
+    }
+    return template;
+}
+
+/**
+ * @brief numbers the variables of the left-hand side of a rule and prepares its
+ * right-hand side as a template
+ *
+ * @param rule The rule
+ * @return int 0 if successful, -1 if the rule has too many variables or memory
+ * could not be allocated
+ */
+static int prepareRule(REVERKI_RULE *rule) {
+    REVERKI_TERM **vars = malloc(REVERKI_MAX_BINDINGS * sizeof(REVERKI_TERM *));
+    if(vars == NULL) {
+        return -1;
+    }
+    int numVars = numberVariables(rule->lhs, vars, 0);
+    if(numVars < 0) {
+        fprintf(stderr, "Too many variables in rule (at most %d)\n", REVERKI_MAX_BINDINGS);
+        free(vars);
+        return -1;
+    }
+    REVERKI_TEMPLATE *template = makeTemplate(rule->rhs, vars, numVars);
+    if(template == NULL) {
+        free(vars);
+        return -1;
+    }
+    rule->numVars = numVars;
+    rule->vars = vars;
+    rule->template = template;
+    return 0;
+}
+
+/*
+ * @brief  Create a rule as if it had just been read by reverki_parse_rule.
+ * @details  The distinct variables of the left-hand side of the rule are
+ * numbered, and its right-hand side is prepared as a template.  The rule is
+ * put at the front of the list of rules read so far, which the rule returned
+ * heads.
+ * @param lhs  The left-hand side of the rule.
+ * @param rhs  The right-hand side of the rule.
+ * @return  A pointer to the newly created rule, or NULL if the rule could not
+ * be created or its left-hand side has more than REVERKI_MAX_BINDINGS distinct
+ * variables.
+ */
+REVERKI_RULE *reverki_define_rule(REVERKI_TERM *lhs, REVERKI_TERM *rhs) {
+    REVERKI_RULE *rule = reverki_make_rule(lhs, rhs);
+    if(rule == NULL) {
+        return NULL;
+    }
+    if(prepareRule(rule)) {
+        reverki_arena_release(&reverki_rule_arena, *pRuleCounter - 1);
+        return NULL;
+    }
+    rule->next = lastParsedRule;
+    lastParsedRule = rule;
+    return rule;
+}
+
+/**
+ * @brief consumes an expected punctuation character, after any whitespace
+ *
+ * @param input The input
+ * @param expected The character expected
+ * @return int 0 if the character was found, -1 if some other character (which
+ * is left unconsumed) was found instead, in which case an error message is printed
+ */
+static int expectChar(REVERKI_INPUT *input, int expected) {
+    int c = reverki_input_skip_space(input);
+    if(c != expected) {
+        if(c == EOF) {
+            fprintf(stderr, "Expected '%c' in rule, found end of input\n", expected);
+        } else {
+            fprintf(stderr, "Expected '%c' in rule, found '%c'\n", expected, c);
+        }
+        return -1;
+    }
+    REVERKI_INPUT_NEXT(input);
+    return 0;
+}
+
+/*
+ * @brief  Read a rule from a specified input and return the resulting object.
+ * @details  As reverki_parse_rule, except that characters are taken from an
+ * input rather than a stream, and an unexpected character is left unconsumed
+ * rather than being pushed back.
+ * @param input  The input from which characters are to be read.
+ * @return  A pointer to the newly created rule, if parsing was successful,
+ * otherwise NULL.
+ */
+REVERKI_RULE *reverki_read_rule(REVERKI_INPUT *input) {
+    REVERKI_PROFILE_ENTER(REVERKI_PROFILE_PARSE);
+    if(reverki_input_skip_space(input) != '[') {
+        return NULL;
+    }
+    REVERKI_INPUT_NEXT(input);
+    REVERKI_TERM *lhs, *rhs;
+    if((lhs = reverki_read_term(input)) == NULL || expectChar(input, ',') ||
+       (rhs = reverki_read_term(input)) == NULL || expectChar(input, ']')) {
+        return NULL;
+    }
+    return reverki_define_rule(lhs, rhs);
+}
+
 /*
  * @brief  Parse a rule from a specified input stream and return the resulting object.
  * @details  Read characters from the specified input stream and attempt to interpret
@@ -43,63 +230,22 @@ REVERKI_RULE *reverki_make_rule(REVERKI_TERM *lhs, REVERKI_TERM *rhs) {
  * the required commma ',' or right square bracket ']' is not seen, or parsing one of
  * the two subterms fails, then the unexpected character read is pushed back to the
  * input stream, an error message is issued (to stderr) and NULL is returned.
+ * Once a rule has been read, the distinct variables of its left-hand side are
+ * numbered, and its right-hand side is prepared as a template in which each of
+ * those variables is replaced by its number.  NULL is also returned if the
+ * left-hand side has more than REVERKI_MAX_BINDINGS distinct variables.
  * @param in  The stream from which characters are to be read.
  * @return  A pointer to the newly created rule, if parsing was successful,
  * otherwise NULL.
  */
 REVERKI_RULE *reverki_parse_rule(FILE *in) {
-    // TO BE IMPLEMENTED.
-    REVERKI_TERM *lhs, *rhs;
-    int commaEncountered = 0;
-    int c;
-    while((c = fgetc(in)) != EOF) {
-        // Start rule
-        while(c < 33) {
-            c = fgetc(in);
-        }
-
-        if(c == 91) {
-            continue;
-
-        // End rule
-        } else if(c == 93) {
-            if(ruleCounter <= REVERKI_NUM_RULES) {
-                int index = ruleCounter;
-                ruleCounter++;
-                (reverki_rule_storage + index)->lhs = lhs;
-                (reverki_rule_storage + index)->rhs = rhs;
-                if(index > 0) {
-                    (reverki_rule_storage + index)->next = (reverki_rule_storage + (index-1));
-                } else {
-                    (reverki_rule_storage + index)->next = NULL;
-                }
-                return (reverki_rule_storage + index);
-            } else {
-                fprintf(stderr, "Rule limit exceeded");
-                return NULL;
-            }
-        // Parse term
-        } else if(c == 40 || (c > 32 && c != 44 && c != 91 && c != 93 && c != 127)) {
-            // Left side term
-            if(!commaEncountered) {
-                ungetc(c, in);
-                lhs = reverki_parse_term(in);
-                if(lhs == NULL) { return NULL; }
-
-            // Right side term
-            } else {
-                ungetc(c, in);
-                rhs = reverki_parse_term(in);
-                if(rhs == NULL) { return NULL; }
-            }
-
-        // Encountered comma
-        } else if(c == 44) {
-            commaEncountered = 1;
-        }
-    }
+    if(in == NULL) { return NULL; }
 
-    return NULL;
+    REVERKI_INPUT input;
+    reverki_input_wrap(&input, in);
+    REVERKI_RULE *rule = reverki_read_rule(&input);
+    reverki_input_close(&input);
+    return rule;
 }
 
 /*
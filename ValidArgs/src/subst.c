@@ -6,10 +6,29 @@
 #include "debug.h"
 #include "write.h"
 
-int addSubsToList(REVERKI_TERM *pat, REVERKI_TERM *tgt, int beforeRuleCount) {
+/**
+ * @brief finds the slot of a substitution in which a variable is bound
+ *
+ * @param subst The substitution
+ * @param var The variable
+ * @return int The slot, or -1 if the variable is not bound
+ */
+static int findSlot(REVERKI_SUBST *subst, REVERKI_TERM *var) {
+    for(int i = 0; i < subst->count; i++) {
+        if(*(subst->vars + i) == var) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int addSubsToList(REVERKI_TERM *pat, REVERKI_TERM *tgt, REVERKI_SUBST *subst) {
+    REVERKI_PROFILE_ENTER(REVERKI_PROFILE_MATCH);
+    REVERKI_PROFILE_NODE(REVERKI_PROFILE_MATCH);
     // Pattern and target are both pair types, recurse through it again
     if(pat->type == REVERKI_PAIR_TYPE && tgt->type == REVERKI_PAIR_TYPE) {
-        return addSubsToList(pat->value.pair.fst, tgt->value.pair.fst, beforeRuleCount) + addSubsToList(pat->value.pair.snd, tgt->value.pair.snd, beforeRuleCount);
+        return addSubsToList(pat->value.pair.fst, tgt->value.pair.fst, subst) ||
+               addSubsToList(pat->value.pair.snd, tgt->value.pair.snd, subst);
 
     // Pattern and target are both constants
     } else if(pat->type == REVERKI_CONSTANT_TYPE && tgt->type == REVERKI_CONSTANT_TYPE) {
@@ -17,32 +36,26 @@ int addSubsToList(REVERKI_TERM *pat, REVERKI_TERM *tgt, int beforeRuleCount) {
         if(!reverki_compare_term(pat, tgt)) {
             return 0;
         }
-        return -100;
+        return -1;
 
     //
     } else if(pat->type == REVERKI_VARIABLE_TYPE) {
-        // Check if rule exists by looping through each of the rules
-        for(int i = beforeRuleCount; i < *pRuleCounter; i++) {
-
-            // If left of rule matches variable
-            if(!reverki_compare_term((reverki_rule_storage + i)->lhs, pat)) {
-
-                // If right of rule does not match subterm
-                if(reverki_compare_term((reverki_rule_storage + i)->rhs, tgt)) {
-                    return -100;
-                } else {
-                    return 0;
-                }
-            }
+        // A variable already bound must be bound to the same subterm
+        int slot = findSlot(subst, pat);
+        if(slot >= 0) {
+            return *(subst->values + slot) == tgt ? 0 : -1;
         }
-
-        *(reverki_rule_storage + *pRuleCounter) = *reverki_make_rule(pat, tgt);
-        ++*pRuleCounter;
-        return 1;
+        if(subst->count == REVERKI_MAX_BINDINGS) {
+            return -1;
+        }
+        *(subst->vars + subst->count) = pat;
+        *(subst->values + subst->count) = tgt;
+        subst->count++;
+        return 0;
     }
 
     // Anything else results in an error
-    return -100;
+    return -1;
 }
 
 /**
@@ -55,67 +68,38 @@ int addSubsToList(REVERKI_TERM *pat, REVERKI_TERM *tgt, int beforeRuleCount) {
  * is more than one instance of a particular variable in the pattern, then all
  * instances of that variable must be matched to identical subterms of the target.
  * As the traversal proceeds, additional bindings of variables to subterms are
- * accumulated by prepending them to a substitution, which is accessed and
- * updated via a by-reference parameter.  If the match succeeds, a nonzero value
+ * accumulated by filling the next free slots of a substitution, which is accessed
+ * and updated via a by-reference parameter.  If the match succeeds, a nonzero value
  * is returned and the final substitution can be obtained by the caller from this
- * by-reference parameter.  If the match should fail at some point, any partially
- * accumulated substitution is recycled, the by-reference parameter is reset to
- * NULL, and 0 is returned.
+ * by-reference parameter.  If the match should fail at some point, the slots
+ * filled by this match are freed again, and 0 is returned.  The match also fails
+ * if there are more distinct variables than slots.
  * @param pat  The term to be used as the pattern.
  * @param tgt  The term to be used as the target.
  * @param substp  A by-reference parameter that is a pointer to a variable
  * containing a substitution.  The caller should declare such a variable,
- * initialize it to NULL, and pass its address to this function.
+ * set its count to 0, and pass its address to this function.
  * Upon nonzero return from this function, the variable will contain the
  * accumulated substitution that is the result of the matching procedure.
- * The caller is responsible for recycling this substitution once it is no
- * longer needed.  Upon zero return from this function this variable will
- * have value NULL and the caller should not attempt to use it.
+ * Upon zero return from this function the variable is as it was before the call.
  * @return  Nonzero if the match is successful, 0 otherwise.  If the match is
- * successful, then the by-reference parameter substp will contain a pointer
- * to the accumulated substitution.
+ * successful, then the by-reference parameter substp will contain the
+ * accumulated substitution.
  */
 int reverki_match(REVERKI_TERM *pat, REVERKI_TERM *tgt, REVERKI_SUBST *substp) {
-    int beforeRuleCount = *pRuleCounter;
-    // Add to substp if numNewRules > 0
-    int numNewRules = addSubsToList(pat, tgt, beforeRuleCount);
-
-    if(numNewRules < 1) {
-        int afterRuleCount = *pRuleCounter;
-        int beforeAfterDiff = afterRuleCount - beforeRuleCount;
-        for(int i = afterRuleCount - 1; i >= afterRuleCount-beforeAfterDiff; i--) {
-            (reverki_rule_storage + i)->lhs = NULL;
-            (reverki_rule_storage + i)->rhs = NULL;
-            (reverki_rule_storage + i)->next = NULL;
-            --*pRuleCounter;
-        }
+    int countBefore = substp->count;
+    if(addSubsToList(pat, tgt, substp)) {
+        substp->count = countBefore;
         return 0;
     }
-
-    // Add to substp
-    REVERKI_SUBST temp = *substp;
-    int ruleStart = *pRuleCounter - numNewRules;
-    for(int i = *pRuleCounter-1; i >= ruleStart; i--) {
-        (reverki_rule_storage + i)->next = (reverki_rule_storage + i-1);
-        if(i == ruleStart) {
-            (reverki_rule_storage + i)->next = NULL;
-        }
-    }
-    *substp = (reverki_rule_storage + *pRuleCounter-1);
-
     return 1;
 }
 
-REVERKI_TERM *reverki_apply_helper(REVERKI_SUBST subst, REVERKI_TERM *term) {
-    REVERKI_SUBST temp = subst;
-    while(temp != NULL) {
-        if(temp->lhs && !reverki_compare_term(temp->lhs, term)) {
-            return temp->rhs;
-        }
-
-        temp = temp->next;
-    }
-    return term;
+REVERKI_TERM *reverki_apply_helper(REVERKI_SUBST *subst, REVERKI_TERM *term) {
+    REVERKI_PROFILE_ENTER(REVERKI_PROFILE_APPLY);
+    REVERKI_PROFILE_NODE(REVERKI_PROFILE_APPLY);
+    int slot = findSlot(subst, term);
+    return slot >= 0 ? *(subst->values + slot) : term;
 }
 
 /**
@@ -134,41 +118,74 @@ REVERKI_TERM *reverki_apply_helper(REVERKI_SUBST subst, REVERKI_TERM *term) {
  * @return  The term constructed by applying the substitution to the term passed
  * as argument.
  */
-REVERKI_TERM *reverki_apply(REVERKI_SUBST subst, REVERKI_TERM *term) {
-    REVERKI_TERM termForReturn;
-    REVERKI_TERM *returnTerm;
-    returnTerm = &termForReturn;
-    // Recurse through the array
-    // If the variable in subst is found, try to replace it
+REVERKI_TERM *reverki_apply(REVERKI_SUBST *subst, REVERKI_TERM *term) {
+    // Recurse through the term
+    // If a variable is bound by subst, replace it
     if(term->type == REVERKI_PAIR_TYPE) {
-        REVERKI_TERM *lhs, *rhs;
-
-        if(term->value.pair.fst->type == REVERKI_VARIABLE_TYPE) {
-            REVERKI_TERM *newTerm = reverki_apply_helper(subst, term->value.pair.fst);
-            lhs = newTerm;
-
-        } else if(term->value.pair.fst->type == REVERKI_PAIR_TYPE) {
-            lhs = reverki_apply(subst, reverki_apply(subst, term->value.pair.fst));
-
-        } else {
-            lhs = term->value.pair.fst;
+        REVERKI_TERM *lhs = reverki_apply(subst, term->value.pair.fst);
+        REVERKI_TERM *rhs = reverki_apply(subst, term->value.pair.snd);
+        if(lhs == term->value.pair.fst && rhs == term->value.pair.snd) {
+            return term;
         }
-
-        if(term->value.pair.snd->type == REVERKI_VARIABLE_TYPE) {
-            REVERKI_TERM *newTerm = reverki_apply_helper(subst, term->value.pair.snd);
-            rhs = newTerm;
-
-        } else if(term->value.pair.snd->type == REVERKI_PAIR_TYPE) {
-            rhs = reverki_apply(subst, term->value.pair.snd);
-
-        } else {
-            rhs = term->value.pair.snd;
-        }
-
-        returnTerm = reverki_make_pair(lhs, rhs);
-        return returnTerm;
+        return reverki_make_pair(lhs, rhs);
     } else if(term->type == REVERKI_VARIABLE_TYPE) {
         return reverki_apply_helper(subst, term);
     }
     return term;
 }
+
+REVERKI_TERM *instantiateHelper(REVERKI_TEMPLATE *template, REVERKI_SUBST *subst) {
+    REVERKI_PROFILE_ENTER(REVERKI_PROFILE_INSTANTIATE);
+    REVERKI_PROFILE_NODE(REVERKI_PROFILE_INSTANTIATE);
+    if(template->term != NULL) {
+        return template->term;
+    }
+    if(template->slot >= 0) {
+        return *(subst->values + template->slot);
+    }
+    REVERKI_TERM *lhs = instantiateHelper(template->fst, subst);
+    REVERKI_TERM *rhs = instantiateHelper(template->snd, subst);
+    return reverki_make_pair(lhs, rhs);
+}
+
+/*
+ * @brief  Instantiate the right-hand side of a rule with a substitution obtained
+ * by matching its left-hand side.
+ * @details  The template prepared from the right-hand side when the rule was
+ * parsed is traversed, and each slot in it is replaced by the term bound in the
+ * same slot of the substitution.  A rule that has not been prepared in this way
+ * is instantiated using reverki_apply.
+ * @param rule  The rule.
+ * @param subst  The substitution, whose slots are numbered as the variables of
+ * the rule.
+ * @return  The instance of the right-hand side.
+ */
+REVERKI_TERM *reverki_instantiate(REVERKI_RULE *rule, REVERKI_SUBST *subst) {
+    if((global_options & STATISTICS_OPTION) == STATISTICS_OPTION) {
+        __atomic_add_fetch(&rule->fires, 1, __ATOMIC_RELAXED);
+    }
+    if(rule->template == NULL) {
+        return reverki_apply(subst, rule->rhs);
+    }
+    return instantiateHelper(rule->template, subst);
+}
+
+/*
+ * @brief  Output a textual representation of a substitution to a specified
+ * output stream.
+ * @details  Each binding is printed in the form of a rule, followed by a space,
+ * beginning with the variable bound most recently.
+ * @param subst  The substitution to be printed.
+ * @param out  Stream to which the substitution is to be printed.
+ * @return  0 if output was successful, EOF if not.
+ */
+int reverki_unparse_subst(REVERKI_SUBST *subst, FILE *out) {
+    for(int i = subst->count - 1; i >= 0; i--) {
+        fprintf(out, "[");
+        reverki_unparse_term(*(subst->vars + i), out);
+        fprintf(out, ", ");
+        reverki_unparse_term(*(subst->values + i), out);
+        fprintf(out, "] ");
+    }
+    return 0;
+}
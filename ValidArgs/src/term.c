@@ -9,6 +9,10 @@
 int termCounter = 0;
 int *pTermCounter = &termCounter;
 
+// Number of terms ever created, and the most in use at once
+unsigned long termsAllocated = 0;
+int peakTerms = 0;
+
 /**
  * @brief returns true if the ascii value pertains to an invalid character for a term
  * 
@@ -22,26 +26,390 @@ int invalidCharForTerm(int val) {
     return 0;
 }
 
+/*
+ * Hash-consing table.  Every term that is created is entered into this
+ * open-addressed table (linear probing, size always a power of two), and
+ * before a new term is created the table is consulted for an existing term
+ * with the same type and the same atom or subterms.  Because subterms are
+ * themselves hash-consed, two terms are structurally equal if and only if
+ * they are the same object, so equality can be tested by pointer comparison.
+ *
+ * The table is split into REVERKI_TERM_LOCKS shards (a power of two), chosen by
+ * bits of the hash, each of which is a table of its own that grows on its own
+ * and is protected by its own lock, so that threads creating terms at the same
+ * time seldom wait for each other.  Storage for new terms is taken under a
+ * separate lock, which is only needed when the term does not already exist.
+ */
+#define TERM_SHARD_INITIAL_SIZE 64
+
+typedef struct term_shard {
+    REVERKI_TERM **table;          // The slots, or NULL before the first term.
+    unsigned long size;            // Number of slots.
+    unsigned long used;            // Number of slots holding a term.
+} TERM_SHARD;
+
+static TERM_SHARD termShards[REVERKI_TERM_LOCKS];
+
+/*
+ * Garbage collection.  Terms that are no longer reachable are reclaimed by a
+ * mark-and-sweep collector: the caller marks every term it still needs, using
+ * reverki_mark_term, and then calls reverki_sweep_terms, which puts every
+ * unmarked term on a free list (threaded through value.pair.fst) from which
+ * subsequent terms are allocated.  A term is marked by setting TERM_MARK in
+ * its type field; the mark is cleared again during the sweep.  Free terms
+ * have type REVERKI_NO_TYPE.
+ */
+#define TERM_MARK 0x100
+#ifndef GC_INITIAL_THRESHOLD
+#define GC_INITIAL_THRESHOLD 65536
+#endif
+static REVERKI_TERM *freeTerms = NULL;
+static int allocatedSinceCollection = 0;
+static int collectionThreshold = GC_INITIAL_THRESHOLD;
+static REVERKI_TERM **markStack = NULL;
+static int markStackSize = 0;
+
+/*
+ * Stack used by the term parser, with an entry for each parenthesis that has
+ * been opened but not yet closed, so that the depth to which terms may be
+ * nested is not limited by the depth of the C stack.
+ */
+typedef struct parse_frame {
+    REVERKI_TERM *first;           // The first subterm read, or NULL if none yet.
+    REVERKI_TERM *term;            // The pair built so far, or NULL if none yet.
+    int label;                     // Label defined by the parenthesis, or 0 if none.
+} PARSE_FRAME;
+
+static PARSE_FRAME *parseStack = NULL;
+static int parseStackSize = 0;
+
+/*
+ * Labels of shared subterms, as printed by reverki_write_shared_term.  In a
+ * term, ",N=(...)" defines label N as the term in parentheses, and a later ",N"
+ * in the same term refers to it.  Labels are numbered from 1 in each term, in
+ * the order in which they are defined.  The parser keeps the subterm for each
+ * label defined so far in the term being read, or NULL while its definition is
+ * still being read.
+ */
+static REVERKI_TERM **labelTable = NULL;
+static int labelTableSize = 0;
+static int numLabels = 0;
+
+/*
+ * Stack used by the term printer, with an entry for each pair whose opening
+ * parenthesis has been printed but not yet its closing one.
+ */
+typedef struct unparse_frame {
+    REVERKI_TERM *pair;            // The pair.
+    int second;                    // Whether its second subterm is being printed.
+} UNPARSE_FRAME;
+
+static __thread UNPARSE_FRAME *unparseStack = NULL;
+static __thread int unparseStackSize = 0;
+
+// Size of the buffer through which reverki_unparse_term prints
+#define UNPARSE_BUFFER_SIZE 4096
+
+/**
+ * @brief computes the hash of a term from its type and its atom or subterms
+ *
+ * @param type The type of the term
+ * @param a The atom (variable or constant) or first subterm (pair)
+ * @param b NULL (variable or constant) or second subterm (pair)
+ * @return unsigned long The hash value
+ */
+static unsigned long hashTerm(REVERKI_TYPE type, void *a, void *b) {
+    unsigned long h = (unsigned long)a * 0x9e3779b97f4a7c15UL;
+    h ^= ((unsigned long)b + type) * 0xc2b2ae3d27d4eb4fUL;
+    return h ^ (h >> 29);
+}
+
+/**
+ * @brief returns true if the term has the specified type and contents
+ *
+ * @param term The term being checked
+ * @param type The type the term should have
+ * @param a The atom or first subterm the term should have
+ * @param b NULL or the second subterm the term should have
+ * @return int 1 if the term has those contents, 0 if not
+ */
+static int termHasContents(REVERKI_TERM *term, REVERKI_TYPE type, void *a, void *b) {
+    if(term->type != type) {
+        return 0;
+    }
+    if(type == REVERKI_PAIR_TYPE) {
+        return term->value.pair.fst == a && term->value.pair.snd == b;
+    }
+    return term->value.atom == a;
+}
+
+/**
+ * @brief returns the number of the shard of the hash-consing table that holds
+ * the terms with a specified hash
+ *
+ * @param hash The hash of the term, as computed by hashTerm
+ * @return int The number of the shard
+ */
+static int termShard(unsigned long hash) {
+    return (hash >> 32) & (REVERKI_TERM_LOCKS - 1);
+}
+
+/**
+ * @brief finds the slot of a shard of the hash-consing table that holds the term
+ * with the specified contents, or the empty slot where such a term should be
+ * entered
+ *
+ * @param shard The shard, which must have at least one empty slot
+ * @param hash The hash of the term, as computed by hashTerm
+ * @param type The type of the term
+ * @param a The atom or first subterm of the term
+ * @param b NULL or the second subterm of the term
+ * @return REVERKI_TERM** The slot found
+ */
+static REVERKI_TERM **findTermSlot(TERM_SHARD *shard, unsigned long hash, REVERKI_TYPE type, void *a, void *b) {
+    unsigned long mask = shard->size - 1;
+    unsigned long index = hash & mask;
+    while(*(shard->table + index) != NULL) {
+        if(termHasContents(*(shard->table + index), type, a, b)) {
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    return shard->table + index;
+}
+
+/**
+ * @brief enters a term into the hash-consing table, which must not already
+ * contain it, and whose shard must have room for it
+ *
+ * @param term The term
+ */
+static void enterTerm(REVERKI_TERM *term) {
+    void *a = term->type == REVERKI_PAIR_TYPE ? (void *)term->value.pair.fst : (void *)term->value.atom;
+    void *b = term->type == REVERKI_PAIR_TYPE ? term->value.pair.snd : NULL;
+    unsigned long hash = hashTerm(term->type, a, b);
+    TERM_SHARD *shard = termShards + termShard(hash);
+    *findTermSlot(shard, hash, term->type, a, b) = term;
+    shard->used++;
+}
+
+/**
+ * @brief resizes a shard of the hash-consing table, entering into the new table
+ * every term that the shard holds
+ *
+ * @param shard The shard
+ * @param newSize The size of the new table, which must be a power of two
+ * @return int 0 if successful, -1 if memory could not be allocated
+ */
+static int resizeShard(TERM_SHARD *shard, unsigned long newSize) {
+    REVERKI_TERM **newTable = calloc(newSize, sizeof(REVERKI_TERM *));
+    if(newTable == NULL) {
+        return -1;
+    }
+    REVERKI_TERM **oldTable = shard->table;
+    unsigned long oldSize = shard->size;
+    shard->table = newTable;
+    shard->size = newSize;
+    shard->used = 0;
+    for(unsigned long i = 0; i < oldSize; i++) {
+        if(*(oldTable + i) != NULL) {
+            enterTerm(*(oldTable + i));
+        }
+    }
+    free(oldTable);
+    return 0;
+}
+
+/**
+ * @brief empties the hash-consing table, and enters into it every term in use
+ * in reverki_term_arena
+ */
+static void rebuildTermTable() {
+    for(int i = 0; i < REVERKI_TERM_LOCKS; i++) {
+        TERM_SHARD *shard = termShards + i;
+        for(unsigned long j = 0; j < shard->size; j++) {
+            *(shard->table + j) = NULL;
+        }
+        shard->used = 0;
+    }
+    for(int i = 0; i < reverki_term_arena.used; i++) {
+        REVERKI_TERM *term = reverki_arena_get(&reverki_term_arena, i);
+        if(term->type != REVERKI_NO_TYPE) {
+            enterTerm(term);
+        }
+    }
+}
+
+/**
+ * @brief takes storage for a new term from the free list, or from
+ * reverki_term_arena if the free list is empty, and counts the term as being
+ * in use, while holding the allocation lock
+ *
+ * @return REVERKI_TERM* The storage, or NULL if memory could not be allocated
+ */
+static REVERKI_TERM *allocateTerm() {
+    reverki_lock(REVERKI_ALLOC_LOCK);
+    REVERKI_TERM *term = freeTerms;
+    if(term != NULL) {
+        freeTerms = term->value.pair.fst;
+    } else {
+        term = reverki_arena_alloc(&reverki_term_arena);
+    }
+    if(term != NULL) {
+        termCounter++;
+        termsAllocated++;
+        if(termCounter > peakTerms) {
+            peakTerms = termCounter;
+        }
+        // Read without the lock by reverki_collection_needed
+        __atomic_add_fetch(&allocatedSinceCollection, 1, __ATOMIC_RELAXED);
+    }
+    reverki_unlock(REVERKI_ALLOC_LOCK);
+    return term;
+}
+
+/**
+ * @brief returns the unique term with the specified type and contents, creating it
+ * if it does not already exist, while holding the lock on the shard of the term
+ * table to which it belongs
+ *
+ * @param type The type of the term
+ * @param a The atom or first subterm of the term
+ * @param b NULL or the second subterm of the term
+ * @return REVERKI_TERM* The term, or NULL if the term limit was exceeded
+ */
+static REVERKI_TERM *internTerm(REVERKI_TYPE type, void *a, void *b) {
+    unsigned long hash = hashTerm(type, a, b);
+    int lock = REVERKI_TERM_LOCK + termShard(hash);
+    TERM_SHARD *shard = termShards + termShard(hash);
+    reverki_lock(lock);
+    if((shard->used + 1) * 2 > shard->size &&
+       resizeShard(shard, shard->size ? shard->size * 2 : TERM_SHARD_INITIAL_SIZE)) {
+        reverki_unlock(lock);
+        fprintf(stderr, "Term limit exceeded");
+        return NULL;
+    }
+    REVERKI_TERM **slot = findTermSlot(shard, hash, type, a, b);
+    REVERKI_TERM *term = *slot;
+    if(term == NULL) {
+        if((term = allocateTerm()) == NULL) {
+            reverki_unlock(lock);
+            fprintf(stderr, "Term limit exceeded");
+            return NULL;
+        }
+        term->type = type;
+        if(type == REVERKI_PAIR_TYPE) {
+            term->value.pair.fst = a;
+            term->value.pair.snd = b;
+            unsigned long size = 1UL + ((REVERKI_TERM *)a)->size + ((REVERKI_TERM *)b)->size;
+            term->size = size < REVERKI_MAX_SIZE ? size : REVERKI_MAX_SIZE;
+        } else {
+            term->value.atom = a;
+            term->size = 1;
+        }
+        *slot = term;
+        shard->used++;
+    }
+    reverki_unlock(lock);
+    return term;
+}
+
+/*
+ * @brief  Determine whether enough terms have been created since the last
+ * collection that a collection should be performed.
+ * @details  A collection is called for once the number of terms created since
+ * the last collection exceeds the larger of GC_INITIAL_THRESHOLD and the number
+ * of terms that survived the last collection, so that the cost of collecting
+ * is proportional to the number of terms allocated.
+ * @return  Nonzero if a collection should be performed, otherwise 0.
+ */
+int reverki_collection_needed() {
+    return __atomic_load_n(&allocatedSinceCollection, __ATOMIC_RELAXED) >= collectionThreshold;
+}
+
+/*
+ * @brief  Mark a specified term, and all its subterms, as being in use.
+ * @details  Marks persist until the next call to reverki_sweep_terms.  An
+ * explicit stack is used, so that the depth of the term is not limited by
+ * the depth of the C stack.
+ * @param term  The term to be marked.
+ * @return  0.
+ */
+int reverki_mark_term(REVERKI_TERM *term) {
+    int depth = 0;
+    while(1) {
+        while(term != NULL && !(term->type & TERM_MARK)) {
+            term->type |= TERM_MARK;
+            if((term->type & ~TERM_MARK) != REVERKI_PAIR_TYPE) {
+                break;
+            }
+            if(depth == markStackSize) {
+                int newSize = markStackSize ? markStackSize * 2 : 1024;
+                REVERKI_TERM **newStack = realloc(markStack, newSize * sizeof(REVERKI_TERM *));
+                if(newStack != NULL) {
+                    markStack = newStack;
+                    markStackSize = newSize;
+                }
+            }
+            if(depth < markStackSize) {
+                *(markStack + depth++) = term->value.pair.snd;
+            } else {
+                // Out of memory for the stack, so fall back on recursion
+                reverki_mark_term(term->value.pair.snd);
+            }
+            term = term->value.pair.fst;
+        }
+        if(depth == 0) {
+            return 0;
+        }
+        term = *(markStack + --depth);
+    }
+}
+
+/*
+ * @brief  Reclaim all terms that have not been marked since the last collection.
+ * @details  Every term in reverki_term_arena that is not marked is put on the
+ * free list, and the marks on the remaining terms are cleared.  The
+ * hash-consing table is then rebuilt so that it contains only the terms that
+ * remain in use.  Any pointers to unmarked terms held by the caller become
+ * invalid.
+ * @return  The number of terms reclaimed.
+ */
+int reverki_sweep_terms() {
+    int reclaimed = 0;
+    freeTerms = NULL;
+    for(int i = reverki_term_arena.used - 1; i >= 0; i--) {
+        REVERKI_TERM *term = reverki_arena_get(&reverki_term_arena, i);
+        if(term->type & TERM_MARK) {
+            term->type &= ~TERM_MARK;
+        } else {
+            if(term->type != REVERKI_NO_TYPE) {
+                term->type = REVERKI_NO_TYPE;
+                reclaimed++;
+            }
+            term->value.pair.fst = freeTerms;
+            freeTerms = term;
+        }
+    }
+    termCounter -= reclaimed;
+    rebuildTermTable();
+    allocatedSinceCollection = 0;
+    collectionThreshold = termCounter > GC_INITIAL_THRESHOLD ? termCounter : GC_INITIAL_THRESHOLD;
+    return reclaimed;
+}
+
 /*
  * @brief  Create a variable term from a specified atom.
  * @details  A term of type REVERKI_VARIABLE is created that contains the
  * specified atom.  The atom must also have type REVERKI_VARIABLE, otherwise
- * an error message is printed and the program aborts.
+ * an error message is printed and the program aborts.  If a variable term
+ * containing the same atom already exists, then that term is returned.
  * @param atom  The atom from which the term is to be constructed.
  * @return  A pointer to the newly created term.
  */
 REVERKI_TERM *reverki_make_variable(REVERKI_ATOM *atom) {
     if(atom->type == REVERKI_VARIABLE_TYPE) {
-        // Set variable type and union type
-        int index = termCounter;
-        (reverki_term_storage + termCounter)->type = REVERKI_VARIABLE_TYPE;
-        (reverki_term_storage + termCounter)->value.atom = atom;
-        termCounter++;
-        if(termCounter > REVERKI_NUM_TERMS) {
-            fprintf(stderr, "Term limit exceeded");
-            return NULL;
-        }
-        return (reverki_term_storage + index);
+        return internTerm(REVERKI_VARIABLE_TYPE, atom, NULL);
     }
 
     fprintf(stderr, "Atom given is not of type variable\n");
@@ -52,22 +420,14 @@ REVERKI_TERM *reverki_make_variable(REVERKI_ATOM *atom) {
  * @brief  Create a constant term from a specified atom.
  * @details  A term of type REVERKI_CONSTANT is created that contains the
  * specified atom.  The atom must also have type REVERKI_CONSTANT, otherwise
- * an error message is printed and the program aborts.
+ * an error message is printed and the program aborts.  If a constant term
+ * containing the same atom already exists, then that term is returned.
  * @param atom  The atom from which the constant is to be constructed.
  * @return  A pointer to the newly created term.
  */
 REVERKI_TERM *reverki_make_constant(REVERKI_ATOM *atom) {
     if(atom->type == REVERKI_CONSTANT_TYPE) {
-        // Set constant type and union type
-        int index = termCounter;
-        (reverki_term_storage + termCounter)->type = REVERKI_CONSTANT_TYPE;
-        (reverki_term_storage + termCounter)->value.atom = atom;
-        termCounter++;
-        if(termCounter > REVERKI_NUM_TERMS) {
-            fprintf(stderr, "Term limit exceeded");
-            return NULL;
-        }
-        return (reverki_term_storage + index);
+        return internTerm(REVERKI_CONSTANT_TYPE, atom, NULL);
     }
 
     fprintf(stderr, "Atom given is not of type constant\n");
@@ -77,50 +437,219 @@ REVERKI_TERM *reverki_make_constant(REVERKI_ATOM *atom) {
 /*
  * @brief  Create a pair term from specified subterms.
  * @details  A term of type REVERKI_PAIR is created that contains specified
- * terms as its first and second subterms.
+ * terms as its first and second subterms.  If a pair with the same first and
+ * second subterms already exists, then that term is returned.
  * @param fst  The first (or "left-hand") subterm of the pair to be constructed.
  * @param snd  The second (or "right-hand") subterm of the pair to be constructed.
  * @return  A pointer to the newly created term.
  */
 REVERKI_TERM *reverki_make_pair(REVERKI_TERM *fst, REVERKI_TERM *snd) {
-    // Set pair type and union type
-    int index = termCounter;
-    (reverki_term_storage + termCounter)->type = REVERKI_PAIR_TYPE;
-    (reverki_term_storage + termCounter)->value.pair.fst = fst;
-    (reverki_term_storage + termCounter)->value.pair.snd = snd;
-    termCounter++;
-    if(termCounter > REVERKI_NUM_TERMS) {
-        fprintf(stderr, "Term limit exceeded");
+    if(fst == NULL || snd == NULL) {
         return NULL;
     }
-    return (reverki_term_storage + index);
+    return internTerm(REVERKI_PAIR_TYPE, fst, snd);
 }
 
 /*
  * @brief  Compare two specified terms for equality.
  * @details  The two specified terms are compared for equality.  Equality of terms
  * means that they have the same type and that corresponding atoms or subterms they
- * contain are recursively equal.
+ * contain are recursively equal.  Since terms are hash-consed, equal terms are
+ * always the same object, so this is just a pointer comparison.
  * @param term1  The first of the two terms to be compared.
  * @param term2  The second of the two terms to be compared.
  * @return  Zero if the specified terms are equal, otherwise nonzero.
  */
 int reverki_compare_term(REVERKI_TERM *term1, REVERKI_TERM *term2) {
-    if(term1->type != term2->type) {
+    if(term1 != term2) {
         return -1;
-    } else if(term1->type == REVERKI_VARIABLE_TYPE || term1->type == REVERKI_CONSTANT_TYPE) {
-        if(term1->value.atom->pname != term2->value.atom->pname) {
+    }
+    return 0;
+}
+
+/**
+ * @brief returns the term made from an atom
+ *
+ * @param atom The atom, or NULL
+ * @return REVERKI_TERM* The variable or constant term, or NULL if atom is NULL
+ */
+static REVERKI_TERM *atomTerm(REVERKI_ATOM *atom) {
+    if(atom == NULL) {
+        return NULL;
+    }
+    if(atom->type == REVERKI_VARIABLE_TYPE) {
+        return reverki_make_variable(atom);
+    }
+    return reverki_make_constant(atom);
+}
+
+/**
+ * @brief pushes an entry for a newly opened parenthesis onto the parse stack,
+ * growing it if necessary
+ *
+ * @param depth By-reference number of entries on the stack
+ * @return int 0 if successful, -1 if memory could not be allocated
+ */
+static int pushParseFrame(int *depth) {
+    if(*depth == parseStackSize) {
+        int newSize = parseStackSize ? parseStackSize * 2 : 256;
+        PARSE_FRAME *newStack = realloc(parseStack, newSize * sizeof(PARSE_FRAME));
+        if(newStack == NULL) {
+            fprintf(stderr, "Term too deeply nested\n");
             return -1;
         }
+        parseStack = newStack;
+        parseStackSize = newSize;
+    }
+    PARSE_FRAME *frame = parseStack + (*depth)++;
+    frame->first = frame->term = NULL;
+    frame->label = 0;
+    return 0;
+}
+
+/**
+ * @brief adds a subterm to the term being read inside a parenthesis, the
+ * subterms associating to the left
+ *
+ * @param frame The entry for the parenthesis
+ * @param subterm The subterm
+ * @return int 0 if successful, -1 if the pair could not be made
+ */
+static int addSubterm(PARSE_FRAME *frame, REVERKI_TERM *subterm) {
+    if(frame->first == NULL) {
+        frame->first = subterm;
         return 0;
-    } else if(term1->type == REVERKI_PAIR_TYPE) {
-        if(term1->value.pair.fst->type == term2->value.pair.fst->type &&
-        term1->value.pair.snd->type == term2->value.pair.snd->type) {
-            return reverki_compare_term(term1->value.pair.fst, term2->value.pair.fst) || reverki_compare_term(term1->value.pair.snd, term2->value.pair.snd);
+    }
+    frame->term = reverki_make_pair(frame->term != NULL ? frame->term : frame->first, subterm);
+    return frame->term == NULL ? -1 : 0;
+}
+
+/**
+ * @brief reads a label following ',', either defining it or referring to it
+ *
+ * @param input The input, positioned just after the ','
+ * @param subtermp By-reference subterm to which the label refers, set to NULL
+ * if the label is being defined
+ * @return int The number of the label, or -1 if the label is not valid
+ */
+static int readLabel(REVERKI_INPUT *input, REVERKI_TERM **subtermp) {
+    char token[REVERKI_PNAME_BUFFER_SIZE];
+    int length = reverki_input_atom(input, token);
+    int label = 0;
+    int index = 0;
+    while(index < length && *(token + index) >= '0' && *(token + index) <= '9' && label < 100000000) {
+        label = label * 10 + *(token + index++) - '0';
+    }
+    int definition = index + 1 == length && *(token + index) == '=';
+    if(length <= 0 || index == 0 || (index < length && !definition) || label == 0) {
+        fprintf(stderr, "Invalid label ,%s in term\n", token);
+        return -1;
+    }
+    *subtermp = NULL;
+    if(definition) {
+        if(label != numLabels + 1) {
+            fprintf(stderr, "Label ,%d defined out of order\n", label);
+            return -1;
         }
+        if(reverki_input_skip_space(input) != '(') {
+            fprintf(stderr, "Label ,%d must be defined as a term in parentheses\n", label);
+            return -1;
+        }
+        if(numLabels == labelTableSize) {
+            int newSize = labelTableSize ? labelTableSize * 2 : 256;
+            REVERKI_TERM **newTable = realloc(labelTable, newSize * sizeof(REVERKI_TERM *));
+            if(newTable == NULL) {
+                fprintf(stderr, "Too many labels in term\n");
+                return -1;
+            }
+            labelTable = newTable;
+            labelTableSize = newSize;
+        }
+        *(labelTable + numLabels++) = NULL;
+        return label;
+    }
+    if(label > numLabels || *(labelTable + label - 1) == NULL) {
+        fprintf(stderr, "Label ,%d used before it is defined\n", label);
         return -1;
     }
-    return 0;
+    *subtermp = *(labelTable + label - 1);
+    return label;
+}
+
+/*
+ * @brief  Read a term from a specified input and return the resulting object.
+ * @details  As reverki_parse_term, except that characters are taken from an
+ * input rather than a stream.  Whitespace before the term is skipped, and the
+ * character that follows the term is left unconsumed.  If the term does not
+ * start with '(' or a character that may start an atom, then that character is
+ * left unconsumed and NULL is returned without an error message.  Terms may be
+ * nested to any depth, since an explicit stack is used rather than recursion.
+ * Within a term in parentheses, ",N=(...)" labels a subterm and ",N" refers to
+ * it again, as printed by reverki_write_shared_term.
+ * @param input  The input from which characters are to be read.
+ * @return  A pointer to the term, if parsing was successful, otherwise NULL.
+ */
+REVERKI_TERM *reverki_read_term(REVERKI_INPUT *input) {
+    REVERKI_PROFILE_ENTER(REVERKI_PROFILE_PARSE);
+    int c = reverki_input_skip_space(input);
+    if(c == EOF) {
+        return NULL;
+    }
+    if(c != '(') {
+        return (*(reverki_char_class + c) & REVERKI_ATOM_CHAR) ? atomTerm(reverki_read_atom(input)) : NULL;
+    }
+
+    int depth = 0;
+    int label = 0;
+    numLabels = 0;
+    while(1) {
+        REVERKI_TERM *subterm;
+        if(c == '(') {
+            REVERKI_INPUT_NEXT(input);
+            if(pushParseFrame(&depth)) {
+                return NULL;
+            }
+            (parseStack + depth - 1)->label = label;
+            label = 0;
+            c = reverki_input_skip_space(input);
+            continue;
+        } else if(c == ')') {
+            REVERKI_INPUT_NEXT(input);
+            if((subterm = (parseStack + --depth)->term) == NULL) {
+                fprintf(stderr, "A term in parentheses must have at least two subterms\n");
+                return NULL;
+            }
+            if((parseStack + depth)->label) {
+                *(labelTable + (parseStack + depth)->label - 1) = subterm;
+            }
+            if(depth == 0) {
+                return subterm;
+            }
+        } else if(c == ',' && depth > 0) {
+            REVERKI_INPUT_NEXT(input);
+            if((label = readLabel(input, &subterm)) < 0) {
+                return NULL;
+            }
+            if(subterm == NULL) {
+                // A definition, followed by the '(' of the labelled subterm
+                c = '(';
+                continue;
+            }
+            label = 0;
+        } else if(c != EOF && (*(reverki_char_class + c) & REVERKI_ATOM_CHAR)) {
+            if((subterm = atomTerm(reverki_read_atom(input))) == NULL) {
+                return NULL;
+            }
+        } else {
+            fprintf(stderr, c == EOF ? "Unterminated term\n" : "Unexpected '%c' in term\n", c);
+            return NULL;
+        }
+        REVERKI_PROFILE_NODE(REVERKI_PROFILE_PARSE);
+        if(addSubterm(parseStack + depth - 1, subterm)) {
+            return NULL;
+        }
+        c = reverki_input_skip_space(input);
+    }
 }
 
 /*
@@ -144,121 +673,262 @@ int reverki_compare_term(REVERKI_TERM *term1, REVERKI_TERM *term2) {
  */
 REVERKI_TERM *reverki_parse_term(FILE *in) {
     if(in == NULL) { return NULL; }
-    int c;
-    // TODO
-    if((c = fgetc(in)) == EOF) { return NULL; }
 
-    // Whitespace
-    while((c > 8 && c < 14) || c == 32) {
-        c = fgetc(in);
+    REVERKI_INPUT input;
+    reverki_input_wrap(&input, in);
+    REVERKI_TERM *term = reverki_read_term(&input);
+    reverki_input_close(&input);
+    return term;
+}
+
+/**
+ * @brief pushes an entry for a pair onto the stack used by the term printer,
+ * growing the stack if necessary
+ *
+ * @param depth By-reference number of entries on the stack
+ * @param pair The pair
+ * @return int 0 if successful, -1 if the stack could not be grown
+ */
+static int pushUnparseFrame(int *depth, REVERKI_TERM *pair) {
+    if(*depth == unparseStackSize) {
+        int newSize = unparseStackSize ? unparseStackSize * 2 : 256;
+        UNPARSE_FRAME *newStack = realloc(unparseStack, newSize * sizeof(UNPARSE_FRAME));
+        if(newStack == NULL) {
+            return -1;
+        }
+        unparseStack = newStack;
+        unparseStackSize = newSize;
     }
-    // Comma, [ or ]
-    if(c == 44 || c == 91 || c == 93) {
-        ungetc(c, in);
-        return NULL;
+    UNPARSE_FRAME *frame = unparseStack + (*depth)++;
+    frame->pair = pair;
+    frame->second = 0;
+    return 0;
+}
+
+/*
+ * @brief  Write a textual representation of a specified term to an output.
+ * @details  The representation is the same as that printed by
+ * reverki_unparse_term.  The term is traversed with an explicit stack, so that
+ * the depth of the term is not limited by the depth of the C stack.
+ * @param output  The output to which the term is to be written.
+ * @param term  The term that is to be written.
+ * @return  0 if successful, EOF if the term is not valid or memory could not be
+ * allocated.
+ */
+int reverki_write_term(REVERKI_OUTPUT *output, REVERKI_TERM *term) {
+    if(term->type != REVERKI_PAIR_TYPE && term->type != REVERKI_CONSTANT_TYPE &&
+       term->type != REVERKI_VARIABLE_TYPE) {
+        return EOF;
+    }
+    int depth = 0;
+    while(1) {
+        // Open every pair down the left spine of the term
+        while(term->type == REVERKI_PAIR_TYPE) {
+            if(pushUnparseFrame(&depth, term)) {
+                return EOF;
+            }
+            REVERKI_OUTPUT_PUT(output, '(');
+            term = term->value.pair.fst;
+        }
+        reverki_output_string(output, term->value.atom->pname);
+
+        // Close every pair whose second subterm is now complete
+        while(depth > 0 && (unparseStack + depth - 1)->second) {
+            REVERKI_OUTPUT_PUT(output, ')');
+            depth--;
+        }
+        if(depth == 0) {
+            return 0;
+        }
+        (unparseStack + depth - 1)->second = 1;
+        REVERKI_OUTPUT_PUT(output, ' ');
+        term = (unparseStack + depth - 1)->pair->value.pair.snd;
+    }
+}
 
-    // Character is (, so start pair
-    } else if(c == 40){
-        REVERKI_TERM *lhs, *rhs;
-        int lhsBool = 0, rhsBool = 0;
-
-        //Looping until ) is reached
-        while((c = fgetc(in)) != 41 && c != EOF) {
-            // If open parentheses and lhs is null, parse the left hand side
-            if((c == 40 || (c > 32 && c != 44 && c != 91 && c != 93 && c != 127)) && !lhsBool) {
-                ungetc(c, in);
-                lhs = reverki_parse_term(in);
-                if(lhs != NULL) { lhsBool = 1; }
-
-            // If open parentheses and lhs is not null, parse the right hand side
-            } else if((c == 40 || (c > 32 && c != 44 && c != 91 && c != 93 && c != 127)) && lhsBool) {
-                ungetc(c, in);
-                rhs = reverki_parse_term(in);
-                if(rhs != NULL) { rhsBool = 1; }
-
-
-            // If anything valid, parse the atom
-            } else if (c > 32 && c != 44 && c != 91 && c != 93 && c != 127) {
-                ungetc(c, in);
-                REVERKI_ATOM *atom = reverki_parse_atom(in);
-                if(atom != NULL && atom->type == REVERKI_VARIABLE_TYPE) { 
-                    if(!lhsBool) { lhs = reverki_make_variable(atom); lhsBool = 1; } 
-                    else { rhs = reverki_make_variable(atom); rhsBool = 1; }
+/*
+ * Table used by reverki_write_shared_term, open-addressed with linear probing,
+ * that maps each distinct pair in a term to the number of pairs in the term of
+ * which it is a subterm, and to the label it has been given once printed.
+ */
+typedef struct share_entry {
+    REVERKI_TERM *term;            // The pair, or NULL if the entry is empty.
+    int count;                     // Number of occurrences of the pair in the term.
+    int label;                     // Label of the pair, or 0 if not yet printed.
+} SHARE_ENTRY;
 
-                }
-                else if(atom != NULL && atom->type == REVERKI_CONSTANT_TYPE) { 
-                    if(!lhsBool) { lhs = reverki_make_constant(atom); lhsBool = 1; }
-                    else { rhs = reverki_make_constant(atom); rhsBool = 1; }
-                } else if(atom == NULL) {
-                    return NULL;
-                }
+typedef struct share_table {
+    SHARE_ENTRY *entries;
+    unsigned long size;            // Number of entries, a power of 2.
+    unsigned long used;            // Number of entries that are not empty.
+} SHARE_TABLE;
 
-            // If lhs and rhs are filled, but more atoms are seen
-            } else if(lhsBool && rhsBool && c != 41) { 
-                int counter = 0;
-                REVERKI_TERM *newPair;
-                newPair = reverki_make_pair(lhs, rhs);
-                while(c != 41 && c != EOF) {
-                    if(c > 32 && c != 40 && c != 44 && c != 91 && c != 93 && c != 127) {
-                        ungetc(c, in);
-                        REVERKI_ATOM *atom = reverki_parse_atom(in);
-                        REVERKI_TERM *term;
-
-                        if(atom != NULL && atom->type == REVERKI_VARIABLE_TYPE) {
-                            term = reverki_make_variable(atom);
-                        } else if(atom != NULL && atom->type == REVERKI_CONSTANT_TYPE) { 
-                            term = reverki_make_constant(atom); 
-                        } else if(atom == NULL) { 
-                            return NULL; 
-                        }
-
-                        if(term != 0) {
-                            REVERKI_TERM *tempPair;
-                            tempPair = reverki_make_pair(newPair, term);
-                            if(tempPair == NULL) {
-                                return NULL;
-                            }
-                            newPair = tempPair;
-                        }
-                    } else if(c == 40) {
-                        ungetc(c, in);
-                        REVERKI_TERM *temp;
-                        temp = reverki_parse_term(in);
-                        if(temp == NULL) { return NULL; }
-                        REVERKI_TERM *tempPair;
-                        tempPair = reverki_make_pair(newPair, temp);
-                        if(tempPair == NULL) { return NULL; }
-                        newPair = tempPair;
-                    }
-                    c = fgetc(in);
-                }
-                return newPair;
+/**
+ * @brief finds the entry of a sharing table for a pair, or the empty entry
+ * where it should be entered
+ *
+ * @param table The table
+ * @param term The pair
+ * @return SHARE_ENTRY* The entry
+ */
+static SHARE_ENTRY *findShare(SHARE_TABLE *table, REVERKI_TERM *term) {
+    unsigned long mask = table->size - 1;
+    unsigned long h = (unsigned long)term * 0x9e3779b97f4a7c15UL;
+    unsigned long index = (h >> 32) & mask;
+    while((table->entries + index)->term != NULL && (table->entries + index)->term != term) {
+        index = (index + 1) & mask;
+    }
+    return table->entries + index;
+}
+
+/**
+ * @brief counts an occurrence of a pair, entering it in a sharing table if it
+ * is not already there
+ *
+ * @param table The table
+ * @param term The pair
+ * @return int 1 if the pair was entered, 0 if it was already there, or -1 if
+ * the table could not be grown
+ */
+static int countShare(SHARE_TABLE *table, REVERKI_TERM *term) {
+    if((table->used + 1) * 2 > table->size) {
+        SHARE_ENTRY *oldEntries = table->entries;
+        unsigned long oldSize = table->size;
+        unsigned long newSize = oldSize ? oldSize * 2 : 1024;
+        if((table->entries = calloc(newSize, sizeof(SHARE_ENTRY))) == NULL) {
+            table->entries = oldEntries;
+            return -1;
+        }
+        table->size = newSize;
+        for(unsigned long i = 0; i < oldSize; i++) {
+            if((oldEntries + i)->term != NULL) {
+                *findShare(table, (oldEntries + i)->term) = *(oldEntries + i);
             }
         }
+        free(oldEntries);
+    }
+    SHARE_ENTRY *entry = findShare(table, term);
+    if(entry->term != NULL) {
+        entry->count++;
+        return 0;
+    }
+    entry->term = term;
+    entry->count = 1;
+    entry->label = 0;
+    table->used++;
+    return 1;
+}
 
-        if(lhsBool && rhsBool) {
-            REVERKI_TERM *term;
-            term = reverki_make_pair(lhs, rhs);
-            if(term == NULL) { return NULL; }
-            return term;
-            //return reverki_make_pair(lhs, rhs);
-        }
-        return NULL;
+/**
+ * @brief writes a label as ',' followed by its number in decimal
+ *
+ * @param output The output
+ * @param label The label
+ */
+static void writeLabel(REVERKI_OUTPUT *output, int label) {
+    char digits[12];
+    int length = 0;
+    do {
+        *(digits + length++) = '0' + label % 10;
+        label /= 10;
+    } while(label > 0);
+    REVERKI_OUTPUT_PUT(output, ',');
+    while(length > 0) {
+        REVERKI_OUTPUT_PUT(output, *(digits + --length));
+    }
+}
+
+/*
+ * @brief  Write a term to an output, printing each shared subterm only once.
+ * @details  The term is written as by reverki_write_term, except that a pair
+ * that occurs more than once in the term (counting occurrences in the graph
+ * of the term, not in its tree) is labelled where it is first printed, as
+ * ",N=(...)", and is printed as ",N" wherever it occurs after that.  Labels are
+ * numbered from 1, in the order in which they are printed.  The output is
+ * therefore proportional to the number of distinct subterms of the term, rather
+ * than to its size, and can be read back by reverki_parse_term.
+ * @param output  The output to which the term is to be written.
+ * @param term  The term that is to be written.
+ * @return  0 if successful, EOF if the term is not valid or memory could not be
+ * allocated.
+ */
+int reverki_write_shared_term(REVERKI_OUTPUT *output, REVERKI_TERM *term) {
+    if(term->type != REVERKI_PAIR_TYPE) {
+        return reverki_write_term(output, term);
+    }
 
-    } else if(c > 32 && c != 44 && c != 91 && c != 93 && c != 127) {
-        ungetc(c, in);
-        REVERKI_ATOM *atom;
-        atom = reverki_parse_atom(in);
-        if(atom != NULL && atom->type == REVERKI_VARIABLE_TYPE) {
-            return reverki_make_variable(atom);
+    // Count the occurrences of each pair, visiting each distinct pair once
+    SHARE_TABLE table = {NULL, 0, 0};
+    REVERKI_TERM **stack = NULL;
+    int stackSize = 0;
+    int depth = 0;
+    int result = countShare(&table, term);
+    REVERKI_TERM *pair = term;
+    while(result >= 0) {
+        for(int i = 0; i < 2 && result >= 0; i++) {
+            REVERKI_TERM *subterm = i ? pair->value.pair.snd : pair->value.pair.fst;
+            if(subterm->type != REVERKI_PAIR_TYPE || (result = countShare(&table, subterm)) != 1) {
+                continue;
+            }
+            if(depth == stackSize) {
+                int newSize = stackSize ? stackSize * 2 : 256;
+                REVERKI_TERM **newStack = realloc(stack, newSize * sizeof(REVERKI_TERM *));
+                if(newStack == NULL) {
+                    result = -1;
+                    break;
+                }
+                stack = newStack;
+                stackSize = newSize;
+            }
+            *(stack + depth++) = subterm;
         }
-        else if(atom != NULL && atom->type == REVERKI_CONSTANT_TYPE) {
-            return reverki_make_constant(atom);
+        if(depth == 0) {
+            break;
         }
-        return NULL;
+        pair = *(stack + --depth);
+    }
+    free(stack);
+    if(result < 0) {
+        free(table.entries);
+        return EOF;
     }
 
-    return NULL;
+    // Print the term as reverki_write_term does, labelling each shared pair
+    int nextLabel = 0;
+    while(1) {
+        while(term->type == REVERKI_PAIR_TYPE) {
+            SHARE_ENTRY *entry = findShare(&table, term);
+            if(entry->count > 1) {
+                if(entry->label) {
+                    writeLabel(output, entry->label);
+                    break;
+                }
+                entry->label = ++nextLabel;
+                writeLabel(output, entry->label);
+                REVERKI_OUTPUT_PUT(output, '=');
+            }
+            if(pushUnparseFrame(&depth, term)) {
+                free(table.entries);
+                return EOF;
+            }
+            REVERKI_OUTPUT_PUT(output, '(');
+            term = term->value.pair.fst;
+        }
+        if(term->type != REVERKI_PAIR_TYPE) {
+            reverki_output_string(output, term->value.atom->pname);
+        }
+        while(depth > 0 && (unparseStack + depth - 1)->second) {
+            REVERKI_OUTPUT_PUT(output, ')');
+            depth--;
+        }
+        if(depth == 0) {
+            free(table.entries);
+            return 0;
+        }
+        (unparseStack + depth - 1)->second = 1;
+        REVERKI_OUTPUT_PUT(output, ' ');
+        term = (unparseStack + depth - 1)->pair->value.pair.snd;
+    }
 }
 
 /*
@@ -272,25 +942,12 @@ REVERKI_TERM *reverki_parse_term(FILE *in) {
  * @return  0 if output was successful, EOF if not.
  */
 int reverki_unparse_term(REVERKI_TERM *term, FILE *out) {
-    if(term->type == REVERKI_PAIR_TYPE) {
-        fprintf(out, "(");
-        if(term->value.pair.fst->type == REVERKI_PAIR_TYPE) {
-            reverki_unparse_term(term->value.pair.fst, out);
-            fprintf(out, " ");
-        } else {
-            fprintf(out, "%s ", term->value.pair.fst->value.atom->pname);
-        }
-
-        if(term->value.pair.snd->type == REVERKI_PAIR_TYPE) {
-            reverki_unparse_term(term->value.pair.snd, out);
-        } else {
-            reverki_unparse_atom(term->value.pair.snd->value.atom, out);
-        }
-        fprintf(out, ")");
-    } else if(term->type == REVERKI_CONSTANT_TYPE || term->type == REVERKI_VARIABLE_TYPE) {
-        fprintf(out, "%s", term->value.atom->pname);
-    } else {
+    char buffer[UNPARSE_BUFFER_SIZE];
+    REVERKI_OUTPUT output;
+    reverki_output_wrap(&output, out, buffer, UNPARSE_BUFFER_SIZE);
+    int result = reverki_write_term(&output, term);
+    if(reverki_output_close(&output)) {
         return EOF;
     }
-    return 0;
+    return result;
 }
\ No newline at end of file
@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "reverki.h"
+#include "global.h"
+#include "write.h"
+
+/*
+ * Binary trace (-T).  Instead of printing the text of every term involved in a
+ * step, each step is written as one compact record that refers to the rule
+ * used by its number, and to terms by their numbers.  A term is numbered the
+ * first time a record refers to it, and a record defining it (and any of its
+ * subterms not yet numbered) is written just before.  Numbers are written as
+ * unsigned LEB128 varints: seven bits to a byte, least significant first, with
+ * the top bit set on every byte but the last.  The text of the trace, exactly
+ * as -t would print it, is produced afterwards by bin/reverki_render.
+ *
+ * Records written by tasks of the pool, or for the terms of a batch, go to
+ * buffers that are later copied into the file, so a record defining a term may
+ * appear in the file after a record that uses it; the renderer reads all the
+ * definitions before rendering anything.  Numbers are never reused, and when
+ * terms are reclaimed their numbers are forgotten, so that a new term at the
+ * same address is numbered afresh.
+ */
+#define TRACE_BUFFER_SIZE (1 << 20)
+#define TRACE_RECORD_SIZE (16 + 20 * (REVERKI_MAX_BINDINGS + 4))
+
+typedef struct trace_number {
+    REVERKI_TERM *term;            // The term, or NULL if the entry is empty.
+    unsigned long number;          // Its number.
+} TRACE_NUMBER;
+
+char *reverki_trace_path = NULL;
+FILE *reverki_trace_file = NULL;
+
+static TRACE_NUMBER *traceNumbers = NULL;
+static unsigned long traceNumbersSize = 0;
+static unsigned long traceNumbersUsed = 0;
+static unsigned long nextNumber = 0;
+static REVERKI_TERM **numberStack = NULL;
+static int numberStackSize = 0;
+
+/**
+ * @brief appends a number to a record as a varint
+ *
+ * @param p Where the number is to be stored
+ * @param n The number
+ * @return unsigned char* The position just after the number
+ */
+static unsigned char *putNumber(unsigned char *p, unsigned long n) {
+    while(n >= 0x80) {
+        *p++ = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    *p++ = n;
+    return p;
+}
+
+/**
+ * @brief finds the entry of the number table for a term, or the empty entry
+ * where it should be entered
+ *
+ * @param term The term
+ * @return TRACE_NUMBER* The entry
+ */
+static TRACE_NUMBER *findNumber(REVERKI_TERM *term) {
+    unsigned long mask = traceNumbersSize - 1;
+    unsigned long h = (unsigned long)term * 0x9e3779b97f4a7c15UL;
+    unsigned long index = (h >> 32) & mask;
+    while((traceNumbers + index)->term != NULL && (traceNumbers + index)->term != term) {
+        index = (index + 1) & mask;
+    }
+    return traceNumbers + index;
+}
+
+/**
+ * @brief rebuilds the number table with a specified size, keeping only the
+ * entries for terms that have not been reclaimed
+ *
+ * @param newSize The new size, a power of 2
+ */
+static void rebuildNumbers(unsigned long newSize) {
+    TRACE_NUMBER *oldNumbers = traceNumbers;
+    unsigned long oldSize = traceNumbersSize;
+    if((traceNumbers = calloc(newSize, sizeof(TRACE_NUMBER))) == NULL) {
+        fprintf(stderr, "Could not allocate trace table\n");
+        abort();
+    }
+    traceNumbersSize = newSize;
+    traceNumbersUsed = 0;
+    for(unsigned long i = 0; i < oldSize; i++) {
+        TRACE_NUMBER *entry = oldNumbers + i;
+        if(entry->term != NULL && entry->term->type != REVERKI_NO_TYPE) {
+            *findNumber(entry->term) = *entry;
+            traceNumbersUsed++;
+        }
+    }
+    free(oldNumbers);
+}
+
+/**
+ * @brief gives the next number to a term whose subterms have all been
+ * numbered, writing the record that defines it
+ *
+ * @param out The stream to which the record is written
+ * @param term The term
+ */
+static void defineTerm(FILE *out, REVERKI_TERM *term) {
+    unsigned char record[TRACE_RECORD_SIZE];
+    unsigned char *p = record;
+    if((traceNumbersUsed + 1) * 2 > traceNumbersSize) {
+        rebuildNumbers(traceNumbersSize ? traceNumbersSize * 2 : 4096);
+    }
+    TRACE_NUMBER *entry = findNumber(term);
+    entry->term = term;
+    entry->number = nextNumber++;
+    traceNumbersUsed++;
+
+    if(term->type == REVERKI_PAIR_TYPE) {
+        *p++ = REVERKI_TRACE_PAIR;
+        p = putNumber(p, entry->number);
+        p = putNumber(p, findNumber(term->value.pair.fst)->number);
+        p = putNumber(p, findNumber(term->value.pair.snd)->number);
+    } else {
+        char *pname = term->value.atom->pname;
+        int length = 0;
+        while(*(pname + length) != '\0') {
+            length++;
+        }
+        *p++ = REVERKI_TRACE_ATOM;
+        p = putNumber(p, entry->number);
+        p = putNumber(p, length);
+        for(int i = 0; i < length; i++) {
+            *p++ = *(pname + i);
+        }
+    }
+    fwrite(record, 1, p - record, out);
+}
+
+/**
+ * @brief returns the number of a term, first numbering it and any of its
+ * subterms not yet numbered, subterms first, using an explicit stack
+ *
+ * @param out The stream to which records defining terms are written
+ * @param term The term
+ * @return unsigned long The number of the term
+ */
+static unsigned long numberTerm(FILE *out, REVERKI_TERM *term) {
+    if(traceNumbersSize > 0 && findNumber(term)->term != NULL) {
+        return findNumber(term)->number;
+    }
+    int depth = 0;
+    REVERKI_TERM *top = term;
+    while(1) {
+        if(traceNumbersSize == 0 || findNumber(top)->term == NULL) {
+            // Number the subterms first, then come back to this term
+            REVERKI_TERM *next = NULL;
+            if(top->type == REVERKI_PAIR_TYPE) {
+                if(traceNumbersSize == 0 || findNumber(top->value.pair.fst)->term == NULL) {
+                    next = top->value.pair.fst;
+                } else if(findNumber(top->value.pair.snd)->term == NULL) {
+                    next = top->value.pair.snd;
+                }
+            }
+            if(next != NULL) {
+                if(depth == numberStackSize) {
+                    int newSize = numberStackSize ? numberStackSize * 2 : 1024;
+                    REVERKI_TERM **newStack = realloc(numberStack, newSize * sizeof(REVERKI_TERM *));
+                    if(newStack == NULL) {
+                        fprintf(stderr, "Could not allocate trace stack\n");
+                        abort();
+                    }
+                    numberStack = newStack;
+                    numberStackSize = newSize;
+                }
+                *(numberStack + depth++) = top;
+                top = next;
+                continue;
+            }
+            defineTerm(out, top);
+        }
+        if(depth == 0) {
+            return findNumber(term)->number;
+        }
+        top = *(numberStack + --depth);
+    }
+}
+
+/*
+ * @brief  Start writing a binary trace to a file.
+ * @param path  The name of the file.
+ * @return  0 if successful, -1 if the file could not be opened.
+ */
+int reverki_tracefile_open(char *path) {
+    if((reverki_trace_file = fopen(path, "wb")) == NULL) {
+        fprintf(stderr, "Could not open trace file %s\n", path);
+        return -1;
+    }
+    setvbuf(reverki_trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    fputs(REVERKI_TRACE_MAGIC, reverki_trace_file);
+    fputc(REVERKI_TRACE_VERSION, reverki_trace_file);
+    return 0;
+}
+
+/*
+ * @brief  Finish writing a binary trace.
+ * @return  0 if successful, EOF if the file could not be written.
+ */
+int reverki_tracefile_close() {
+    if(reverki_trace_file == NULL) {
+        return 0;
+    }
+    int result = fclose(reverki_trace_file);
+    reverki_trace_file = NULL;
+    free(traceNumbers);
+    free(numberStack);
+    traceNumbers = NULL;
+    numberStack = NULL;
+    traceNumbersSize = traceNumbersUsed = 0;
+    numberStackSize = 0;
+    if(result) {
+        fprintf(stderr, "Could not write trace file\n");
+    }
+    return result;
+}
+
+/*
+ * @brief  Write a record for each rule, in the order in which they were read.
+ * @details  These are rendered as the lines "# [lhs, rhs]" that begin a trace.
+ * @param out  The stream to which the records are written.
+ */
+void reverki_tracefile_rules(FILE *out) {
+    unsigned char record[TRACE_RECORD_SIZE];
+    for(int i = 0; i < *pRuleCounter; i++) {
+        REVERKI_RULE *rule = reverki_arena_get(&reverki_rule_arena, i);
+        unsigned char *p = record;
+        *p++ = REVERKI_TRACE_RULE;
+        p = putNumber(p, numberTerm(out, rule->lhs));
+        p = putNumber(p, numberTerm(out, rule->rhs));
+        fwrite(record, 1, p - record, out);
+    }
+}
+
+/*
+ * @brief  Write a record for a term about to be rewritten.
+ * @details  This is rendered as the line "# term" followed by the term and
+ * its subterms, one per line, as reverki_trace prints them.
+ * @param out  The stream to which the record is written.
+ * @param term  The term.
+ */
+void reverki_tracefile_term(FILE *out, REVERKI_TERM *term) {
+    unsigned char record[TRACE_RECORD_SIZE];
+    unsigned char *p = record;
+    reverki_lock(REVERKI_TRACE_LOCK);
+    unsigned long number = numberTerm(out, term);
+    reverki_unlock(REVERKI_TRACE_LOCK);
+    *p++ = REVERKI_TRACE_TERM;
+    p = putNumber(p, number);
+    fwrite(record, 1, p - record, out);
+}
+
+/*
+ * @brief  Write a record for a rewriting step.
+ * @details  This is rendered as -t would print the step: the subterm rewritten,
+ * the rule and substitution used, and the term it was replaced by.
+ * @param out  The stream to which the record is written.
+ * @param step  The number of the step, counting from 0.
+ * @param tgt  The subterm rewritten.
+ * @param rule  The rule used.
+ * @param subst  The substitution used.
+ * @param result  The term that replaces tgt.
+ * @param index  The depth of tgt in the term being rewritten.
+ */
+void reverki_tracefile_step(FILE *out, unsigned int step, REVERKI_TERM *tgt, REVERKI_RULE *rule,
+                            REVERKI_SUBST *subst, REVERKI_TERM *result, int index) {
+    unsigned char record[TRACE_RECORD_SIZE];
+    unsigned char *p = record;
+    *p++ = REVERKI_TRACE_STEP;
+    p = putNumber(p, step);
+    p = putNumber(p, index);
+    p = putNumber(p, reverki_arena_index(&reverki_rule_arena, rule));
+    reverki_lock(REVERKI_TRACE_LOCK);
+    p = putNumber(p, numberTerm(out, tgt));
+    p = putNumber(p, numberTerm(out, result));
+    p = putNumber(p, subst->count);
+    for(int i = 0; i < subst->count; i++) {
+        p = putNumber(p, numberTerm(out, *(subst->vars + i)));
+        p = putNumber(p, numberTerm(out, *(subst->values + i)));
+    }
+    reverki_unlock(REVERKI_TRACE_LOCK);
+    fwrite(record, 1, p - record, out);
+}
+
+/*
+ * @brief  Forget the numbers of reclaimed terms.
+ * @details  This must be called after reverki_sweep_terms and before any new
+ * term is created, while reclaimed terms can still be recognized by their
+ * type REVERKI_NO_TYPE.
+ */
+void reverki_tracefile_sweep() {
+    if(traceNumbers != NULL) {
+        rebuildNumbers(traceNumbersSize);
+    }
+}
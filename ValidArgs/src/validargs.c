@@ -81,6 +81,26 @@ long stringToLong(char *a) {
     return currNum;
 }
 
+/**
+ * @brief Recognizes the --stats-format option
+ *
+ * @param arg The argument
+ * @return int 0 if the argument selects the text format, 1 if it selects JSON,
+ * or -1 if it is not a --stats-format option with a valid format
+ */
+static int statsFormat(char *arg) {
+    if(equalStrings(arg, "--stats-format=text\0")) {
+        return 0;
+    }
+    if(equalStrings(arg, "--stats-format=json\0")) {
+        return 1;
+    }
+    return -1;
+}
+
+// File to which the input is to be compiled, if -c is specified
+char *reverki_compile_path = NULL;
+
 /**
  * @brief Validates command line arguments passed to the program.
  * @details This function will validate all the arguments passed to the
@@ -112,10 +132,23 @@ int validargs(int argc, char **argv) {
     // Check if the second argument is "-v"
     } else if(equalStrings(*argv, "-v\0")) {
         argv++;
-        int useS = 0;
+        int useS = 0, useC = 0, useF = 0;
         local_options = VALIDATE_OPTION;
         for(int i = 2; i < argc; i++) {
-            if(!equalStrings(*argv, "-s\0") || equalStrings(*argv, "-v\0") || (equalStrings(*argv, "-s\0") && useS)) {
+            if(equalStrings(*argv, "-c\0") && !useC) {
+                argv++;
+                i++;
+                if(i >= argc) {
+                    fprintf(stderr, "Missing file for -c\n");
+                    return -1;
+                }
+                reverki_compile_path = *argv;
+                local_options += COMPILE_OPTION;
+                useC = 1;
+            } else if(statsFormat(*argv) >= 0 && !useF) {
+                local_options += statsFormat(*argv) ? STATS_JSON_OPTION : 0;
+                useF = 1;
+            } else if(!equalStrings(*argv, "-s\0") || equalStrings(*argv, "-v\0") || (equalStrings(*argv, "-s\0") && useS)) {
                 local_options = 0;
                 fprintf(stderr, "Invalid argument for -v\n");
                 return -1;
@@ -127,13 +160,16 @@ int validargs(int argc, char **argv) {
             }
             argv++;
         }
+        if(useF && !useS) {
+            local_options += STATISTICS_OPTION;
+        }
         global_options = local_options;
         return 0;
 
     /* Check if second argument is "-r" */
     } else if(equalStrings(*argv, "-r\0")) {
         argv++;
-        int useL = 0, useS = 0, useT = 0;
+        int useL = 0, useS = 0, useT = 0, useM = 0, useI = 0, useG = 0, useStrategy = 0, useJ = 0, useB = 0, useC = 0, useD = 0, useF = 0;
         local_options = REWRITE_OPTION;
         for(int i = 2; i < argc; i++) {
             if(equalStrings(*argv, "-l\0") && !useL) {
@@ -151,9 +187,75 @@ int validargs(int argc, char **argv) {
             } else if(equalStrings(*argv, "-s\0") && !useS) {
                local_options += STATISTICS_OPTION;
                useS = 1;
+            } else if(statsFormat(*argv) >= 0 && !useF) {
+                local_options += statsFormat(*argv) ? STATS_JSON_OPTION : 0;
+                useF = 1;
             } else if(equalStrings(*argv, "-t\0") && !useT) {
                 local_options += TRACE_OPTION;
                 useT = 1;
+            } else if(equalStrings(*argv, "-T\0") && !useT) {
+                argv++;
+                i++;
+                if(i >= argc) {
+                    local_options = 0;
+                    fprintf(stderr, "Missing file for -T\n");
+                    return -1;
+                }
+                reverki_trace_path = *argv;
+                local_options += TRACE_OPTION;
+                useT = 1;
+            } else if(equalStrings(*argv, "-c\0") && !useC) {
+                argv++;
+                i++;
+                if(i >= argc) {
+                    local_options = 0;
+                    fprintf(stderr, "Missing file for -c\n");
+                    return -1;
+                }
+                reverki_compile_path = *argv;
+                local_options += COMPILE_OPTION;
+                useC = 1;
+            } else if(equalStrings(*argv, "-b\0") && !useB) {
+                local_options += BATCH_OPTION;
+                useB = 1;
+            } else if(equalStrings(*argv, "-d\0") && !useD) {
+                local_options += SHARED_OPTION;
+                useD = 1;
+            } else if(equalStrings(*argv, "-m\0") && !useM) {
+                local_options += MEMO_OPTION;
+                useM = 1;
+            } else if(equalStrings(*argv, "-i\0") && !useI) {
+                local_options += INCREMENTAL_OPTION;
+                useI = 1;
+            } else if(equalStrings(*argv, "-g\0") && !useG) {
+                local_options += GRAPH_OPTION;
+                useG = 1;
+            } else if(equalStrings(*argv, "-S\0") && !useStrategy) {
+                argv++;
+                i++;
+                if(i < argc && equalStrings(*argv, "innermost\0")) {
+                    local_options += INNERMOST_STRATEGY;
+                } else if(i < argc && equalStrings(*argv, "outermost\0")) {
+                    local_options += OUTERMOST_STRATEGY;
+                } else if(i < argc && equalStrings(*argv, "parallel\0")) {
+                    local_options += PARALLEL_STRATEGY;
+                } else {
+                    local_options = 0;
+                    fprintf(stderr, "Invalid strategy\n");
+                    return -1;
+                }
+                useStrategy = 1;
+            } else if(equalStrings(*argv, "-j\0") && !useJ) {
+                argv++;
+                i++;
+                long jobs = isValidDigit(*argv) ? stringToLong(*argv) >> 32 : 0;
+                if(jobs < 1 || jobs > (JOBS_OPTION >> JOBS_SHIFT)) {
+                    local_options = 0;
+                    fprintf(stderr, "Invalid number of jobs\n");
+                    return -1;
+                }
+                local_options += jobs << JOBS_SHIFT;
+                useJ = 1;
             } else if(equalStrings(*argv, "<\0")) {
                 return 0;
             } else {
@@ -163,6 +265,9 @@ int validargs(int argc, char **argv) {
             }
             argv++;
         }
+        if(useF && !useS) {
+            local_options += STATISTICS_OPTION;
+        }
         global_options = local_options;
         return 0;
     }
@@ -93,3 +93,461 @@ Test(basecode_suite, reverki_basic_test) {
     cr_assert_eq(return_code, EXIT_SUCCESS,
                  "Program output did not match reference output.");
 }
+
+/*
+ * Rewrites an input with tracing, with and without some options, and checks
+ * that the results are the same, and that the traces are too if trace is set.
+ * The outputs are left in test_output, named after tag.
+ */
+static void assert_same_rewriting(char *input, char *options, char *tag, int trace) {
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "bin/reverki -r -t < %s > test_output/%s.ref.out 2> test_output/%s.ref.trace",
+	     input, tag, tag);
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    snprintf(cmd, sizeof(cmd), "bin/reverki -r -t %s < %s > test_output/%s.out 2> test_output/%s.trace",
+	     options, input, tag, tag);
+    return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS with %s",
+		 return_code, options);
+    snprintf(cmd, sizeof(cmd), "cmp test_output/%s.ref.out test_output/%s.out", tag, tag);
+    return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Result with %s did not match result without it.", options);
+    if(trace) {
+        snprintf(cmd, sizeof(cmd), "cmp test_output/%s.ref.trace test_output/%s.trace", tag, tag);
+        return_code = WEXITSTATUS(system(cmd));
+        cr_assert_eq(return_code, EXIT_SUCCESS,
+                     "Trace with %s did not match trace without it.", options);
+    }
+}
+
+Test(basecode_suite, incremental_test) {
+    assert_same_rewriting("rsrc/multiplication", "-i", "multiplication.incremental", 1);
+    assert_same_rewriting("rsrc/algebra", "-i", "algebra.incremental", 1);
+    assert_same_rewriting("rsrc/combinators", "-i", "combinators.incremental", 1);
+}
+
+Test(basecode_suite, graph_test) {
+    assert_same_rewriting("rsrc/multiplication", "-g", "multiplication.graph", 1);
+
+    // Shared subterms are traced only where they are first rewritten
+    assert_same_rewriting("rsrc/algebra", "-g", "algebra.graph", 0);
+    assert_same_rewriting("rsrc/combinators", "-g", "combinators.graph", 0);
+}
+
+Test(basecode_suite, strategy_test) {
+    assert_same_rewriting("rsrc/multiplication", "-S outermost", "multiplication.outermost", 1);
+    assert_same_rewriting("rsrc/multiplication", "-S parallel", "multiplication.parallel", 1);
+
+    // Elsewhere the redexes are rewritten in another order, traced as checked in
+    char *inputs[] = {"algebra", "combinators"};
+    char *strategies[] = {"outermost", "parallel"};
+    for(int i = 0; i < (int)(sizeof(inputs) / sizeof(char *)); i++) {
+        for(int j = 0; j < (int)(sizeof(strategies) / sizeof(char *)); j++) {
+            char input[64], options[64], tag[64], cmd[256];
+            snprintf(input, sizeof(input), "rsrc/%s", inputs[i]);
+            snprintf(options, sizeof(options), "-S %s", strategies[j]);
+            snprintf(tag, sizeof(tag), "%s.%s", inputs[i], strategies[j]);
+            assert_same_rewriting(input, options, tag, 0);
+            snprintf(cmd, sizeof(cmd), "cmp test_output/%s.trace tests/rsrc/%s.trace", tag, tag);
+            int return_code = WEXITSTATUS(system(cmd));
+            cr_assert_eq(return_code, EXIT_SUCCESS,
+                         "Trace with %s did not match tests/rsrc/%s.trace.", options, tag);
+        }
+    }
+}
+
+/*
+ * Writes a complete binary tree of the given depth, whose leaves are redexes.
+ */
+static void write_tree(FILE *out, int depth, int *leaves) {
+    if(depth == 0) {
+        fprintf(out, "(I (K a%d b))", (*leaves)++ % 7);
+        return;
+    }
+    fprintf(out, "(P ");
+    write_tree(out, depth - 1, leaves);
+    fprintf(out, " ");
+    write_tree(out, depth - 1, leaves);
+    fprintf(out, ")");
+}
+
+Test(basecode_suite, jobs_test) {
+    // Large enough that both sides of the pairs near the root are forked
+    FILE *out = fopen("test_output/trees", "w");
+    cr_assert_not_null(out, "Could not create test_output/trees");
+    int leaves = 0;
+    fprintf(out, "[(I x), x]\n[(K x y), x]\n(F ");
+    write_tree(out, 9, &leaves);
+    fprintf(out, " ");
+    write_tree(out, 9, &leaves);
+    fprintf(out, ")\n");
+    fclose(out);
+
+    assert_same_rewriting("test_output/trees", "-j 2", "trees.jobs2", 1);
+    assert_same_rewriting("test_output/trees", "-j 8", "trees.jobs8", 1);
+    assert_same_rewriting("rsrc/multiplication", "-j 4", "multiplication.jobs", 1);
+}
+
+Test(basecode_suite, tracefile_test) {
+    // Large enough for the trace to be written by several tasks with -j
+    FILE *out = fopen("test_output/trees.render", "w");
+    cr_assert_not_null(out, "Could not create test_output/trees.render");
+    int leaves = 0;
+    fprintf(out, "[(I x), x]\n[(K x y), x]\n(F ");
+    write_tree(out, 9, &leaves);
+    fprintf(out, " ");
+    write_tree(out, 9, &leaves);
+    fprintf(out, ")\n");
+    fclose(out);
+
+    // The binary trace, rendered, is the text that -t prints
+    char *inputs[] = {"rsrc/addition", "rsrc/algebra", "rsrc/combinators", "rsrc/multiplication",
+                      "test_output/trees.render"};
+    char *options[] = {"", "-j 2", "-b", "-b -j 2"};
+    for(int i = 0; i < (int)(sizeof(inputs) / sizeof(char *)); i++) {
+        for(int j = 0; j < (int)(sizeof(options) / sizeof(char *)); j++) {
+            char cmd[512];
+            snprintf(cmd, sizeof(cmd), "bin/reverki -r -t %s < %s > /dev/null 2> test_output/render.trace && "
+                     "bin/reverki -r -T test_output/render.bin %s < %s > /dev/null && "
+                     "bin/reverki_render test_output/render.bin | cmp - test_output/render.trace",
+		     options[j], inputs[i], options[j], inputs[i]);
+            int return_code = WEXITSTATUS(system(cmd));
+            cr_assert_eq(return_code, EXIT_SUCCESS,
+                         "Rendered trace of %s with '%s' did not match the trace printed by -t.",
+			 inputs[i], options[j]);
+        }
+    }
+}
+
+Test(basecode_suite, batch_test) {
+    // One result per term, in the order of the input, however many threads
+    char *cmd = "bin/reverki -r -b < rsrc/combinators > test_output/combinators.batch.out";
+    char *cmp = "cmp test_output/combinators.batch.out tests/rsrc/combinators.batch.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+
+    cmd = "bin/reverki -r -b -j 3 < rsrc/combinators > test_output/combinators.batch3.out";
+    cmp = "cmp test_output/combinators.batch3.out tests/rsrc/combinators.batch.out";
+    return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output with -j 3 did not match reference output.");
+}
+
+/*
+ * Writes the numeral for n, which is nested n deep.
+ */
+static void write_peano(FILE *out, int n) {
+    for(int i = 0; i < n; i++) {
+        fprintf(out, "(S ");
+    }
+    fprintf(out, "0");
+    for(int i = 0; i < n; i++) {
+        fprintf(out, ")");
+    }
+}
+
+/*
+ * Writes the rules for addition, followed by the numeral for n.
+ */
+static void write_numeral(char *path, int n) {
+    FILE *out = fopen(path, "w");
+    cr_assert_not_null(out, "Could not create %s", path);
+    fprintf(out, "[(+ x 0), x]\n[(+ x (S y)), (S (+ x y))]\n");
+    write_peano(out, n);
+    fprintf(out, "\n");
+    fclose(out);
+}
+
+Test(basecode_suite, parse_deep_test) {
+    write_numeral("test_output/numeral", 1000000);
+    char *cmd = "bin/reverki -v < test_output/numeral > /dev/null";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+}
+
+Test(basecode_suite, parse_error_test) {
+    // The program must fail, saying why
+    char *cmd = "printf '[(I x), x]\\n(I (S (S 0)\\n' > test_output/unterminated;"
+                "bin/reverki -v < test_output/unterminated > /dev/null 2> test_output/unterminated.err;"
+                "test $? -ne 0 && grep -q 'Unterminated term' test_output/unterminated.err";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "An unterminated term was not reported.");
+
+    cmd = "printf '[(I x), x]\\n(I ,x=(S 0))\\n' > test_output/label;"
+          "bin/reverki -v < test_output/label > /dev/null 2> test_output/label.err;"
+          "test $? -ne 0 && grep -q 'Invalid label' test_output/label.err";
+    return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "An invalid label was not reported.");
+}
+
+Test(basecode_suite, compile_test) {
+    char *cmd = "bin/reverki -v -c test_output/multiplication.rvk < rsrc/multiplication > /dev/null";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+
+    // Loading the compiled file gives the same rules and terms as the text
+    cmd = "bin/reverki -r < test_output/multiplication.rvk > test_output/multiplication.rvk.out";
+    char *cmp = "cmp test_output/multiplication.rvk.out tests/rsrc/multiplication.out";
+    return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+}
+
+Test(basecode_suite, compile_error_test) {
+    char *cmd = "bin/reverki -v -c test_output/addition.rvk < rsrc/addition > /dev/null";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+
+    cmd = "head -c 48 test_output/addition.rvk > test_output/truncated.rvk;"
+          "bin/reverki -r < test_output/truncated.rvk > /dev/null 2> test_output/truncated.err;"
+          "test $? -ne 0 && grep -q 'Invalid compiled file' test_output/truncated.err";
+    return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "A truncated compiled file was not rejected.");
+
+    // Everything after the header is overwritten, so no subterm is valid
+    cmd = "cp test_output/addition.rvk test_output/corrupted.rvk";
+    return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS, "Could not copy the compiled file.");
+    FILE *file = fopen("test_output/corrupted.rvk", "r+b");
+    cr_assert_not_null(file, "Could not open test_output/corrupted.rvk");
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 40, SEEK_SET);
+    for(long i = 40; i < size; i++) {
+        fputc(0xff, file);
+    }
+    fclose(file);
+    cmd = "bin/reverki -r < test_output/corrupted.rvk > /dev/null 2> test_output/corrupted.err;"
+          "test $? -ne 0 && grep -q 'Invalid compiled file' test_output/corrupted.err";
+    return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "A corrupted compiled file was not rejected.");
+}
+
+Test(basecode_suite, pipe_test) {
+    // Input that cannot be mapped is read in pieces, the large one in several
+    write_numeral("test_output/numeral.large", 400000);
+    char *cmd = "bin/reverki -v -c test_output/multiplication.pipe.rvk < rsrc/multiplication > /dev/null && "
+                "bin/reverki -v -c test_output/numeral.large.rvk < test_output/numeral.large > /dev/null && "
+                "bin/reverki -r < test_output/numeral.large > test_output/numeral.large.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+
+    char *cmds[] = {
+        "cat rsrc/multiplication | bin/reverki -r | cmp - tests/rsrc/multiplication.out",
+        "cat test_output/multiplication.pipe.rvk | bin/reverki -r | cmp - tests/rsrc/multiplication.out",
+        "cat test_output/numeral.large | bin/reverki -r | cmp - test_output/numeral.large.out",
+        "cat test_output/numeral.large.rvk | bin/reverki -r | cmp - test_output/numeral.large.out"
+    };
+    for(int i = 0; i < (int)(sizeof(cmds) / sizeof(char *)); i++) {
+        return_code = WEXITSTATUS(system(cmds[i]));
+        cr_assert_eq(return_code, EXIT_SUCCESS,
+                     "Program output did not match with: %s", cmds[i]);
+    }
+}
+
+Test(basecode_suite, print_deep_test) {
+    // No rule applies, so the numeral is printed as it was read
+    write_numeral("test_output/deep", 1000000);
+    char *cmd = "bin/reverki -r < test_output/deep > test_output/deep.out";
+    char *cmp = "tail -n 1 test_output/deep | cmp test_output/deep.out -";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match the numeral read.");
+}
+
+Test(basecode_suite, dag_test) {
+    // The result is a normal form, so reading it back with the same rules and
+    // rewriting it must give the result printed without labels
+    char *cmd = "bin/reverki -r < rsrc/algebra > test_output/algebra.plain.out &&"
+                "bin/reverki -r -d < rsrc/algebra > test_output/algebra.dag.out &&"
+                "grep '^\\[' rsrc/algebra | cat - test_output/algebra.dag.out > test_output/algebra.dag &&"
+                "bin/reverki -r < test_output/algebra.dag > test_output/algebra.reread.out";
+    char *cmp = "cmp test_output/algebra.reread.out test_output/algebra.plain.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    return_code = WEXITSTATUS(system("grep -q ',1=' test_output/algebra.dag.out"));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "No shared subterm was labelled.");
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output read back did not match output without -d.");
+}
+
+/*
+ * Checks that a file holds a single JSON object: braces and brackets outside
+ * strings nest properly, and nothing but white space follows the object.
+ */
+static int is_json_object(char *path) {
+    FILE *in = fopen(path, "r");
+    if(in == NULL) {
+        return 0;
+    }
+    char open[64];
+    int depth = 0, seen = 0, valid = 1, c;
+    while(valid && (c = fgetc(in)) != EOF) {
+        if(seen && depth == 0) {
+            valid = c == ' ' || c == '\n';
+        } else if(c == '"') {
+            while((c = fgetc(in)) != EOF && c != '"') {
+                if(c == '\\') {
+                    fgetc(in);
+                }
+            }
+            valid = c == '"' && depth > 0;
+        } else if(c == '{' || c == '[') {
+            valid = depth < (int)sizeof(open) && (depth > 0 || c == '{');
+            if(valid) {
+                open[depth++] = c;
+            }
+            seen = 1;
+        } else if(c == '}' || c == ']') {
+            valid = depth > 0 && open[--depth] == (c == '}' ? '{' : '[');
+        } else {
+            valid = depth > 0 || c == ' ' || c == '\n';
+        }
+    }
+    fclose(in);
+    return valid && seen && depth == 0;
+}
+
+Test(basecode_suite, stats_json_test) {
+    char *cmd = "bin/reverki -r -m --stats-format=json < rsrc/algebra > /dev/null 2> test_output/algebra.json";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+
+    // The statistics must be a single JSON object with the figures for each rule
+    cr_assert(is_json_object("test_output/algebra.json"),
+              "Statistics were not a single JSON object.");
+    cmd = "grep -q '\"memo\": {' test_output/algebra.json && "
+          "test $(grep -o '\"fired\": [0-9]*' test_output/algebra.json | wc -l) -eq 14";
+    return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Statistics did not cover the cache and every rule.");
+}
+
+Test(basecode_suite, collection_test) {
+    // The product of two numerals makes enough terms to need collections
+    FILE *out = fopen("test_output/product", "w");
+    cr_assert_not_null(out, "Could not create test_output/product");
+    fprintf(out, "[(+ x 0), x]\n[(+ x (S y)), (S (+ x y))]\n[(* x 0), 0]\n[(* x (S y)), (+ x (* x y))]\n(* ");
+    write_peano(out, 20);
+    fprintf(out, " ");
+    write_peano(out, 20);
+    fprintf(out, ")\n");
+    fclose(out);
+    out = fopen("test_output/product.exp", "w");
+    cr_assert_not_null(out, "Could not create test_output/product.exp");
+    write_peano(out, 400);
+    fprintf(out, "\n");
+    fclose(out);
+
+    char *cmd = "bin/reverki -r --stats-format=json < test_output/product > test_output/product.out "
+                "2> test_output/product.json";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    return_code = WEXITSTATUS(system("grep -q '\"collections\": [1-9]' test_output/product.json"));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "No garbage collection was performed.");
+    return_code = WEXITSTATUS(system("cmp test_output/product.out test_output/product.exp"));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match the product.");
+
+    // Collections also sweep the normal-form cache, and wait for every task of a batch
+    char *options[] = {"-m", "-i", "-g", "-b -j 2"};
+    for(int i = 0; i < (int)(sizeof(options) / sizeof(char *)); i++) {
+        char line[256];
+        snprintf(line, sizeof(line), "bin/reverki -r %s < test_output/product | cmp - test_output/product.exp",
+		 options[i]);
+        return_code = WEXITSTATUS(system(line));
+        cr_assert_eq(return_code, EXIT_SUCCESS,
+                     "Program output with %s did not match the product.", options[i]);
+    }
+}
+
+Test(basecode_suite, memo_test) {
+    // Only the numeral is rewritten, and the tree beside it is a normal form
+    FILE *out = fopen("test_output/countdown", "w");
+    cr_assert_not_null(out, "Could not create test_output/countdown");
+    int leaves = 0;
+    fprintf(out, "[(D (S x)), (D x)]\n(Q (D ");
+    write_peano(out, 200);
+    fprintf(out, ") ");
+    write_tree(out, 10, &leaves);
+    fprintf(out, ")\n");
+    fclose(out);
+
+    assert_same_rewriting("test_output/countdown", "-m", "countdown.memo", 1);
+    char *cmd = "bin/reverki -r -m --stats-format=json < test_output/countdown > /dev/null "
+                "2> test_output/countdown.json";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    return_code = WEXITSTATUS(system("grep -q '\"probe_hits\": [1-9]' test_output/countdown.json"));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "No subterm was found in the normal-form cache.");
+}
+
+/*
+ * Rewrites an input with some options, and compares the result with a
+ * reference output.
+ */
+static void assert_rewrites_to(char *input, char *options, char *expected) {
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "bin/reverki -r %s < %s | cmp - %s", options, input, expected);
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output for %s with '%s' did not match %s.",
+		 input, options, expected);
+}
+
+Test(basecode_suite, automaton_test) {
+    // The ground rule [0, I] applies, as do the rules of algebra in order
+    assert_rewrites_to("rsrc/combinators", "", "tests/rsrc/combinators.rewrite.out");
+    assert_rewrites_to("rsrc/algebra", "", "tests/rsrc/algebra.rewrite.out");
+
+    // A repeated variable matches equal subterms only, and the rule read last
+    // is tried first, so (E x y) applies only where (E x x) does not
+    assert_rewrites_to("rsrc/nonlinear", "-b", "tests/rsrc/nonlinear.out");
+    assert_rewrites_to("rsrc/nonlinear", "-b -i", "tests/rsrc/nonlinear.out");
+}